@@ -0,0 +1,444 @@
+#include "batch.h"
+#include "bfjit.h"
+#include "parser.h"
+#include "runtime.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ *  batch mode
+ *
+ *  The manifest holds one job per line:
+ *
+ *      <program path> <input path> <output path>
+ *
+ *  Empty lines and lines starting with '#' are skipped. Jobs are split into
+ *  contiguous ranges, one per worker thread. A worker that runs out of jobs
+ *  steals the upper half of another worker's remaining range. Each distinct
+ *  program path is compiled once, by the first worker that needs it, and
+ *  the read+exec code is shared by all workers. Workers reset only the
+ *  dirty part of their tape between jobs. With --fork the workers are
+ *  processes instead of threads.
+ *
+ */
+
+#define BATCH_TAPE_CELLS 30000
+#define BATCH_IO_BUFFER_SIZE (1 << 16)
+
+typedef struct {
+    const char* path;
+    pthread_mutex_t lock;
+    bool compiled;
+    bool valid;
+    BfjitProgram program;
+} BatchProgram;
+
+typedef struct {
+    const char* input_path;
+    const char* output_path;
+    size_t program;
+} BatchJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+} WorkQueue;
+
+typedef struct {
+    char* manifest;
+    BatchJob* jobs;
+    size_t jobs_length;
+    BatchProgram* programs;
+    size_t programs_length;
+    WorkQueue* queues;
+    int worker_count;
+    BfjitOptions options;
+} Batch;
+
+typedef struct {
+    Batch* batch;
+    int id;
+    size_t failed;
+    pthread_t thread;
+} Worker;
+
+static size_t batch_find_program(Batch* batch, const char* path)
+{
+    for (size_t i = 0; i < batch->programs_length; ++i) {
+        if (strcmp(batch->programs[i].path, path) == 0) {
+            return i;
+        }
+    }
+    BatchProgram* program = &batch->programs[batch->programs_length];
+    *program = (BatchProgram) {
+        .path = path,
+        .compiled = false,
+        .valid = false,
+    };
+    pthread_mutex_init(&program->lock, NULL);
+    batch->programs_length += 1;
+    return batch->programs_length - 1;
+}
+
+static void batch_parse_manifest(Batch* batch, const char* manifest_path)
+{
+    size_t manifest_length;
+    batch->manifest = read_source(manifest_path, &manifest_length);
+    if (batch->manifest == NULL) {
+        fprintf(
+            stderr, "panic: could not open manifest \"%s\"\n", manifest_path
+        );
+        exit(1);
+    }
+    size_t lines = 1;
+    for (const char* c = batch->manifest; *c != '\0'; ++c) {
+        lines += *c == '\n';
+    }
+    batch->jobs = malloc(sizeof(BatchJob) * lines);
+    batch->programs = malloc(sizeof(BatchProgram) * lines);
+    batch->jobs_length = 0;
+    batch->programs_length = 0;
+
+    char* line_state;
+    int line_number = 0;
+    for (char* line = strtok_r(batch->manifest, "\n", &line_state);
+         line != NULL;
+         line = strtok_r(NULL, "\n", &line_state)) {
+        line_number += 1;
+        char* field_state;
+        char* fields[4];
+        int fields_length = 0;
+        for (char* field = strtok_r(line, " \t\r", &field_state);
+             field != NULL && fields_length < 4;
+             field = strtok_r(NULL, " \t\r", &field_state)) {
+            fields[fields_length] = field;
+            fields_length += 1;
+        }
+        if (fields_length == 0 || fields[0][0] == '#') {
+            continue;
+        }
+        if (fields_length != 3) {
+            fprintf(
+                stderr,
+                "panic: manifest line %d: expected <program> <input> "
+                "<output>\n",
+                line_number
+            );
+            exit(1);
+        }
+        batch->jobs[batch->jobs_length] = (BatchJob) {
+            .input_path = fields[1],
+            .output_path = fields[2],
+            .program = batch_find_program(batch, fields[0]),
+        };
+        batch->jobs_length += 1;
+    }
+}
+
+static bool batch_compile(
+    BatchProgram* program, const BfjitOptions* options
+)
+{
+    size_t length;
+    char* source = read_source(program->path, &length);
+    if (source == NULL) {
+        return false;
+    }
+    bool valid = bfjit_compile(&program->program, source, length, options);
+    free(source);
+    return valid;
+}
+
+static const BfjitProgram* batch_program_get(
+    Batch* batch, BatchProgram* program
+)
+{
+    pthread_mutex_lock(&program->lock);
+    if (!program->compiled) {
+        program->valid = batch_compile(program, &batch->options);
+        if (!program->valid) {
+            fprintf(
+                stderr,
+                "batch: could not compile \"%s\"\n",
+                program->path
+            );
+        }
+        program->compiled = true;
+    }
+    pthread_mutex_unlock(&program->lock);
+    return program->valid ? &program->program : NULL;
+}
+
+static bool batch_run_job(Batch* batch, BatchJob* job, BfjitTape* tape)
+{
+    const BfjitProgram* program
+        = batch_program_get(batch, &batch->programs[job->program]);
+    if (program == NULL) {
+        return false;
+    }
+    FILE* input = fopen(job->input_path, "rb");
+    if (!input) {
+        fprintf(
+            stderr, "batch: could not open input \"%s\"\n", job->input_path
+        );
+        return false;
+    }
+    FILE* output = fopen(job->output_path, "wb");
+    if (!output) {
+        fprintf(
+            stderr,
+            "batch: could not open output \"%s\"\n",
+            job->output_path
+        );
+        fclose(input);
+        return false;
+    }
+    setvbuf(input, NULL, _IOFBF, BATCH_IO_BUFFER_SIZE);
+    setvbuf(output, NULL, _IOFBF, BATCH_IO_BUFFER_SIZE);
+
+    bfjit_tape_reset(tape);
+    RuntimeStreams streams = { .input = input, .output = output };
+    BfjitIo io = bfjit_stdio(&streams);
+    RunStatus status = bfjit_run(program, tape, &io);
+    if (status == RunStatus_OutOfFuel) {
+        fprintf(
+            stderr,
+            "batch: \"%s\" ran out of fuel on \"%s\"\n",
+            batch->programs[job->program].path,
+            job->input_path
+        );
+    }
+
+    fclose(input);
+    return fclose(output) == 0 && status == RunStatus_Finished;
+}
+
+static bool work_queue_pop(WorkQueue* queue, size_t* job)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head < queue->tail;
+    if (found) {
+        *job = queue->head;
+        queue->head += 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static bool batch_steal(Batch* batch, int thief, size_t* job)
+{
+    for (int i = 1; i < batch->worker_count; ++i) {
+        WorkQueue* victim = &batch->queues[(thief + i) % batch->worker_count];
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->tail - victim->head;
+        if (remaining == 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        size_t start = victim->tail - (remaining + 1) / 2;
+        size_t end = victim->tail;
+        victim->tail = start;
+        pthread_mutex_unlock(&victim->lock);
+
+        WorkQueue* own = &batch->queues[thief];
+        pthread_mutex_lock(&own->lock);
+        own->head = start + 1;
+        own->tail = end;
+        pthread_mutex_unlock(&own->lock);
+        *job = start;
+        return true;
+    }
+    return false;
+}
+
+static void* batch_worker(void* data)
+{
+    Worker* worker = data;
+    Batch* batch = worker->batch;
+    BfjitTape tape;
+    bfjit_tape_construct(
+        &tape, BATCH_TAPE_CELLS * (size_t)batch->options.cell_width
+    );
+    size_t job;
+    while (work_queue_pop(&batch->queues[worker->id], &job)
+           || batch_steal(batch, worker->id, &job)) {
+        if (!batch_run_job(batch, &batch->jobs[job], &tape)) {
+            fprintf(stderr, "batch: job %zu failed\n", job + 1);
+            worker->failed += 1;
+        }
+    }
+    bfjit_tape_destroy(&tape);
+    return NULL;
+}
+
+static size_t batch_run_threads(Batch* batch)
+{
+    int worker_count = batch->worker_count;
+    batch->queues = malloc(sizeof(WorkQueue) * (size_t)worker_count);
+    Worker* workers = malloc(sizeof(Worker) * (size_t)worker_count);
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_mutex_init(&batch->queues[i].lock, NULL);
+        batch->queues[i].head
+            = batch->jobs_length * (size_t)i / (size_t)worker_count;
+        batch->queues[i].tail
+            = batch->jobs_length * (size_t)(i + 1) / (size_t)worker_count;
+        workers[i] = (Worker) { .batch = batch, .id = i, .failed = 0 };
+    }
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_create(&workers[i].thread, NULL, batch_worker, &workers[i]);
+    }
+    size_t failed = 0;
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        failed += workers[i].failed;
+    }
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_mutex_destroy(&batch->queues[i].lock);
+    }
+    free(workers);
+    free(batch->queues);
+    return failed;
+}
+
+/*
+ *  process workers
+ *
+ *  Every program is compiled up front into a sealed memfd before forking,
+ *  so all worker processes execute the same physical copy of the code.
+ *  Jobs are handed out through a counter in a shared anonymous mapping.
+ *
+ */
+
+typedef struct {
+    atomic_size_t next_job;
+    atomic_size_t failed;
+} SharedProgress;
+
+static void batch_process_worker(Batch* batch, SharedProgress* progress)
+{
+    BfjitTape tape;
+    bfjit_tape_construct(
+        &tape, BATCH_TAPE_CELLS * (size_t)batch->options.cell_width
+    );
+    size_t job;
+    while ((job = atomic_fetch_add(&progress->next_job, 1))
+           < batch->jobs_length) {
+        if (!batch_run_job(batch, &batch->jobs[job], &tape)) {
+            fprintf(stderr, "batch: job %zu failed\n", job + 1);
+            atomic_fetch_add(&progress->failed, 1);
+        }
+    }
+    bfjit_tape_destroy(&tape);
+}
+
+static size_t batch_run_processes(Batch* batch)
+{
+    BfjitOptions options = batch->options;
+    options.shared = true;
+    for (size_t i = 0; i < batch->programs_length; ++i) {
+        BatchProgram* program = &batch->programs[i];
+        program->valid = batch_compile(program, &options);
+        if (!program->valid) {
+            fprintf(
+                stderr,
+                "batch: could not compile \"%s\"\n",
+                program->path
+            );
+        }
+        program->compiled = true;
+    }
+
+    SharedProgress* progress = mmap(
+        NULL,
+        sizeof(SharedProgress),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    if (progress == MAP_FAILED) {
+        fprintf(stderr, "panic: could not mmap\n");
+        exit(1);
+    }
+    atomic_init(&progress->next_job, 0);
+    atomic_init(&progress->failed, 0);
+
+    fflush(NULL);
+    for (int i = 0; i < batch->worker_count; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "panic: could not fork\n");
+            exit(1);
+        }
+        if (pid == 0) {
+            batch_process_worker(batch, progress);
+            fflush(NULL);
+            _exit(0);
+        }
+    }
+    size_t failed = 0;
+    int status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "batch: worker process died\n");
+            failed += 1;
+        }
+    }
+    failed += atomic_load(&progress->failed);
+    munmap(progress, sizeof(SharedProgress));
+    return failed;
+}
+
+size_t batch_run(
+    const char* manifest_path,
+    int worker_count,
+    bool processes,
+    const BfjitOptions* options
+)
+{
+    double start = stats_now();
+    Batch batch;
+    batch.options = *options;
+    batch_parse_manifest(&batch, manifest_path);
+    if (worker_count <= 0) {
+        worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ((size_t)worker_count > batch.jobs_length) {
+        worker_count = batch.jobs_length > 0 ? (int)batch.jobs_length : 1;
+    }
+    batch.worker_count = worker_count;
+    size_t failed
+        = processes ? batch_run_processes(&batch) : batch_run_threads(&batch);
+
+    fprintf(
+        stderr,
+        "batch: %zu jobs, %zu programs, %zu failed, %d %s, %.3f s\n",
+        batch.jobs_length,
+        batch.programs_length,
+        failed,
+        worker_count,
+        processes ? "processes" : "workers",
+        stats_now() - start
+    );
+
+    for (size_t i = 0; i < batch.programs_length; ++i) {
+        pthread_mutex_destroy(&batch.programs[i].lock);
+        if (batch.programs[i].valid) {
+            bfjit_program_destroy(&batch.programs[i].program);
+        }
+    }
+    free(batch.programs);
+    free(batch.jobs);
+    free(batch.manifest);
+    return failed;
+}
@@ -0,0 +1,15 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "bfjit.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+size_t batch_run(
+    const char* manifest_path,
+    int worker_count,
+    bool processes,
+    const BfjitOptions* options
+);
+
+#endif
@@ -0,0 +1,546 @@
+#include "bfjit.h"
+#include "cache.h"
+#include "emitter.h"
+#include "expr.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "runtime.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ *  libbfjit
+ *
+ *  A program is compiled once into read+exec code and can then be run any
+ *  number of times, from any number of threads, each with its own tape and
+ *  I/O callbacks. The compiled code reports how far up the tape it got, so
+ *  resetting a tape between runs only clears the cells that may have been
+ *  written.
+ *
+ *  With a fuel budget, the compiled code counts loop iterations and gives
+ *  up with RunStatus_OutOfFuel once a run has used up its budget, leaving
+ *  the process and the compiled program intact for the next run.
+ *
+ *  Resumable programs can be stopped at their next input or output, and
+ *  stop there as well as when they run out of fuel. The run then leaves a
+ *  checkpoint, which another run of the same compiled code, in this or a
+ *  later process, continues from.
+ *
+ *  Programs compiled with the shared option live in a sealed memfd. The
+ *  file descriptor can be inherited by forked workers or sent to other
+ *  processes over a unix socket, which then map the same physical code
+ *  instead of compiling it again.
+ *
+ */
+
+BfjitOptions bfjit_default_options(void)
+{
+    return (BfjitOptions) {
+        .shared = false,
+        .cell_width = CellWidth_8,
+        .outline_loops = false,
+        .unroll_loops = true,
+        .pipeline = optimizer_pipeline_for_level(2),
+        .fuel = 0,
+        .resumable = false,
+        .region = NULL,
+        .cache = NULL,
+    };
+}
+
+bool bfjit_compile(
+    BfjitProgram* program,
+    const char* source,
+    size_t length,
+    const BfjitOptions* options
+)
+{
+    Parser parser = parser_create(lexer_from_string(source, length));
+    ExprVec ast = parser_parse(&parser);
+    if (expr_vec_contains_errors(&ast)) {
+        expr_vec_free(&ast);
+        return false;
+    }
+    BfjitOptions defaults = bfjit_default_options();
+    if (options == NULL) {
+        options = &defaults;
+    }
+    OptimizerOptions optimizer_options = {
+        .cell_width = options->cell_width,
+    };
+    ExprVec optimized = options->cache != NULL
+        ? compile_cache_optimize(
+              options->cache,
+              &ast,
+              &options->pipeline,
+              &optimizer_options,
+              NULL
+          )
+        : optimize_program(&ast, &options->pipeline, &optimizer_options, NULL);
+    expr_vec_free(&ast);
+
+    Emitter emitter = emitter_create();
+    emitter.cell_width = options->cell_width;
+    emitter.outline_loops = options->outline_loops;
+    emitter.unroll_loops = options->unroll_loops;
+    emitter.fuel = options->fuel != 0;
+    emitter.resumable = options->resumable;
+    emitter.threads = options->pipeline.threads;
+    emitter.cache = options->cache;
+    emitter_emit_program(&emitter, &optimized);
+    bfjit_program_from_emitter(program, &emitter, options);
+    emitter_destroy(&emitter);
+    expr_vec_free(&optimized);
+    return true;
+}
+
+// fnv-1a, identifies the code a checkpoint was taken with
+static uint64_t bfjit_hash_code(const void* code, size_t size)
+{
+    const uint8_t* bytes = code;
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+void bfjit_program_from_emitter(
+    BfjitProgram* program, const Emitter* emitter, const BfjitOptions* options
+)
+{
+    *program = (BfjitProgram) {
+        .code = NULL,
+        .code_size = 0,
+        .dirty_margin = emitter->dirty_margin,
+        .counters = NULL,
+        .fd = -1,
+        .cell_width = emitter->cell_width,
+        .fuel = options != NULL ? options->fuel : 0,
+        .in_region = false,
+    };
+    if (options != NULL && options->region != NULL) {
+        program->code = emitter_install_region(emitter, options->region);
+        program->code_size = emitter->pos;
+        program->in_region = true;
+    } else if (options != NULL && options->shared) {
+        program->code = emitter_install_shared(
+            emitter, &program->code_size, &program->fd
+        );
+    } else {
+        program->code = emitter_install(emitter, &program->code_size);
+    }
+    program->code_hash = bfjit_hash_code(program->code, program->code_size);
+}
+
+void bfjit_program_destroy(BfjitProgram* program)
+{
+    if (!program->in_region) {
+        munmap(program->code, program->code_size);
+    }
+    if (program->fd >= 0) {
+        close(program->fd);
+    }
+}
+
+// takes ownership of fd, which must be a memfd sealed against writes
+bool bfjit_program_map(
+    BfjitProgram* program, int fd, size_t dirty_margin, CellWidth cell_width
+)
+{
+    int seals = fcntl(fd, F_GET_SEALS);
+    struct stat status;
+    if (seals < 0 || (seals & F_SEAL_WRITE) == 0 || fstat(fd, &status) != 0
+        || status.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    void* code = mmap(
+        NULL, (size_t)status.st_size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0
+    );
+    if (code == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    *program = (BfjitProgram) {
+        .code = code,
+        .code_size = (size_t)status.st_size,
+        .dirty_margin = dirty_margin,
+        .counters = NULL,
+        .fd = fd,
+        .cell_width = cell_width,
+        .fuel = 0,
+        .code_hash = bfjit_hash_code(code, (size_t)status.st_size),
+        .in_region = false,
+    };
+    return true;
+}
+
+// sent along with the file descriptor
+typedef struct {
+    uint64_t dirty_margin;
+    uint64_t cell_width;
+    uint64_t fuel;
+} SharedProgramHeader;
+
+bool bfjit_program_send(const BfjitProgram* program, int socket)
+{
+    if (program->fd < 0) {
+        return false;
+    }
+    SharedProgramHeader program_header = {
+        .dirty_margin = program->dirty_margin,
+        .cell_width = program->cell_width,
+        .fuel = program->fuel,
+    };
+    struct iovec payload = {
+        .iov_base = &program_header,
+        .iov_len = sizeof(program_header),
+    };
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message = {
+        .msg_iov = &payload,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &program->fd, sizeof(int));
+    return sendmsg(socket, &message, 0) == (ssize_t)sizeof(program_header);
+}
+
+bool bfjit_program_receive(BfjitProgram* program, int socket)
+{
+    SharedProgramHeader program_header;
+    struct iovec payload = {
+        .iov_base = &program_header,
+        .iov_len = sizeof(program_header),
+    };
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {
+        .msg_iov = &payload,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+    if (recvmsg(socket, &message, MSG_CMSG_CLOEXEC)
+        != (ssize_t)sizeof(program_header)) {
+        return false;
+    }
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_level != SOL_SOCKET
+        || header->cmsg_type != SCM_RIGHTS
+        || header->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return false;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(header), sizeof(int));
+    CellWidth cell_width = (CellWidth)program_header.cell_width;
+    if (cell_width != CellWidth_8 && cell_width != CellWidth_16
+        && cell_width != CellWidth_32) {
+        close(fd);
+        return false;
+    }
+    if (!bfjit_program_map(
+            program, fd, (size_t)program_header.dirty_margin, cell_width
+        )) {
+        return false;
+    }
+    program->fuel = program_header.fuel;
+    return true;
+}
+
+void bfjit_tape_construct(BfjitTape* tape, size_t size)
+{
+    *tape = (BfjitTape) {
+        .data = calloc(size, 1),
+        .size = size,
+        .dirty = 0,
+    };
+}
+
+void bfjit_tape_destroy(BfjitTape* tape) { free(tape->data); }
+
+void bfjit_tape_reset(BfjitTape* tape)
+{
+    memset(tape->data, 0, tape->dirty);
+    tape->dirty = 0;
+}
+
+static const volatile sig_atomic_t never_stop = 0;
+
+static RunStatus bfjit_run_context(
+    const BfjitProgram* program,
+    BfjitTape* tape,
+    uint8_t* start,
+    RunContext* context
+)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    CompiledProgram runnable = (CompiledProgram)program->code;
+#pragma GCC diagnostic pop
+    RunStatus status = runnable(start, context);
+
+    size_t dirty = (size_t)(context->high_water - tape->data)
+        + program->dirty_margin + 1;
+    if (dirty > tape->size) {
+        dirty = tape->size;
+    }
+    if (dirty > tape->dirty) {
+        tape->dirty = dirty;
+    }
+    return status;
+}
+
+RunStatus bfjit_run(
+    const BfjitProgram* program, BfjitTape* tape, const BfjitIo* io
+)
+{
+    size_t position = 0;
+    return bfjit_run_at(program, tape, io, &position);
+}
+
+// starts with the tape pointer at position, in bytes from the start of the
+// tape, and leaves it where the program ended
+RunStatus bfjit_run_at(
+    const BfjitProgram* program,
+    BfjitTape* tape,
+    const BfjitIo* io,
+    size_t* position
+)
+{
+    RunContext context = {
+        .read = io->read,
+        .write = io->write,
+        .user = io->user,
+        .counters = program->counters,
+        .high_water = tape->data + *position,
+        .fuel = program->fuel != 0 ? program->fuel : UINT64_MAX,
+        .resume_point = 0,
+        .stop = &never_stop,
+    };
+    RunStatus status = bfjit_run_context(
+        program, tape, tape->data + *position, &context
+    );
+    *position = (size_t)(context.position - tape->data);
+    return status;
+}
+
+BfjitIo bfjit_stdio(RuntimeStreams* streams)
+{
+    return (BfjitIo) {
+        .read = runtime_read_stdio,
+        .write = runtime_write_stdio,
+        .user = streams,
+    };
+}
+
+/*
+ *  checkpoints
+ *
+ *  The file is a fixed header of little endian 64 bit fields followed by
+ *  the touched part of the tape:
+ *
+ *      "bfjitck1" code_hash cell_width resume_point position high_water
+ *      input_offset output_offset tape_length <tape_length bytes>
+ *
+ *  Offsets count the bytes that went through the I/O callbacks, so a
+ *  resumed run has to be given its input from input_offset on, and its
+ *  output continues at output_offset.
+ *
+ */
+
+#define CHECKPOINT_MAGIC "bfjitck1"
+#define CHECKPOINT_FIELDS 8
+
+void bfjit_checkpoint_construct(BfjitCheckpoint* checkpoint)
+{
+    *checkpoint = (BfjitCheckpoint) {
+        .code_hash = 0,
+        .cell_width = CellWidth_8,
+        .resume_point = 0,
+        .position = 0,
+        .high_water = 0,
+        .input_offset = 0,
+        .output_offset = 0,
+        .tape_length = 0,
+        .tape = NULL,
+    };
+}
+
+void bfjit_checkpoint_destroy(BfjitCheckpoint* checkpoint)
+{
+    free(checkpoint->tape);
+}
+
+bool bfjit_checkpoint_save(
+    const BfjitCheckpoint* checkpoint, const char* path
+)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    uint64_t fields[CHECKPOINT_FIELDS] = {
+        checkpoint->code_hash,
+        checkpoint->cell_width,
+        checkpoint->resume_point,
+        checkpoint->position,
+        checkpoint->high_water,
+        checkpoint->input_offset,
+        checkpoint->output_offset,
+        checkpoint->tape_length,
+    };
+    bool written = fwrite(CHECKPOINT_MAGIC, 8, 1, file) == 1
+        && fwrite(fields, sizeof(fields), 1, file) == 1
+        && fwrite(checkpoint->tape, 1, checkpoint->tape_length, file)
+            == checkpoint->tape_length;
+    return fclose(file) == 0 && written;
+}
+
+bool bfjit_checkpoint_load(BfjitCheckpoint* checkpoint, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    char magic[8];
+    uint64_t fields[CHECKPOINT_FIELDS];
+    if (fread(magic, 8, 1, file) != 1
+        || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0
+        || fread(fields, sizeof(fields), 1, file) != 1) {
+        fclose(file);
+        return false;
+    }
+    free(checkpoint->tape);
+    *checkpoint = (BfjitCheckpoint) {
+        .code_hash = fields[0],
+        .cell_width = (CellWidth)fields[1],
+        .resume_point = (uint32_t)fields[2],
+        .position = (size_t)fields[3],
+        .high_water = (size_t)fields[4],
+        .input_offset = fields[5],
+        .output_offset = fields[6],
+        .tape_length = (size_t)fields[7],
+        .tape = malloc(fields[7] > 0 ? (size_t)fields[7] : 1),
+    };
+    bool read = fread(checkpoint->tape, 1, checkpoint->tape_length, file)
+        == checkpoint->tape_length;
+    fclose(file);
+    return read;
+}
+
+// false if the checkpoint is from other code or does not fit the tape
+bool bfjit_checkpoint_matches(
+    const BfjitCheckpoint* checkpoint,
+    const BfjitProgram* program,
+    const BfjitTape* tape
+)
+{
+    return checkpoint->code_hash == program->code_hash
+        && checkpoint->cell_width == program->cell_width
+        && checkpoint->tape_length <= tape->size
+        && checkpoint->position < tape->size
+        && checkpoint->high_water < tape->size;
+}
+
+typedef struct {
+    const BfjitIo* io;
+    uint64_t input_offset;
+    uint64_t output_offset;
+} CountingIo;
+
+static int counting_read(void* user)
+{
+    CountingIo* counting = user;
+    int value = counting->io->read(counting->io->user);
+    if (value >= 0) {
+        counting->input_offset += 1;
+    }
+    return value;
+}
+
+static void counting_write(void* user, uint8_t value)
+{
+    CountingIo* counting = user;
+    counting->io->write(counting->io->user, value);
+    counting->output_offset += 1;
+}
+
+// runs a resumable program from the start, or from the checkpoint if it
+// has a resume point, and leaves a checkpoint behind unless the program
+// finished
+RunStatus bfjit_run_resumable(
+    const BfjitProgram* program,
+    BfjitTape* tape,
+    const BfjitIo* io,
+    BfjitCheckpoint* checkpoint,
+    const volatile sig_atomic_t* stop
+)
+{
+    CountingIo counting = {
+        .io = io,
+        .input_offset = 0,
+        .output_offset = 0,
+    };
+    RunContext context = {
+        .read = counting_read,
+        .write = counting_write,
+        .user = &counting,
+        .counters = program->counters,
+        .high_water = tape->data,
+        .fuel = program->fuel != 0 ? program->fuel : UINT64_MAX,
+        .resume_point = 0,
+        .stop = stop != NULL ? stop : &never_stop,
+    };
+    if (checkpoint->resume_point != 0) {
+        memcpy(tape->data, checkpoint->tape, checkpoint->tape_length);
+        if (checkpoint->tape_length > tape->dirty) {
+            tape->dirty = checkpoint->tape_length;
+        }
+        counting.input_offset = checkpoint->input_offset;
+        counting.output_offset = checkpoint->output_offset;
+        context.resume_point = checkpoint->resume_point;
+        context.position = tape->data + checkpoint->position;
+        context.high_water = tape->data + checkpoint->high_water;
+    }
+    RunStatus status
+        = bfjit_run_context(program, tape, tape->data, &context);
+
+    free(checkpoint->tape);
+    bfjit_checkpoint_construct(checkpoint);
+    if (status == RunStatus_Finished) {
+        return status;
+    }
+    *checkpoint = (BfjitCheckpoint) {
+        .code_hash = program->code_hash,
+        .cell_width = program->cell_width,
+        .resume_point = context.resume_point,
+        .position = (size_t)(context.position - tape->data),
+        .high_water = (size_t)(context.high_water - tape->data),
+        .input_offset = counting.input_offset,
+        .output_offset = counting.output_offset,
+        .tape_length = tape->dirty,
+        .tape = malloc(tape->dirty > 0 ? tape->dirty : 1),
+    };
+    memcpy(checkpoint->tape, tape->data, tape->dirty);
+    return status;
+}
@@ -0,0 +1,121 @@
+#ifndef BFJIT_H
+#define BFJIT_H
+
+#include "emitter.h"
+#include "optimizer.h"
+#include "runtime.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef RunStatus (*CompiledProgram)(uint8_t* tape, RunContext* context);
+
+typedef struct {
+    bool shared;
+    CellWidth cell_width;
+    bool outline_loops;
+    bool unroll_loops;
+    OptimizerPipeline pipeline;
+    // loop iterations per run, 0 for no limit
+    uint64_t fuel;
+    // stop at inputs and outputs on request, and resume from checkpoints
+    bool resumable;
+    // appends the code to this region instead of mapping it on its own
+    CodeRegion* region;
+    // reuses the code of loops compiled before with the same cache
+    CompileCache* cache;
+} BfjitOptions;
+
+typedef struct {
+    void* code;
+    size_t code_size;
+    size_t dirty_margin;
+    uint64_t* counters;
+    int fd;
+    CellWidth cell_width;
+    uint64_t fuel;
+    uint64_t code_hash;
+    // the code lives in a code region, which unmaps it
+    bool in_region;
+} BfjitProgram;
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t dirty;
+} BfjitTape;
+
+typedef struct {
+    ReadCallback read;
+    WriteCallback write;
+    void* user;
+} BfjitIo;
+
+BfjitOptions bfjit_default_options(void);
+bool bfjit_compile(
+    BfjitProgram* program,
+    const char* source,
+    size_t length,
+    const BfjitOptions* options
+);
+void bfjit_program_from_emitter(
+    BfjitProgram* program, const Emitter* emitter, const BfjitOptions* options
+);
+void bfjit_program_destroy(BfjitProgram* program);
+bool bfjit_program_map(
+    BfjitProgram* program, int fd, size_t dirty_margin, CellWidth cell_width
+);
+bool bfjit_program_send(const BfjitProgram* program, int socket);
+bool bfjit_program_receive(BfjitProgram* program, int socket);
+
+void bfjit_tape_construct(BfjitTape* tape, size_t size);
+void bfjit_tape_destroy(BfjitTape* tape);
+void bfjit_tape_reset(BfjitTape* tape);
+
+RunStatus bfjit_run(
+    const BfjitProgram* program, BfjitTape* tape, const BfjitIo* io
+);
+RunStatus bfjit_run_at(
+    const BfjitProgram* program,
+    BfjitTape* tape,
+    const BfjitIo* io,
+    size_t* position
+);
+BfjitIo bfjit_stdio(RuntimeStreams* streams);
+
+typedef struct {
+    // of the program the checkpoint can be resumed with
+    uint64_t code_hash;
+    CellWidth cell_width;
+    uint32_t resume_point;
+    // in bytes from the start of the tape
+    size_t position;
+    size_t high_water;
+    // bytes read and written so far
+    uint64_t input_offset;
+    uint64_t output_offset;
+    // the touched part of the tape, from its start
+    size_t tape_length;
+    uint8_t* tape;
+} BfjitCheckpoint;
+
+void bfjit_checkpoint_construct(BfjitCheckpoint* checkpoint);
+void bfjit_checkpoint_destroy(BfjitCheckpoint* checkpoint);
+bool bfjit_checkpoint_save(
+    const BfjitCheckpoint* checkpoint, const char* path
+);
+bool bfjit_checkpoint_load(BfjitCheckpoint* checkpoint, const char* path);
+bool bfjit_checkpoint_matches(
+    const BfjitCheckpoint* checkpoint,
+    const BfjitProgram* program,
+    const BfjitTape* tape
+);
+RunStatus bfjit_run_resumable(
+    const BfjitProgram* program,
+    BfjitTape* tape,
+    const BfjitIo* io,
+    BfjitCheckpoint* checkpoint,
+    const volatile sig_atomic_t* stop
+);
+
+#endif
@@ -1,4 +1,4 @@
 #!/bin/bash
 
-gcc -o program -std=c17 -Wall -Wextra -Wpedantic -O3 `cat compile_files.txt`
+gcc -o program -std=c17 -D_GNU_SOURCE -Wall -Wextra -Wpedantic -O3 -pthread `cat compile_files.txt`
 
@@ -0,0 +1,815 @@
+#include "cache.h"
+#include "emitter.h"
+#include "expr.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "stats.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ *  compile cache
+ *
+ *  Recompiling a program that changed in a few places, or a variant of a
+ *  generated program, mostly repeats work done before. Large top level
+ *  loops are optimized and emitted on their own, and the results are kept
+ *  by the loop's structure, so a later program only pays for the loops
+ *  that are new. Loops are found by their structural hash, in a table of
+ *  the parsed loops for the optimized ones, and in a table of the
+ *  optimized loops for their code.
+ *
+ *  Optimizing every loop apart from its neighbours is valid, as no pass
+ *  assumes anything about the tape at the start of a sequence, but a
+ *  rewrite across the boundary of a cached loop is not found. The code of
+ *  a loop is emitted like a chunk of a parallel emission and linked the
+ *  same way. Results are only reused with the settings the first program
+ *  compiled with the cache had. A time budget is shared by all the parts of
+ *  a program, and a loop is only kept if its optimization finished within
+ *  it. The cache may be shared between threads.
+ *
+ */
+
+#define COMPILE_CACHE_MIN_NODES 16
+
+void compile_cache_construct(CompileCache* cache)
+{
+    *cache = (CompileCache) {
+        .optimized = NULL,
+        .optimized_capacity = 0,
+        .code = NULL,
+        .code_capacity = 0,
+        .pipeline_configured = false,
+        .emitter_configured = false,
+        .cell_width = CellWidth_8,
+        .unroll_loops = false,
+        .avx2 = false,
+        .fuel = false,
+        .hits = 0,
+        .misses = 0,
+        .code_hits = 0,
+        .code_misses = 0,
+    };
+    expr_table_construct(&cache->sources);
+    expr_table_construct(&cache->loops);
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+static void compile_cache_free_keys(ExprTable* table)
+{
+    for (size_t i = 0; i < table->length; ++i) {
+        Expr* loop = table->entries[i].expr;
+        expr_free(loop);
+        free(loop);
+    }
+    expr_table_destroy(table);
+}
+
+void compile_cache_destroy(CompileCache* cache)
+{
+    for (size_t i = 0; i < cache->sources.length; ++i) {
+        expr_vec_free(&cache->optimized[i]);
+    }
+    for (size_t i = 0; i < cache->loops.length; ++i) {
+        emitter_destroy(cache->code[i]);
+        free(cache->code[i]);
+    }
+    compile_cache_free_keys(&cache->sources);
+    compile_cache_free_keys(&cache->loops);
+    free(cache->optimized);
+    free(cache->code);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+bool compile_cache_wants(const Expr* expr)
+{
+    return expr->type == ExprType_Loop
+        && expr_vec_count_nodes(&expr->exprs) + 1 >= COMPILE_CACHE_MIN_NODES;
+}
+
+bool compile_cache_accepts_pipeline(
+    CompileCache* cache,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options
+)
+{
+    if (!cache->pipeline_configured) {
+        cache->pipeline_configured = true;
+        cache->pipeline = *pipeline;
+        cache->options = *options;
+    }
+    if (cache->pipeline.passes_length != pipeline->passes_length
+        || cache->pipeline.max_iterations != pipeline->max_iterations
+        || cache->pipeline.time_budget != pipeline->time_budget
+        || cache->options.cell_width != options->cell_width) {
+        return false;
+    }
+    for (size_t i = 0; i < pipeline->passes_length; ++i) {
+        if (cache->pipeline.passes[i] != pipeline->passes[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool compile_cache_accepts_emitter(CompileCache* cache, const Emitter* emitter)
+{
+    if (!cache->emitter_configured) {
+        cache->emitter_configured = true;
+        cache->cell_width = emitter->cell_width;
+        cache->unroll_loops = emitter->unroll_loops;
+        cache->avx2 = emitter->avx2;
+        cache->fuel = emitter->fuel;
+    }
+    return cache->cell_width == emitter->cell_width
+        && cache->unroll_loops == emitter->unroll_loops
+        && cache->avx2 == emitter->avx2 && cache->fuel == emitter->fuel;
+}
+
+// adds a copy of the loop as a key, and returns its id
+static int compile_cache_intern(ExprTable* table, const Expr* loop)
+{
+    Expr* key = malloc(sizeof(Expr));
+    *key = expr_clone(loop);
+    key->hash = loop->hash;
+    return expr_table_intern(table, key);
+}
+
+// appends the optimized nodes to the result, taking them over
+static void compile_cache_append(ExprVec* result, ExprVec* nodes)
+{
+    for (size_t i = 0; i < nodes->length; ++i) {
+        expr_vec_push(result, nodes->data[i]);
+    }
+    expr_vec_destroy(nodes);
+}
+
+// runs the pipeline with what is left of the time budget for the whole
+// program, and tells whether it finished before the deadline
+static ExprVec compile_cache_run_pipeline(
+    ExprVec* nodes,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    const OptimizerTrace* trace,
+    double deadline,
+    bool* finished
+)
+{
+    OptimizerPipeline budgeted = *pipeline;
+    if (pipeline->time_budget > 0.0) {
+        double remaining = deadline - stats_now();
+        if (remaining > 0.0) {
+            budgeted.time_budget = remaining;
+        } else {
+            budgeted.passes_length = 0;
+        }
+    }
+    ExprVec optimized = optimize_program(nodes, &budgeted, options, trace);
+    *finished = pipeline->time_budget <= 0.0 || stats_now() < deadline;
+    return optimized;
+}
+
+ExprVec compile_cache_optimize(
+    CompileCache* cache,
+    ExprVec* program,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    const OptimizerTrace* trace
+)
+{
+    pthread_mutex_lock(&cache->lock);
+    bool accepted = compile_cache_accepts_pipeline(cache, pipeline, options);
+    pthread_mutex_unlock(&cache->lock);
+    if (!accepted) {
+        return optimize_program(program, pipeline, options, trace);
+    }
+    // the budget is for the whole program, not every part of it
+    double deadline = stats_now() + pipeline->time_budget;
+    bool finished;
+    ExprVec result;
+    expr_vec_construct(&result);
+    size_t run_start = 0;
+    for (size_t i = 0; i <= program->length; ++i) {
+        Expr* expr = i < program->length ? &program->data[i] : NULL;
+        if (expr != NULL && !compile_cache_wants(expr)) {
+            continue;
+        }
+        // the nodes since the last cached loop are optimized as they are
+        if (i > run_start) {
+            ExprVec run = {
+                .data = &program->data[run_start],
+                .capacity = i - run_start,
+                .length = i - run_start,
+            };
+            ExprVec optimized = compile_cache_run_pipeline(
+                &run, pipeline, options, trace, deadline, &finished
+            );
+            compile_cache_append(&result, &optimized);
+        }
+        run_start = i + 1;
+        if (expr == NULL) {
+            break;
+        }
+
+        expr_hash(expr);
+        pthread_mutex_lock(&cache->lock);
+        int id = expr_table_find(&cache->sources, expr);
+        ExprVec optimized;
+        if (id >= 0) {
+            cache->hits += 1;
+            optimized = expr_vec_clone(&cache->optimized[id]);
+            pthread_mutex_unlock(&cache->lock);
+            compile_cache_append(&result, &optimized);
+            continue;
+        }
+        cache->misses += 1;
+        pthread_mutex_unlock(&cache->lock);
+
+        ExprVec loop = {
+            .data = expr,
+            .capacity = 1,
+            .length = 1,
+        };
+        optimized = compile_cache_run_pipeline(
+            &loop, pipeline, options, trace, deadline, &finished
+        );
+        pthread_mutex_lock(&cache->lock);
+        // another thread may have added the loop in the meantime, and a
+        // loop whose optimization was cut short is not kept
+        if (finished && expr_table_find(&cache->sources, expr) < 0) {
+            id = compile_cache_intern(&cache->sources, expr);
+            if ((size_t)id + 1 > cache->optimized_capacity) {
+                cache->optimized_capacity = cache->optimized_capacity == 0
+                    ? 8
+                    : cache->optimized_capacity * 2;
+                cache->optimized = realloc(
+                    cache->optimized,
+                    sizeof(ExprVec) * cache->optimized_capacity
+                );
+            }
+            cache->optimized[id] = expr_vec_clone(&optimized);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        compile_cache_append(&result, &optimized);
+    }
+    return result;
+}
+
+// the code of the optimized loop, emitted and added first if needed. The
+// lock is only held for the lookups, so threads emit new loops in parallel
+const Emitter* compile_cache_code(
+    CompileCache* cache, const Emitter* emitter, Expr* loop
+)
+{
+    expr_hash(loop);
+    pthread_mutex_lock(&cache->lock);
+    int id = expr_table_find(&cache->loops, loop);
+    if (id >= 0) {
+        cache->code_hits += 1;
+        const Emitter* code = cache->code[id];
+        pthread_mutex_unlock(&cache->lock);
+        return code;
+    }
+    cache->code_misses += 1;
+    pthread_mutex_unlock(&cache->lock);
+
+    Emitter* code = malloc(sizeof(Emitter));
+    *code = emitter_create_chunk(emitter);
+    ExprVec nodes = {
+        .data = loop,
+        .capacity = 1,
+        .length = 1,
+    };
+    emitter_emit_expr_vec(code, &nodes);
+
+    pthread_mutex_lock(&cache->lock);
+    // another thread may have added the loop in the meantime
+    id = expr_table_find(&cache->loops, loop);
+    if (id >= 0) {
+        emitter_destroy(code);
+        free(code);
+        code = cache->code[id];
+    } else {
+        id = compile_cache_intern(&cache->loops, loop);
+        if ((size_t)id + 1 > cache->code_capacity) {
+            cache->code_capacity
+                = cache->code_capacity == 0 ? 8 : cache->code_capacity * 2;
+            cache->code = realloc(
+                cache->code, sizeof(Emitter*) * cache->code_capacity
+            );
+        }
+        cache->code[id] = code;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return code;
+}
+
+/*
+ *  cache files
+ *
+ *  The optimized loops can be saved to a file and loaded by a later run, so
+ *  rebuilding a large program after a small edit only optimizes the loops
+ *  that changed. The file starts with the build that wrote it and the
+ *  settings the loops were optimized with, and is ignored if either
+ *  differs. Then every parsed loop follows with what it optimized to, in a
+ *  compact encoding of the nodes, and a checksum of everything before it
+ *  ends the file. The code of the loops is not saved, emitting is cheap
+ *  next to optimizing.
+ *
+ *  Loaded loops are used without optimizing them again, so a file is only
+ *  trusted as a whole: if its checksum does not match, a field is out of
+ *  range, or a node has a shape the parser or the optimizer never makes,
+ *  none of it is loaded.
+ *
+ */
+
+#define COMPILE_CACHE_MAGIC "bfjitcc2"
+// what a pass makes of a loop changes between builds
+#define COMPILE_CACHE_BUILD __DATE__ " " __TIME__
+// set in a node's type byte when its offset and length follow
+#define COMPILE_CACHE_HAS_RANGE 0x80
+
+// fnv-1a
+static uint64_t compile_cache_checksum(const uint8_t* bytes, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+static bool compile_cache_write_u64(FILE* file, uint64_t value)
+{
+    return fwrite(&value, sizeof(value), 1, file) == 1;
+}
+
+static bool compile_cache_read_u64(FILE* file, uint64_t* value)
+{
+    return fread(value, sizeof(*value), 1, file) == 1;
+}
+
+// writes a signed number in as few bytes as its magnitude needs
+static bool compile_cache_write_int(FILE* file, int64_t value)
+{
+    uint64_t bits = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    while (bits >= 0x80) {
+        if (fputc((int)(bits & 0x7f) | 0x80, file) == EOF) {
+            return false;
+        }
+        bits >>= 7;
+    }
+    return fputc((int)bits, file) != EOF;
+}
+
+static bool compile_cache_read_int(FILE* file, int64_t* value)
+{
+    uint64_t bits = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) {
+            return false;
+        }
+        bits |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *value = (int64_t)(bits >> 1) ^ -(int64_t)(bits & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool compile_cache_write_vec(FILE* file, const ExprVec* vec);
+static bool compile_cache_read_vec(FILE* file, ExprVec* vec);
+
+// a node is its type, its value or number of nodes in its body, and the
+// offset and length if either is set. Source locations are not kept
+static bool compile_cache_write_expr(FILE* file, const Expr* expr)
+{
+    bool range = expr->offset != 0 || expr->length != 0;
+    if (fputc(expr->type | (range ? COMPILE_CACHE_HAS_RANGE : 0), file)
+        == EOF) {
+        return false;
+    }
+    if (range
+        && (!compile_cache_write_int(file, expr->offset)
+            || !compile_cache_write_int(file, expr->length))) {
+        return false;
+    }
+    if (expr_has_body(expr)) {
+        return compile_cache_write_vec(file, &expr->exprs);
+    }
+    return compile_cache_write_int(file, expr->value);
+}
+
+static bool compile_cache_write_vec(FILE* file, const ExprVec* vec)
+{
+    if (!compile_cache_write_int(file, (int64_t)vec->length)) {
+        return false;
+    }
+    for (size_t i = 0; i < vec->length; ++i) {
+        if (!compile_cache_write_expr(file, &vec->data[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// reads a number that has to fit in an int
+static bool compile_cache_read_small_int(FILE* file, int64_t* value)
+{
+    return compile_cache_read_int(file, value) && *value >= INT_MIN
+        && *value <= INT_MAX;
+}
+
+// reads a node, which owns nothing if this fails
+static bool compile_cache_read_expr(FILE* file, Expr* expr)
+{
+    int type = fgetc(file);
+    int64_t offset = 0;
+    int64_t length = 0;
+    if (type == EOF
+        || (type & ~COMPILE_CACHE_HAS_RANGE) >= EXPR_TYPE_COUNT) {
+        return false;
+    }
+    if ((type & COMPILE_CACHE_HAS_RANGE) != 0
+        && (!compile_cache_read_small_int(file, &offset)
+            || !compile_cache_read_small_int(file, &length))) {
+        return false;
+    }
+    *expr = (Expr) {
+        .type = (ExprType)(type & ~COMPILE_CACHE_HAS_RANGE),
+        .loc = { .offset = 0, .line = 0, .column = 0 },
+        .hash = 0,
+        .offset = (int)offset,
+        .length = (int)length,
+    };
+    if (expr_has_body(expr)) {
+        return compile_cache_read_vec(file, &expr->exprs);
+    }
+    int64_t value;
+    if (!compile_cache_read_small_int(file, &value)) {
+        return false;
+    }
+    expr->value = (int)value;
+    return true;
+}
+
+static bool compile_cache_read_vec(FILE* file, ExprVec* vec)
+{
+    int64_t length;
+    if (!compile_cache_read_int(file, &length) || length < 0) {
+        return false;
+    }
+    expr_vec_construct(vec);
+    for (int64_t i = 0; i < length; ++i) {
+        Expr expr;
+        if (!compile_cache_read_expr(file, &expr)) {
+            expr_vec_free(vec);
+            return false;
+        }
+        expr_vec_push(vec, expr);
+    }
+    return true;
+}
+
+// true for a node the parser makes, in a parsed loop
+static bool compile_cache_check_parsed(const Expr* expr)
+{
+    if (expr->offset != 0 || expr->length != 0) {
+        return false;
+    }
+    switch (expr->type) {
+        case ExprType_Incr:
+        case ExprType_Decr:
+        case ExprType_Left:
+        case ExprType_Right:
+            return expr->value == 1;
+        case ExprType_Output:
+        case ExprType_Input:
+            return expr->value == 0;
+        case ExprType_Loop:
+            for (size_t i = 0; i < expr->exprs.length; ++i) {
+                if (!compile_cache_check_parsed(&expr->exprs.data[i])) {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool compile_cache_check_optimized_vec(const ExprVec* vec);
+
+// true for a node the optimizer can make, with the fields its type uses and
+// a range that stays within the offsets an int holds
+static bool compile_cache_check_optimized(const Expr* expr)
+{
+    int64_t last = (int64_t)expr->offset + expr->length - 1;
+    switch (expr->type) {
+        case ExprType_Incr:
+        case ExprType_Decr:
+        case ExprType_Left:
+        case ExprType_Right:
+        case ExprType_Output:
+        case ExprType_Input:
+        case ExprType_Zero:
+        case ExprType_Add:
+            return expr->offset == 0 && expr->length == 0;
+        case ExprType_Mul:
+            return expr->length == 0;
+        case ExprType_Loop:
+        case ExprType_If:
+            return expr->offset == 0 && expr->length == 0
+                && compile_cache_check_optimized_vec(&expr->exprs);
+        case ExprType_DivMod:
+            return expr->length == 0 && expr->exprs.length == 1
+                && expr->exprs.data[0].type == ExprType_Loop
+                && compile_cache_check_optimized_vec(&expr->exprs);
+        case ExprType_ClearRange:
+            return expr->length > 0 && last <= INT_MAX && expr->value == 0;
+        case ExprType_AddRange:
+            return expr->length > 0 && last <= INT_MAX;
+        case ExprType_MulRange:
+            if (expr->length < 2 || last > INT_MAX
+                || expr->exprs.length != (size_t)expr->length) {
+                return false;
+            }
+            for (int i = 0; i < expr->length; ++i) {
+                const Expr* mul = &expr->exprs.data[i];
+                if (mul->type != ExprType_Mul || mul->length != 0
+                    || mul->offset != expr->offset + i) {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool compile_cache_check_optimized_vec(const ExprVec* vec)
+{
+    for (size_t i = 0; i < vec->length; ++i) {
+        if (!compile_cache_check_optimized(&vec->data[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool compile_cache_write_settings(
+    FILE* file,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options
+)
+{
+    uint64_t time_budget;
+    memcpy(&time_budget, &pipeline->time_budget, sizeof(time_budget));
+    size_t build_length = strlen(COMPILE_CACHE_BUILD);
+    if (!compile_cache_write_u64(file, build_length)
+        || fwrite(COMPILE_CACHE_BUILD, 1, build_length, file) != build_length
+        || !compile_cache_write_u64(file, options->cell_width)
+        || !compile_cache_write_u64(file, (uint64_t)pipeline->max_iterations)
+        || !compile_cache_write_u64(file, time_budget)
+        || !compile_cache_write_u64(file, pipeline->passes_length)) {
+        return false;
+    }
+    for (size_t i = 0; i < pipeline->passes_length; ++i) {
+        const char* name = pipeline->passes[i]->name;
+        size_t length = strlen(name);
+        if (!compile_cache_write_u64(file, length)
+            || fwrite(name, 1, length, file) != length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// true if the file was written by this build with the same settings
+static bool compile_cache_settings_match(
+    FILE* file,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options
+)
+{
+    char build[64];
+    uint64_t build_length;
+    if (!compile_cache_read_u64(file, &build_length)
+        || build_length != strlen(COMPILE_CACHE_BUILD)
+        || build_length > sizeof(build)
+        || fread(build, 1, build_length, file) != build_length
+        || memcmp(build, COMPILE_CACHE_BUILD, build_length) != 0) {
+        return false;
+    }
+    uint64_t fields[4];
+    uint64_t time_budget;
+    memcpy(&time_budget, &pipeline->time_budget, sizeof(time_budget));
+    for (size_t i = 0; i < 4; ++i) {
+        if (!compile_cache_read_u64(file, &fields[i])) {
+            return false;
+        }
+    }
+    if (fields[0] != (uint64_t)options->cell_width
+        || fields[1] != (uint64_t)pipeline->max_iterations
+        || fields[2] != time_budget
+        || fields[3] != pipeline->passes_length) {
+        return false;
+    }
+    for (size_t i = 0; i < pipeline->passes_length; ++i) {
+        const char* name = pipeline->passes[i]->name;
+        char read[64];
+        uint64_t length;
+        if (!compile_cache_read_u64(file, &length) || length != strlen(name)
+            || length > sizeof(read)
+            || fread(read, 1, length, file) != length
+            || memcmp(read, name, length) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    Expr** loops;
+    ExprVec* optimized;
+    size_t length;
+    size_t capacity;
+} CompileCacheEntries;
+
+static void compile_cache_entries_free(CompileCacheEntries* entries)
+{
+    for (size_t i = 0; i < entries->length; ++i) {
+        expr_free(entries->loops[i]);
+        free(entries->loops[i]);
+        expr_vec_free(&entries->optimized[i]);
+    }
+    free(entries->loops);
+    free(entries->optimized);
+}
+
+// reads every entry of a file after its header, and fails unless all of
+// them are valid and nothing follows them
+static bool compile_cache_read_entries(
+    FILE* file, CompileCacheEntries* entries
+)
+{
+    uint64_t count;
+    if (!compile_cache_read_u64(file, &count)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        Expr* loop = malloc(sizeof(Expr));
+        ExprVec optimized;
+        if (!compile_cache_read_expr(file, loop)) {
+            free(loop);
+            return false;
+        }
+        if (!compile_cache_read_vec(file, &optimized)) {
+            expr_free(loop);
+            free(loop);
+            return false;
+        }
+        if (entries->length == entries->capacity) {
+            entries->capacity
+                = entries->capacity == 0 ? 8 : entries->capacity * 2;
+            entries->loops = realloc(
+                entries->loops, sizeof(Expr*) * entries->capacity
+            );
+            entries->optimized = realloc(
+                entries->optimized, sizeof(ExprVec) * entries->capacity
+            );
+        }
+        entries->loops[entries->length] = loop;
+        entries->optimized[entries->length] = optimized;
+        entries->length += 1;
+        if (loop->type != ExprType_Loop || !compile_cache_check_parsed(loop)
+            || !compile_cache_check_optimized_vec(&optimized)) {
+            return false;
+        }
+    }
+    return fgetc(file) == EOF;
+}
+
+// loads the loops saved by this build with the same settings into an empty
+// cache, and fails, loading nothing, unless the whole file is intact
+bool compile_cache_load(
+    CompileCache* cache,
+    const char* path,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options
+)
+{
+    size_t size;
+    char* data = read_source(path, &size);
+    if (data == NULL) {
+        return false;
+    }
+    uint64_t checksum;
+    FILE* file = NULL;
+    if (size > sizeof(checksum)) {
+        size -= sizeof(checksum);
+        memcpy(&checksum, &data[size], sizeof(checksum));
+        if (checksum == compile_cache_checksum((uint8_t*)data, size)) {
+            file = fmemopen(data, size, "rb");
+        }
+    }
+    char magic[8];
+    CompileCacheEntries entries = {
+        .loops = NULL,
+        .optimized = NULL,
+        .length = 0,
+        .capacity = 0,
+    };
+    bool valid = file != NULL && fread(magic, 8, 1, file) == 1
+        && memcmp(magic, COMPILE_CACHE_MAGIC, 8) == 0
+        && compile_cache_settings_match(file, pipeline, options)
+        && compile_cache_read_entries(file, &entries);
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(data);
+    if (!valid) {
+        compile_cache_entries_free(&entries);
+        return false;
+    }
+
+    compile_cache_accepts_pipeline(cache, pipeline, options);
+    for (size_t i = 0; i < entries.length; ++i) {
+        Expr* loop = entries.loops[i];
+        expr_hash(loop);
+        if (expr_table_find(&cache->sources, loop) >= 0) {
+            expr_free(loop);
+            free(loop);
+            expr_vec_free(&entries.optimized[i]);
+            continue;
+        }
+        int id = expr_table_intern(&cache->sources, loop);
+        if ((size_t)id + 1 > cache->optimized_capacity) {
+            cache->optimized_capacity = cache->optimized_capacity == 0
+                ? 8
+                : cache->optimized_capacity * 2;
+            cache->optimized = realloc(
+                cache->optimized, sizeof(ExprVec) * cache->optimized_capacity
+            );
+        }
+        cache->optimized[id] = entries.optimized[i];
+    }
+    free(entries.loops);
+    free(entries.optimized);
+    return true;
+}
+
+// saves the optimized loops, while no other thread uses the cache
+bool compile_cache_save(const CompileCache* cache, const char* path)
+{
+    if (!cache->pipeline_configured) {
+        return true;
+    }
+    char* data;
+    size_t size;
+    FILE* stream = open_memstream(&data, &size);
+    if (!stream) {
+        return false;
+    }
+    bool written = fwrite(COMPILE_CACHE_MAGIC, 8, 1, stream) == 1
+        && compile_cache_write_settings(
+            stream, &cache->pipeline, &cache->options
+        )
+        && compile_cache_write_u64(stream, cache->sources.length);
+    for (size_t i = 0; written && i < cache->sources.length; ++i) {
+        written
+            = compile_cache_write_expr(stream, cache->sources.entries[i].expr)
+            && compile_cache_write_vec(stream, &cache->optimized[i]);
+    }
+    written = fclose(stream) == 0 && written;
+
+    FILE* file = written ? fopen(path, "wb") : NULL;
+    if (file != NULL) {
+        uint64_t checksum = compile_cache_checksum((uint8_t*)data, size);
+        written = fwrite(data, 1, size, file) == size
+            && compile_cache_write_u64(file, checksum);
+        written = fclose(file) == 0 && written;
+    }
+    free(data);
+    return file != NULL && written;
+}
+
+void compile_cache_print(const CompileCache* cache, FILE* stream)
+{
+    fprintf(
+        stream,
+        "compile cache: %zu loops reused, %zu optimized, "
+        "%zu reused code, %zu emitted\n",
+        cache->hits,
+        cache->misses,
+        cache->code_hits,
+        cache->code_misses
+    );
+}
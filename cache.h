@@ -0,0 +1,71 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "emitter.h"
+#include "expr.h"
+#include "optimizer.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// what large top level loops optimized and emitted to on their own, kept
+// between the programs compiled with the cache
+struct CompileCache {
+    // parsed loops, and what each optimized to
+    ExprTable sources;
+    ExprVec* optimized;
+    size_t optimized_capacity;
+    // optimized loops, and the code of each, which stays in place while
+    // other loops are added
+    ExprTable loops;
+    Emitter** code;
+    size_t code_capacity;
+    // the settings the entries were made with, fixed by the first user
+    bool pipeline_configured;
+    OptimizerPipeline pipeline;
+    OptimizerOptions options;
+    bool emitter_configured;
+    CellWidth cell_width;
+    bool unroll_loops;
+    bool avx2;
+    bool fuel;
+    // lookups of parsed loops, and of optimized loops for their code
+    size_t hits;
+    size_t misses;
+    size_t code_hits;
+    size_t code_misses;
+    pthread_mutex_t lock;
+};
+
+void compile_cache_construct(CompileCache* cache);
+void compile_cache_destroy(CompileCache* cache);
+bool compile_cache_wants(const Expr* expr);
+bool compile_cache_accepts_pipeline(
+    CompileCache* cache,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options
+);
+bool compile_cache_accepts_emitter(
+    CompileCache* cache, const Emitter* emitter
+);
+ExprVec compile_cache_optimize(
+    CompileCache* cache,
+    ExprVec* program,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    const OptimizerTrace* trace
+);
+const Emitter* compile_cache_code(
+    CompileCache* cache, const Emitter* emitter, Expr* loop
+);
+bool compile_cache_load(
+    CompileCache* cache,
+    const char* path,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options
+);
+bool compile_cache_save(const CompileCache* cache, const char* path);
+void compile_cache_print(const CompileCache* cache, FILE* stream);
+
+#endif
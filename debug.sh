@@ -2,7 +2,7 @@
 
 set -xe
 
-gcc -o program -std=c17 -Wall -Wextra -Wpedantic -O3 -g -fsanitize=address,undefined `cat compile_files.txt`
+gcc -o program -std=c17 -D_GNU_SOURCE -Wall -Wextra -Wpedantic -O3 -g -pthread -fsanitize=address,undefined `cat compile_files.txt`
 
 ./program
 
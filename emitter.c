@@ -1,198 +1,2139 @@
 #include "emitter.h"
+#include "cache.h"
 #include "expr.h"
+#include "parallel.h"
 #include "runtime.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-Emitter emitter_create(uint8_t* code_address)
+Emitter emitter_create(void)
 {
     return (Emitter) {
-        .code = code_address,
+        .code = malloc(4096),
+        .capacity = 4096,
         .pos = 0,
         .loop_counter = 0,
         .cmp_flags_set = false,
         .rax_contains_copy = false,
+        .type_code_sizes = { 0 },
+        .profile = NULL,
+        .symbols = NULL,
+        .loop_depth = 0,
+        .profile_data = NULL,
+        .deferred = NULL,
+        .deferred_length = 0,
+        .deferred_capacity = 0,
+        .segment_offset = 0,
+        .dirty_margin = 0,
+        .cell_width = CellWidth_8,
+        .outline_loops = false,
+        .unroll_loops = true,
+        .outlined = NULL,
+        .outline_parent = -1,
+        .outlined_calls = NULL,
+        .outlined_calls_length = 0,
+        .outlined_calls_capacity = 0,
+        .avx2 = __builtin_cpu_supports("avx2"),
+        .fuel = false,
+        .resumable = false,
+        .exits = NULL,
+        .exits_length = 0,
+        .exits_capacity = 0,
+        .resume_points = NULL,
+        .resume_points_length = 0,
+        .resume_points_capacity = 0,
+        .resume_jump_pos = 0,
+        .helper_calls = NULL,
+        .helper_calls_length = 0,
+        .helper_calls_capacity = 0,
+        .threads = 1,
     };
 }
 
+void emitter_destroy(Emitter* emitter)
+{
+    free(emitter->code);
+    free(emitter->deferred);
+    if (emitter->outlined != NULL) {
+        expr_table_destroy(&emitter->outline_table);
+        free(emitter->outlined);
+    }
+    free(emitter->outlined_calls);
+    free(emitter->exits);
+    free(emitter->resume_points);
+    free(emitter->helper_calls);
+}
+
+void* emitter_install(const Emitter* emitter, size_t* mapped_size)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (emitter->pos + page_size - 1) / page_size * page_size;
+    if (size == 0) {
+        size = page_size;
+    }
+    void* code = mmap(
+        NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    if (code == MAP_FAILED) {
+        fprintf(stderr, "panic: could not mmap\n");
+        exit(1);
+    }
+    memcpy(code, emitter->code, emitter->pos);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "panic: could not mprotect\n");
+        exit(1);
+    }
+    *mapped_size = size;
+    return code;
+}
+
+// installs the code into a sealed memfd, so that other processes can map
+// the same physical pages, either inherited through fork or passed over a
+// unix socket
+void* emitter_install_shared(
+    const Emitter* emitter, size_t* mapped_size, int* fd
+)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (emitter->pos + page_size - 1) / page_size * page_size;
+    if (size == 0) {
+        size = page_size;
+    }
+    *fd = memfd_create("bfjit", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd < 0) {
+        fprintf(stderr, "panic: could not create memfd\n");
+        exit(1);
+    }
+    if (ftruncate(*fd, (off_t)size) != 0) {
+        fprintf(stderr, "panic: could not resize memfd\n");
+        exit(1);
+    }
+    size_t written = 0;
+    while (written < emitter->pos) {
+        ssize_t result
+            = write(*fd, emitter->code + written, emitter->pos - written);
+        if (result <= 0) {
+            fprintf(stderr, "panic: could not write memfd\n");
+            exit(1);
+        }
+        written += (size_t)result;
+    }
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+    if (fcntl(*fd, F_ADD_SEALS, seals) != 0) {
+        fprintf(stderr, "panic: could not seal memfd\n");
+        exit(1);
+    }
+    void* code = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, *fd, 0);
+    if (code == MAP_FAILED) {
+        fprintf(stderr, "panic: could not mmap\n");
+        exit(1);
+    }
+    *mapped_size = size;
+    return code;
+}
+
+void code_region_construct(CodeRegion* region, size_t size)
+{
+    void* base = mmap(
+        NULL,
+        size,
+        PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "panic: could not mmap\n");
+        exit(1);
+    }
+    *region = (CodeRegion) {
+        .base = base,
+        .size = size,
+        .length = 0,
+    };
+}
+
+void code_region_destroy(CodeRegion* region)
+{
+    munmap(region->base, region->size);
+}
+
+// appends the code to the region, 16 byte aligned. Only the pages the code
+// lands on are made writable while it is copied, and the last of them may
+// hold the end of earlier code, which must not be running meanwhile
+void* emitter_install_region(const Emitter* emitter, CodeRegion* region)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (region->length + 15) / 16 * 16;
+    size_t end = start + emitter->pos;
+    if (end > region->size) {
+        fprintf(stderr, "panic: code region is full\n");
+        exit(1);
+    }
+    size_t first_page = start / page_size * page_size;
+    size_t last_page = (end + page_size - 1) / page_size * page_size;
+    uint8_t* pages = region->base + first_page;
+    if (mprotect(pages, last_page - first_page, PROT_READ | PROT_WRITE)
+        != 0) {
+        fprintf(stderr, "panic: could not mprotect\n");
+        exit(1);
+    }
+    memcpy(region->base + start, emitter->code, emitter->pos);
+    if (mprotect(pages, last_page - first_page, PROT_READ | PROT_EXEC)
+        != 0) {
+        fprintf(stderr, "panic: could not mprotect\n");
+        exit(1);
+    }
+    region->length = end;
+    return region->base + start;
+}
+
 void emitter_push_u8(Emitter* emitter, uint8_t value)
 {
-    emitter->code[emitter->pos] = value;
-    emitter->pos += 1;
+    if (emitter->pos + 1 > emitter->capacity) {
+        emitter->capacity *= 2;
+        emitter->code = realloc(emitter->code, emitter->capacity);
+    }
+    emitter->code[emitter->pos] = value;
+    emitter->pos += 1;
+}
+
+void emitter_push_u32(Emitter* emitter, uint32_t value)
+{
+    emitter_push_u8(emitter, value & 0xFF);
+    emitter_push_u8(emitter, (value >> 8) & 0xFF);
+    emitter_push_u8(emitter, (value >> 16) & 0xFF);
+    emitter_push_u8(emitter, value >> 24);
+}
+
+void emitter_push_u64(Emitter* emitter, uint64_t value)
+{
+    emitter_push_u32(emitter, value & 0xFFFFFFFF);
+    emitter_push_u32(emitter, value >> 32);
+}
+
+void emitter_push_bytes(Emitter* emitter, const uint8_t* bytes, size_t count)
+{
+    while (emitter->pos + count > emitter->capacity) {
+        emitter->capacity *= 2;
+    }
+    emitter->code = realloc(emitter->code, emitter->capacity);
+    memcpy(emitter->code + emitter->pos, bytes, count);
+    emitter->pos += count;
+}
+
+inline bool is_8(int value) { return value >= -128 && value <= 127; }
+inline bool is_16(int value) { return value >= -32768 && value <= 32767; }
+
+void emitter_emit_counter_increment(Emitter* emitter, int index)
+{
+    int displacement = index * (int)sizeof(uint64_t);
+    if (is_8(displacement)) {
+        // inc QWORD [r14 + <displacement: rel8>]
+        emitter_push_u8(emitter, 0x49);
+        emitter_push_u8(emitter, 0xff);
+        emitter_push_u8(emitter, 0x46);
+        emitter_push_u8(emitter, (uint8_t)displacement);
+    } else {
+        // inc QWORD [r14 + <displacement: rel32>]
+        emitter_push_u8(emitter, 0x49);
+        emitter_push_u8(emitter, 0xff);
+        emitter_push_u8(emitter, 0x86);
+        emitter_push_u32(emitter, (uint32_t)displacement);
+    }
+    emitter->cmp_flags_set = false;
+}
+
+/*
+ *  dirty range
+ *
+ *  r13 holds the highest tape pointer seen at a tracking point, and is
+ *  stored in the run context on return. Tracking points are the function
+ *  entry and the start and exit of every loop whose pointer movement is not
+ *  statically balanced. Between tracking points the pointer offset is known
+ *  at compile time, so the largest offset written to from a tracking point
+ *  becomes a static margin. Everything written lies below the high water
+ *  mark plus the margin. Offsets and the margin are in bytes.
+ *
+ */
+
+// records a write to the cell at offset, in cells, from the tape pointer
+void emitter_touch(Emitter* emitter, int offset)
+{
+    int width = (int)emitter->cell_width;
+    int reach = emitter->segment_offset + offset * width + width - 1;
+    if (reach > 0 && (size_t)reach > emitter->dirty_margin) {
+        emitter->dirty_margin = (size_t)reach;
+    }
+}
+
+void emitter_emit_track_high_water(Emitter* emitter)
+{
+    // cmp r13, rbx
+    emitter_push_u8(emitter, 0x49);
+    emitter_push_u8(emitter, 0x39);
+    emitter_push_u8(emitter, 0xdd);
+    // cmovb r13, rbx
+    emitter_push_u8(emitter, 0x4c);
+    emitter_push_u8(emitter, 0x0f);
+    emitter_push_u8(emitter, 0x42);
+    emitter_push_u8(emitter, 0xeb);
+    emitter->segment_offset = 0;
+    emitter->cmp_flags_set = false;
+}
+
+/*
+ *  fuel
+ *
+ *  With fuel enabled, r15 holds the number of loop iterations the program
+ *  may still run. It is loaded from the run context on entry, decremented
+ *  at the start of every loop iteration and stored back on return. When it
+ *  would go below zero the code jumps to an exit stub, which records the
+ *  tape pointer and high water mark, unwinds any outlined loop calls
+ *  through rbp and returns RunStatus_OutOfFuel. Cells and the pointer are
+ *  left as they were at the start of the iteration.
+ *
+ */
+
+void emitter_emit_fuel_check(Emitter* emitter)
+{
+    // sub r15, 1
+    emitter_push_u8(emitter, 0x49);
+    emitter_push_u8(emitter, 0x83);
+    emitter_push_u8(emitter, 0xef);
+    emitter_push_u8(emitter, 0x01);
+    // jb <exit stub: rel32>
+    emitter_push_u8(emitter, 0x0f);
+    emitter_push_u8(emitter, 0x82);
+    emitter_push_u32(emitter, 0);
+    size_t jump_pos = emitter->pos - 4;
+    // the iteration starts over when resumed
+    uint32_t resume_point
+        = emitter->resumable ? emitter_push_resume_point(emitter) : 0;
+    emitter_push_exit(emitter, jump_pos, RunStatus_OutOfFuel, resume_point);
+    emitter->cmp_flags_set = false;
+}
+
+/*
+ *  resume points
+ *
+ *  Resumable code stops before an input or output when the run context's
+ *  stop flag is set, and can be entered again at that input or output, or
+ *  at the loop iteration it ran out of fuel in. Every such place is a
+ *  resume point, numbered from 1 in emit order. Before each input and
+ *  output the code stores the point, the tape pointer and the high water
+ *  mark in the run context, which is all a checkpoint needs besides the
+ *  tape. Emitter caches are cleared at resume points, since they may be
+ *  reached from the entry.
+ *
+ *  On entry with a nonzero resume point, the tape pointer and high water
+ *  mark are loaded from the run context and a jump table at the end of the
+ *  code leads to the point. Outlined loops are not resumable, as there is
+ *  no call stack to resume into.
+ *
+ */
+
+uint32_t emitter_push_resume_point(Emitter* emitter)
+{
+    if (emitter->resume_points_length + 1 > emitter->resume_points_capacity) {
+        emitter->resume_points_capacity = emitter->resume_points_capacity == 0
+            ? 8
+            : emitter->resume_points_capacity * 2;
+        emitter->resume_points = realloc(
+            emitter->resume_points,
+            sizeof(size_t) * emitter->resume_points_capacity
+        );
+    }
+    emitter->resume_points[emitter->resume_points_length] = emitter->pos;
+    emitter->resume_points_length += 1;
+    emitter->cmp_flags_set = false;
+    emitter->rax_contains_copy = false;
+    return (uint32_t)emitter->resume_points_length;
+}
+
+// stores the state of a checkpoint and stops if asked to, before an input
+// or output
+void emitter_emit_io_resume_point(Emitter* emitter)
+{
+    uint32_t resume_point = emitter_push_resume_point(emitter);
+    // mov QWORD [r12 + <position: rel8>], rbx
+    emitter_push_u8(emitter, 0x49);
+    emitter_push_u8(emitter, 0x89);
+    emitter_push_u8(emitter, 0x5c);
+    emitter_push_u8(emitter, 0x24);
+    emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, position));
+    // mov QWORD [r12 + <high_water: rel8>], r13
+    emitter_push_u8(emitter, 0x4d);
+    emitter_push_u8(emitter, 0x89);
+    emitter_push_u8(emitter, 0x6c);
+    emitter_push_u8(emitter, 0x24);
+    emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, high_water));
+    // mov DWORD [r12 + <resume_point: rel8>], <resume point: imm32>
+    emitter_push_u8(emitter, 0x41);
+    emitter_push_u8(emitter, 0xc7);
+    emitter_push_u8(emitter, 0x44);
+    emitter_push_u8(emitter, 0x24);
+    emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, resume_point));
+    emitter_push_u32(emitter, resume_point);
+    // mov rax, QWORD [r12 + <stop: rel8>]
+    emitter_push_u8(emitter, 0x49);
+    emitter_push_u8(emitter, 0x8b);
+    emitter_push_u8(emitter, 0x44);
+    emitter_push_u8(emitter, 0x24);
+    emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, stop));
+    // cmp DWORD [rax], 0
+    emitter_push_u8(emitter, 0x83);
+    emitter_push_u8(emitter, 0x38);
+    emitter_push_u8(emitter, 0x00);
+    // jne <exit stub: rel32>
+    emitter_push_u8(emitter, 0x0f);
+    emitter_push_u8(emitter, 0x85);
+    emitter_push_u32(emitter, 0);
+    emitter_push_exit(emitter, emitter->pos - 4, RunStatus_Stopped, 0);
+}
+
+void emitter_push_exit(
+    Emitter* emitter, size_t jump_pos, RunStatus status, uint32_t resume_point
+)
+{
+    if (emitter->exits_length + 1 > emitter->exits_capacity) {
+        emitter->exits_capacity
+            = emitter->exits_capacity == 0 ? 8 : emitter->exits_capacity * 2;
+        emitter->exits = realloc(
+            emitter->exits, sizeof(ExitJump) * emitter->exits_capacity
+        );
+    }
+    emitter->exits[emitter->exits_length] = (ExitJump) {
+        .pos = jump_pos,
+        .status = status,
+        .resume_point = resume_point,
+    };
+    emitter->exits_length += 1;
+}
+
+// emits a stub for every early exit, which continue at exit_pos
+void emitter_emit_exits(Emitter* emitter, size_t exit_pos)
+{
+    if (emitter->exits_length == 0) {
+        return;
+    }
+    size_t tail_pos = emitter->pos;
+    emitter_emit_track_high_water(emitter);
+    // jmp <exit>
+    emitter_emit_jump_back(emitter, 0xeb, exit_pos);
+    for (size_t i = 0; i < emitter->exits_length; ++i) {
+        ExitJump exit = emitter->exits[i];
+        emitter_patch_u32(
+            emitter, exit.pos, (uint32_t)(emitter->pos - (exit.pos + 4))
+        );
+        if (exit.status == RunStatus_OutOfFuel) {
+            // xor r15d, r15d
+            emitter_push_u8(emitter, 0x45);
+            emitter_push_u8(emitter, 0x31);
+            emitter_push_u8(emitter, 0xff);
+        }
+        if (exit.resume_point != 0) {
+            // mov DWORD [r12 + <resume_point: rel8>], <resume point: imm32>
+            emitter_push_u8(emitter, 0x41);
+            emitter_push_u8(emitter, 0xc7);
+            emitter_push_u8(emitter, 0x44);
+            emitter_push_u8(emitter, 0x24);
+            emitter_push_u8(
+                emitter, (uint8_t)offsetof(RunContext, resume_point)
+            );
+            emitter_push_u32(emitter, exit.resume_point);
+        }
+        // mov eax, <status>
+        emitter_push_u8(emitter, 0xb8);
+        emitter_push_u32(emitter, exit.status);
+        // jmp <tail>
+        emitter_emit_jump_back(emitter, 0xeb, tail_pos);
+    }
+}
+
+// the entry jumps here with the resume point in eax
+void emitter_emit_resume_dispatch(Emitter* emitter)
+{
+    // mov rbx, QWORD [r12 + <position: rel8>]
+    emitter_push_u8(emitter, 0x49);
+    emitter_push_u8(emitter, 0x8b);
+    emitter_push_u8(emitter, 0x5c);
+    emitter_push_u8(emitter, 0x24);
+    emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, position));
+    // mov r13, QWORD [r12 + <high_water: rel8>]
+    emitter_push_u8(emitter, 0x4d);
+    emitter_push_u8(emitter, 0x8b);
+    emitter_push_u8(emitter, 0x6c);
+    emitter_push_u8(emitter, 0x24);
+    emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, high_water));
+    // lea rcx, [rip + <table: rel32>]
+    emitter_push_u8(emitter, 0x48);
+    emitter_push_u8(emitter, 0x8d);
+    emitter_push_u8(emitter, 0x0d);
+    emitter_push_u32(emitter, 0);
+    size_t table_address_pos = emitter->pos - 4;
+    // movsxd rax, DWORD [rcx + rax * 4 - 4]
+    emitter_push_u8(emitter, 0x48);
+    emitter_push_u8(emitter, 0x63);
+    emitter_push_u8(emitter, 0x44);
+    emitter_push_u8(emitter, 0x81);
+    emitter_push_u8(emitter, 0xfc);
+    // add rax, rcx
+    emitter_push_u8(emitter, 0x48);
+    emitter_push_u8(emitter, 0x01);
+    emitter_push_u8(emitter, 0xc8);
+    // jmp rax
+    emitter_push_u8(emitter, 0xff);
+    emitter_push_u8(emitter, 0xe0);
+
+    emitter_emit_align(emitter, 4);
+    size_t table_pos = emitter->pos;
+    emitter_patch_u32(
+        emitter,
+        table_address_pos,
+        (uint32_t)(table_pos - (table_address_pos + 4))
+    );
+    for (size_t i = 0; i < emitter->resume_points_length; ++i) {
+        emitter_push_u32(
+            emitter, (uint32_t)(emitter->resume_points[i] - table_pos)
+        );
+    }
+}
+
+/*
+ *  helper stubs
+ *
+ *  The read and write callbacks are called through a stub behind the
+ *  epilogue, one per callback the program uses, that loads the user
+ *  pointer and jumps on to the callback in the run context. Every input or
+ *  output is then a direct call of 5 bytes. The stub leaves the stack as
+ *  the call site had it, which is aligned for calls, and the callbacks
+ *  only clobber caller saved registers, none of which the code keeps
+ *  anything in across an input or output.
+ *
+ */
+
+void emitter_emit_context_call(Emitter* emitter, size_t callback_offset)
+{
+    // call <stub: rel32>
+    emitter_push_u8(emitter, 0xe8);
+    emitter_push_u32(emitter, 0);
+    emitter_push_helper_call(emitter, emitter->pos - 4, callback_offset);
+}
+
+void emitter_push_helper_call(
+    Emitter* emitter, size_t call_pos, size_t callback_offset
+)
+{
+    if (emitter->helper_calls_length + 1 > emitter->helper_calls_capacity) {
+        emitter->helper_calls_capacity = emitter->helper_calls_capacity == 0
+            ? 8
+            : emitter->helper_calls_capacity * 2;
+        emitter->helper_calls = realloc(
+            emitter->helper_calls,
+            sizeof(HelperCall) * emitter->helper_calls_capacity
+        );
+    }
+    emitter->helper_calls[emitter->helper_calls_length] = (HelperCall) {
+        .pos = call_pos,
+        .callback_offset = callback_offset,
+    };
+    emitter->helper_calls_length += 1;
+}
+
+void emitter_emit_helper_stubs(Emitter* emitter)
+{
+    const size_t callbacks[] = {
+        offsetof(RunContext, read),
+        offsetof(RunContext, write),
+    };
+    for (size_t i = 0; i < sizeof(callbacks) / sizeof(callbacks[0]); ++i) {
+        size_t stub_pos = 0;
+        bool emitted = false;
+        for (size_t j = 0; j < emitter->helper_calls_length; ++j) {
+            HelperCall call = emitter->helper_calls[j];
+            if (call.callback_offset != callbacks[i]) {
+                continue;
+            }
+            if (!emitted) {
+                emitter_emit_align(emitter, 16);
+                stub_pos = emitter->pos;
+                emitted = true;
+                // mov rdi, QWORD [r12 + <user: rel8>]
+                emitter_push_u8(emitter, 0x49);
+                emitter_push_u8(emitter, 0x8b);
+                emitter_push_u8(emitter, 0x7c);
+                emitter_push_u8(emitter, 0x24);
+                emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, user));
+                // jmp QWORD [r12 + <callback: rel8>]
+                emitter_push_u8(emitter, 0x41);
+                emitter_push_u8(emitter, 0xff);
+                emitter_push_u8(emitter, 0x64);
+                emitter_push_u8(emitter, 0x24);
+                emitter_push_u8(emitter, (uint8_t)callbacks[i]);
+            }
+            emitter_patch_u32(
+                emitter, call.pos, (uint32_t)(stub_pos - (call.pos + 4))
+            );
+        }
+    }
+}
+
+/*
+ *  cell width
+ *
+ *  Every instruction touching the tape is selected for the cell width at
+ *  emit time, so the generated code has no width checks. 16 bit operations
+ *  take an operand size prefix, 32 bit operations use the default operand
+ *  size, and tape offsets are scaled by the cell size.
+ *
+ */
+
+void emitter_push_operand_size_prefix(Emitter* emitter)
+{
+    if (emitter->cell_width == CellWidth_16) {
+        emitter_push_u8(emitter, 0x66);
+    }
+}
+
+// <op> <cell size> [rbx], <value>, where the operation is given by the reg
+// field of the modrm byte
+void emitter_emit_cell_arithmetic(
+    Emitter* emitter, uint8_t operation, int value
+)
+{
+    uint8_t modrm = (uint8_t)(operation << 3 | 0x03);
+    switch (emitter->cell_width) {
+        case CellWidth_8:
+            // <op> BYTE [rbx], <value: imm8>
+            emitter_push_u8(emitter, 0x80);
+            emitter_push_u8(emitter, modrm);
+            emitter_push_u8(emitter, (uint8_t)value);
+            break;
+        case CellWidth_16:
+        case CellWidth_32:
+            emitter_push_operand_size_prefix(emitter);
+            if (is_8(value)) {
+                // <op> WORD/DWORD [rbx], <value: imm8>
+                emitter_push_u8(emitter, 0x83);
+                emitter_push_u8(emitter, modrm);
+                emitter_push_u8(emitter, (uint8_t)value);
+            } else if (emitter->cell_width == CellWidth_16) {
+                // <op> WORD [rbx], <value: imm16>
+                emitter_push_u8(emitter, 0x81);
+                emitter_push_u8(emitter, modrm);
+                emitter_push_u8(emitter, value & 0xFF);
+                emitter_push_u8(emitter, (value >> 8) & 0xFF);
+            } else {
+                // <op> DWORD [rbx], <value: imm32>
+                emitter_push_u8(emitter, 0x81);
+                emitter_push_u8(emitter, modrm);
+                emitter_push_u32(emitter, (uint32_t)value);
+            }
+            break;
+    }
+}
+
+// mov <register>, <cell> [rbx + <offset>], zero extended to 32 bits, where
+// the register is given by its number and the offset is in cells
+void emitter_emit_load_cell(Emitter* emitter, uint8_t reg, int offset)
+{
+    switch (emitter->cell_width) {
+        case CellWidth_8:
+            // movzx <register>, BYTE [rbx + <offset>]
+            emitter_push_u8(emitter, 0x0f);
+            emitter_push_u8(emitter, 0xb6);
+            break;
+        case CellWidth_16:
+            // movzx <register>, WORD [rbx + <offset>]
+            emitter_push_u8(emitter, 0x0f);
+            emitter_push_u8(emitter, 0xb7);
+            break;
+        case CellWidth_32:
+            // mov <register>, DWORD [rbx + <offset>]
+            emitter_push_u8(emitter, 0x8b);
+            break;
+    }
+    emitter_push_cell_address(emitter, reg, offset);
+}
+
+// <op> <cell> [rbx + <offset>], <register>, where the operation is given by
+// its 8 bit opcode, such as 0x00 for add and 0x88 for mov
+void emitter_emit_cell_register_op(
+    Emitter* emitter, uint8_t opcode, uint8_t reg, int offset
+)
+{
+    emitter_push_operand_size_prefix(emitter);
+    emitter_push_u8(
+        emitter, emitter->cell_width == CellWidth_8 ? opcode : opcode + 1
+    );
+    emitter_push_cell_address(emitter, reg, offset);
+}
+
+// the modrm byte and displacement for [rbx + <offset>]
+void emitter_push_cell_address(Emitter* emitter, uint8_t reg, int offset)
+{
+    emitter_push_tape_address(emitter, reg, offset * (int)emitter->cell_width);
+}
+
+// the modrm byte and displacement for [rbx + <displacement>], in bytes
+void emitter_push_tape_address(
+    Emitter* emitter, uint8_t reg, int displacement
+)
+{
+    if (displacement == 0) {
+        emitter_push_u8(emitter, (uint8_t)(0x03 | reg << 3));
+    } else if (is_8(displacement)) {
+        emitter_push_u8(emitter, (uint8_t)(0x43 | reg << 3));
+        emitter_push_u8(emitter, (uint8_t)displacement);
+    } else {
+        emitter_push_u8(emitter, (uint8_t)(0x83 | reg << 3));
+        emitter_push_u32(emitter, (uint32_t)displacement);
+    }
+}
+
+// adds <factor> times the current cell to the cell at <offset>, with the
+// current cell kept in eax
+void emitter_emit_multiply(Emitter* emitter, int offset, int factor)
+{
+    if (!emitter->rax_contains_copy) {
+        // mov eax, <cell> [rbx]
+        emitter_emit_load_cell(emitter, 0, 0);
+        emitter->rax_contains_copy = true;
+    }
+    if (factor == 1) {
+        // add <cell> [rbx + <offset>], al/ax/eax
+        emitter_emit_cell_register_op(emitter, 0x00, 0, offset);
+    } else {
+        if (is_8(factor)) {
+            // imul ecx, eax, <factor: imm8>
+            emitter_push_u8(emitter, 0x6b);
+            emitter_push_u8(emitter, 0xc8);
+            emitter_push_u8(emitter, (uint8_t)factor);
+        } else {
+            // imul ecx, eax, <factor: imm32>
+            emitter_push_u8(emitter, 0x69);
+            emitter_push_u8(emitter, 0xc8);
+            emitter_push_u32(emitter, (uint32_t)factor);
+        }
+        // add <cell> [rbx + <offset>], cl/cx/ecx
+        emitter_emit_cell_register_op(emitter, 0x00, 1, offset);
+    }
+    emitter_touch(emitter, offset);
+}
+
+/*
+ *  ranges
+ *
+ *  Clearing or adding the same value to a run of adjacent cells is done 32
+ *  bytes at a time with AVX2 where the host has it, then 16 bytes at a time
+ *  with SSE2, and the rest of the run with scalar instructions. AVX2 support
+ *  is checked once when the emitter is created, so the generated code
+ *  contains no feature checks. Short runs are scalar only, since setting up
+ *  a vector register costs more than it saves.
+ *
+ */
+
+#define VECTOR_RANGE_MIN_BYTES 16
+
+// mov <size> [rbx + <displacement>], 0 for a size of 8, 4, 2 or 1 bytes
+void emitter_emit_clear_bytes(Emitter* emitter, int displacement, int size)
+{
+    switch (size) {
+        case 8:
+            emitter_push_u8(emitter, 0x48);
+            emitter_push_u8(emitter, 0xc7);
+            break;
+        case 4:
+            emitter_push_u8(emitter, 0xc7);
+            break;
+        case 2:
+            emitter_push_u8(emitter, 0x66);
+            emitter_push_u8(emitter, 0xc7);
+            break;
+        default:
+            emitter_push_u8(emitter, 0xc6);
+            break;
+    }
+    emitter_push_tape_address(emitter, 0, displacement);
+    for (int i = 0; i < (size == 8 ? 4 : size); ++i) {
+        emitter_push_u8(emitter, 0x00);
+    }
+}
+
+// add <cell> [rbx + <offset>], <value>
+void emitter_emit_cell_add(Emitter* emitter, int offset, int value)
+{
+    if (emitter->cell_width == CellWidth_8) {
+        // add BYTE [rbx + <offset>], <value: imm8>
+        emitter_push_u8(emitter, 0x80);
+        emitter_push_cell_address(emitter, 0, offset);
+        emitter_push_u8(emitter, (uint8_t)value);
+        return;
+    }
+    emitter_push_operand_size_prefix(emitter);
+    if (is_8(value)) {
+        // add WORD/DWORD [rbx + <offset>], <value: imm8>
+        emitter_push_u8(emitter, 0x83);
+        emitter_push_cell_address(emitter, 0, offset);
+        emitter_push_u8(emitter, (uint8_t)value);
+    } else if (emitter->cell_width == CellWidth_16) {
+        // add WORD [rbx + <offset>], <value: imm16>
+        emitter_push_u8(emitter, 0x81);
+        emitter_push_cell_address(emitter, 0, offset);
+        emitter_push_u8(emitter, value & 0xFF);
+        emitter_push_u8(emitter, (value >> 8) & 0xFF);
+    } else {
+        // add DWORD [rbx + <offset>], <value: imm32>
+        emitter_push_u8(emitter, 0x81);
+        emitter_push_cell_address(emitter, 0, offset);
+        emitter_push_u32(emitter, (uint32_t)value);
+    }
+}
+
+// vmovdqu/movdqu/movq between xmm0 or ymm0 and [rbx + <displacement>],
+// moving size bytes, where store selects the direction
+void emitter_emit_vector_move(
+    Emitter* emitter, int displacement, int size, bool store
+)
+{
+    if (size == 32) {
+        // vmovdqu [rbx + <displacement>], ymm0 / vmovdqu ymm0, [...]
+        emitter_push_u8(emitter, 0xc5);
+        emitter_push_u8(emitter, 0xfe);
+        emitter_push_u8(emitter, store ? 0x7f : 0x6f);
+    } else if (size == 16) {
+        // movdqu [rbx + <displacement>], xmm0 / movdqu xmm0, [...]
+        emitter_push_u8(emitter, 0xf3);
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, store ? 0x7f : 0x6f);
+    } else if (store) {
+        // movq [rbx + <displacement>], xmm0
+        emitter_push_u8(emitter, 0x66);
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, 0xd6);
+    } else {
+        // movq xmm0, [rbx + <displacement>]
+        emitter_push_u8(emitter, 0xf3);
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, 0x7e);
+    }
+    emitter_push_tape_address(emitter, 0, displacement);
+}
+
+// the largest vector chunk that fits in the given number of bytes
+int emitter_vector_chunk(const Emitter* emitter, int bytes)
+{
+    if (emitter->avx2 && bytes >= 32) {
+        return 32;
+    }
+    return bytes >= 16 ? 16 : bytes >= 8 ? 8 : 0;
+}
+
+void emitter_emit_clear_range(Emitter* emitter, Expr* expr)
+{
+    int width = (int)emitter->cell_width;
+    int start = expr->offset * width;
+    int end = start + expr->length * width;
+    int bytes = end - start;
+    if (bytes >= VECTOR_RANGE_MIN_BYTES) {
+        bool wide = emitter->avx2 && bytes >= 32;
+        // vpxor ymm0, ymm0, ymm0 / pxor xmm0, xmm0
+        emitter_push_u8(emitter, wide ? 0xc5 : 0x66);
+        emitter_push_u8(emitter, wide ? 0xfd : 0x0f);
+        emitter_push_u8(emitter, 0xef);
+        emitter_push_u8(emitter, 0xc0);
+        for (int chunk; (chunk = emitter_vector_chunk(emitter, end - start));
+             start += chunk) {
+            emitter_emit_vector_move(emitter, start, chunk, true);
+        }
+        if (wide) {
+            // vzeroupper
+            emitter_push_u8(emitter, 0xc5);
+            emitter_push_u8(emitter, 0xf8);
+            emitter_push_u8(emitter, 0x77);
+        }
+    }
+    for (int size = 8; start < end; size /= 2) {
+        for (; end - start >= size; start += size) {
+            emitter_emit_clear_bytes(emitter, start, size);
+        }
+    }
+    emitter_touch(emitter, expr->offset + expr->length - 1);
+}
+
+void emitter_emit_add_range(Emitter* emitter, Expr* expr)
+{
+    int width = (int)emitter->cell_width;
+    int start = expr->offset * width;
+    int end = start + expr->length * width;
+    int bytes = end - start;
+    if (bytes >= VECTOR_RANGE_MIN_BYTES) {
+        bool wide = emitter->avx2 && bytes >= 32;
+        uint32_t value = (uint32_t)expr->value;
+        uint8_t add_opcode = 0xfe;
+        if (emitter->cell_width == CellWidth_8) {
+            value = (value & 0xFF) * 0x01010101u;
+            add_opcode = 0xfc;
+        } else if (emitter->cell_width == CellWidth_16) {
+            value = (value & 0xFFFF) * 0x00010001u;
+            add_opcode = 0xfd;
+        }
+        // mov eax, <value: imm32>
+        emitter_push_u8(emitter, 0xb8);
+        emitter_push_u32(emitter, value);
+        // movd xmm1, eax
+        emitter_push_u8(emitter, 0x66);
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, 0x6e);
+        emitter_push_u8(emitter, 0xc8);
+        // pshufd xmm1, xmm1, 0
+        emitter_push_u8(emitter, 0x66);
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, 0x70);
+        emitter_push_u8(emitter, 0xc9);
+        emitter_push_u8(emitter, 0x00);
+        if (wide) {
+            // vpbroadcastd ymm1, xmm1
+            emitter_push_u8(emitter, 0xc4);
+            emitter_push_u8(emitter, 0xe2);
+            emitter_push_u8(emitter, 0x7d);
+            emitter_push_u8(emitter, 0x58);
+            emitter_push_u8(emitter, 0xc9);
+        }
+        for (int chunk; (chunk = emitter_vector_chunk(emitter, end - start));
+             start += chunk) {
+            emitter_emit_vector_move(emitter, start, chunk, false);
+            if (chunk == 32) {
+                // vpaddb/vpaddw/vpaddd ymm0, ymm0, ymm1
+                emitter_push_u8(emitter, 0xc5);
+                emitter_push_u8(emitter, 0xfd);
+            } else {
+                // paddb/paddw/paddd xmm0, xmm1
+                emitter_push_u8(emitter, 0x66);
+                emitter_push_u8(emitter, 0x0f);
+            }
+            emitter_push_u8(emitter, add_opcode);
+            emitter_push_u8(emitter, 0xc1);
+            emitter_emit_vector_move(emitter, start, chunk, true);
+        }
+        if (wide) {
+            // vzeroupper
+            emitter_push_u8(emitter, 0xc5);
+            emitter_push_u8(emitter, 0xf8);
+            emitter_push_u8(emitter, 0x77);
+        }
+    }
+    for (; start < end; start += width) {
+        emitter_emit_cell_add(emitter, start / width, expr->value);
+    }
+    emitter_touch(emitter, expr->offset + expr->length - 1);
+}
+
+/*
+ *  multiply ranges
+ *
+ *  A MulRange adds a multiple of the current cell to every cell of a run,
+ *  with a factor per cell. The current cell is broadcast to 16 bit lanes,
+ *  or 32 bit lanes for 32 bit cells, and multiplied by the factors with
+ *  pmullw or pmulld, whose low half is the product in lane arithmetic. For
+ *  8 bit cells the products are masked to their low byte and packed back
+ *  to bytes with packuswb, which cannot saturate on them, so one multiply
+ *  does 8 cells. The factors are stored in the code behind a jump and
+ *  loaded RIP relative, which keeps the code free of relocations. pmulld
+ *  is only used when the host has AVX2. The rest of a run, and runs that
+ *  are too short or have 32 bit cells without AVX2, use scalar multiplies.
+ *
+ */
+
+// the bytes of factors loaded for a chunk of cells, one or two vectors
+static int emitter_mul_range_factor_bytes(const Emitter* emitter, int chunk)
+{
+    if (emitter->cell_width == CellWidth_8) {
+        return chunk * 2;
+    }
+    // a chunk of 8 bytes still loads a whole xmm register
+    return chunk < 16 ? 16 : chunk;
+}
+
+// <op> xmm<dest>, xmm<source> / v<op> ymm<dest>, ymm<dest>, ymm<source>,
+// for the 66 0f opcodes such as paddb, pand and pmullw
+void emitter_emit_vector_op(
+    Emitter* emitter, uint8_t opcode, uint8_t dest, uint8_t source, bool wide
+)
+{
+    if (wide) {
+        emitter_push_u8(emitter, 0xc5);
+        emitter_push_u8(emitter, (uint8_t)(0x85 | (~dest & 0x0f) << 3));
+    } else {
+        emitter_push_u8(emitter, 0x66);
+        emitter_push_u8(emitter, 0x0f);
+    }
+    emitter_push_u8(emitter, opcode);
+    emitter_push_u8(emitter, (uint8_t)(0xc0 | dest << 3 | source));
+}
+
+// movdqu xmm<reg>, [rip + <data>] / vmovdqu ymm<reg>, [...], for data
+// stored earlier in the code
+void emitter_emit_vector_constant(
+    Emitter* emitter, uint8_t reg, size_t data_pos, bool wide
+)
+{
+    emitter_push_u8(emitter, wide ? 0xc5 : 0xf3);
+    emitter_push_u8(emitter, wide ? 0xfe : 0x0f);
+    emitter_push_u8(emitter, 0x6f);
+    emitter_push_u8(emitter, (uint8_t)(0x05 | reg << 3));
+    emitter_push_u32(
+        emitter,
+        (uint32_t)((int64_t)data_pos - (int64_t)(emitter->pos + 4))
+    );
+}
+
+// multiplies the factors in xmm<reg> or ymm<reg> by the current cell in
+// xmm1 or ymm1
+static void emitter_emit_lane_multiply(
+    Emitter* emitter, uint8_t reg, bool wide
+)
+{
+    if (emitter->cell_width != CellWidth_32) {
+        // pmullw xmm<reg>, xmm1 / vpmullw ymm<reg>, ymm<reg>, ymm1
+        emitter_emit_vector_op(emitter, 0xd5, reg, 1, wide);
+        return;
+    }
+    if (wide) {
+        // vpmulld ymm<reg>, ymm<reg>, ymm1
+        emitter_push_u8(emitter, 0xc4);
+        emitter_push_u8(emitter, 0xe2);
+        emitter_push_u8(emitter, (uint8_t)(0x05 | (~reg & 0x0f) << 3));
+    } else {
+        // pmulld xmm<reg>, xmm1
+        emitter_push_u8(emitter, 0x66);
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, 0x38);
+    }
+    emitter_push_u8(emitter, 0x40);
+    emitter_push_u8(emitter, (uint8_t)(0xc1 | reg << 3));
+}
+
+// stores the factors of the cells from first on, in lanes of the given
+// number of bytes, and pads the vectors with zeros
+static void emitter_push_factors(
+    Emitter* emitter,
+    const Expr* expr,
+    size_t first,
+    int cells,
+    int lane,
+    int bytes
+)
+{
+    for (int i = 0; i < bytes / lane; ++i) {
+        uint32_t factor = i < cells
+            ? (uint32_t)expr->exprs.data[first + (size_t)i].value
+            : 0;
+        for (int j = 0; j < lane; ++j) {
+            emitter_push_u8(emitter, (uint8_t)(factor >> (j * 8)));
+        }
+    }
+}
+
+void emitter_emit_mul_range(Emitter* emitter, Expr* expr)
+{
+    int width = (int)emitter->cell_width;
+    int lane = width == 4 ? 4 : 2;
+    int start = expr->offset * width;
+    int end = start + expr->length * width;
+    size_t first = 0;
+    if (!emitter->rax_contains_copy) {
+        // mov eax, <cell> [rbx]
+        emitter_emit_load_cell(emitter, 0, 0);
+        emitter->rax_contains_copy = true;
+    }
+    if (end - start >= VECTOR_RANGE_MIN_BYTES
+        && (width != 4 || emitter->avx2)) {
+        bool wide = emitter->avx2 && end - start >= 32;
+        int factor_bytes = 0;
+        for (int at = start, chunk;
+             (chunk = emitter_vector_chunk(emitter, end - at));
+             at += chunk) {
+            factor_bytes += emitter_mul_range_factor_bytes(emitter, chunk);
+        }
+        // jmp <over the factors>
+        if (factor_bytes <= 127) {
+            emitter_push_u8(emitter, 0xeb);
+            emitter_push_u8(emitter, (uint8_t)factor_bytes);
+        } else {
+            emitter_push_u8(emitter, 0xe9);
+            emitter_push_u32(emitter, (uint32_t)factor_bytes);
+        }
+        size_t data_pos = emitter->pos;
+        for (int at = start, chunk;
+             (chunk = emitter_vector_chunk(emitter, end - at));
+             at += chunk) {
+            int bytes = emitter_mul_range_factor_bytes(emitter, chunk);
+            int cells = chunk / width;
+            size_t cell = (size_t)(at - start) / (size_t)width;
+            if (width == 1 && chunk > 8) {
+                int half = cells / 2;
+                emitter_push_factors(emitter, expr, cell, half, 2, bytes / 2);
+                emitter_push_factors(
+                    emitter,
+                    expr,
+                    cell + (size_t)half,
+                    half,
+                    2,
+                    bytes / 2
+                );
+            } else {
+                emitter_push_factors(emitter, expr, cell, cells, lane, bytes);
+            }
+        }
+
+        // movd xmm1, eax
+        emitter_push_u8(emitter, 0x66);
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, 0x6e);
+        emitter_push_u8(emitter, 0xc8);
+        if (wide) {
+            // vpbroadcastw ymm1, xmm1 / vpbroadcastd ymm1, xmm1
+            emitter_push_u8(emitter, 0xc4);
+            emitter_push_u8(emitter, 0xe2);
+            emitter_push_u8(emitter, 0x7d);
+            emitter_push_u8(emitter, lane == 2 ? 0x79 : 0x58);
+            emitter_push_u8(emitter, 0xc9);
+        } else {
+            if (lane == 2) {
+                // pshuflw xmm1, xmm1, 0
+                emitter_push_u8(emitter, 0xf2);
+                emitter_push_u8(emitter, 0x0f);
+                emitter_push_u8(emitter, 0x70);
+                emitter_push_u8(emitter, 0xc9);
+                emitter_push_u8(emitter, 0x00);
+            }
+            // pshufd xmm1, xmm1, 0
+            emitter_push_u8(emitter, 0x66);
+            emitter_push_u8(emitter, 0x0f);
+            emitter_push_u8(emitter, 0x70);
+            emitter_push_u8(emitter, 0xc9);
+            emitter_push_u8(emitter, 0x00);
+        }
+        if (width == 1) {
+            // pcmpeqw xmm3, xmm3 / vpcmpeqw ymm3, ymm3, ymm3
+            emitter_emit_vector_op(emitter, 0x75, 3, 3, wide);
+            // psrlw xmm3, 8 / vpsrlw ymm3, ymm3, 8
+            if (wide) {
+                emitter_push_u8(emitter, 0xc5);
+                emitter_push_u8(emitter, 0xe5);
+            } else {
+                emitter_push_u8(emitter, 0x66);
+                emitter_push_u8(emitter, 0x0f);
+            }
+            emitter_push_u8(emitter, 0x71);
+            emitter_push_u8(emitter, 0xd3);
+            emitter_push_u8(emitter, 0x08);
+        }
+
+        uint8_t add_opcode = width == 1 ? 0xfc : width == 2 ? 0xfd : 0xfe;
+        for (int chunk; (chunk = emitter_vector_chunk(emitter, end - start));
+             start += chunk) {
+            int bytes = emitter_mul_range_factor_bytes(emitter, chunk);
+            bool ymm = chunk == 32;
+            if (width == 1 && chunk > 8) {
+                // two vectors of 16 bit products, packed to one of bytes
+                emitter_emit_vector_constant(emitter, 2, data_pos, ymm);
+                emitter_emit_lane_multiply(emitter, 2, ymm);
+                // pand xmm2, xmm3
+                emitter_emit_vector_op(emitter, 0xdb, 2, 3, ymm);
+                emitter_emit_vector_constant(
+                    emitter, 4, data_pos + (size_t)bytes / 2, ymm
+                );
+                emitter_emit_lane_multiply(emitter, 4, ymm);
+                // pand xmm4, xmm3
+                emitter_emit_vector_op(emitter, 0xdb, 4, 3, ymm);
+                // packuswb xmm2, xmm4
+                emitter_emit_vector_op(emitter, 0x67, 2, 4, ymm);
+                if (ymm) {
+                    // vpermq ymm2, ymm2, 0xd8, as vpackuswb packs within
+                    // 128 bit halves
+                    emitter_push_u8(emitter, 0xc4);
+                    emitter_push_u8(emitter, 0xe3);
+                    emitter_push_u8(emitter, 0xfd);
+                    emitter_push_u8(emitter, 0x00);
+                    emitter_push_u8(emitter, 0xd2);
+                    emitter_push_u8(emitter, 0xd8);
+                }
+            } else {
+                emitter_emit_vector_constant(emitter, 2, data_pos, ymm);
+                emitter_emit_lane_multiply(emitter, 2, ymm);
+                if (width == 1) {
+                    // pand xmm2, xmm3
+                    emitter_emit_vector_op(emitter, 0xdb, 2, 3, false);
+                    // packuswb xmm2, xmm2
+                    emitter_emit_vector_op(emitter, 0x67, 2, 2, false);
+                }
+            }
+            emitter_emit_vector_move(emitter, start, chunk, false);
+            // paddb/paddw/paddd xmm0, xmm2
+            emitter_emit_vector_op(emitter, add_opcode, 0, 2, ymm);
+            emitter_emit_vector_move(emitter, start, chunk, true);
+            data_pos += (size_t)bytes;
+            first += (size_t)(chunk / width);
+        }
+        if (wide) {
+            // vzeroupper
+            emitter_push_u8(emitter, 0xc5);
+            emitter_push_u8(emitter, 0xf8);
+            emitter_push_u8(emitter, 0x77);
+        }
+    }
+    for (size_t i = first; i < expr->exprs.length; ++i) {
+        const Expr* cell = &expr->exprs.data[i];
+        emitter_emit_multiply(emitter, cell->offset, cell->value);
+    }
+    emitter_touch(emitter, expr->offset + expr->length - 1);
+}
+
+void emitter_emit_expr(Emitter* emitter, Expr* expr)
+{
+    size_t start_pos = emitter->pos;
+    int width = (int)emitter->cell_width;
+    emitter->cmp_flags_set = false;
+    switch (expr->type) {
+        case ExprType_Error:
+            fprintf(stderr, "panic: emitter: program contained errors\n");
+            exit(1);
+            break;
+        case ExprType_Incr:
+            // add <cell> [rbx], <value>
+            emitter_emit_cell_arithmetic(emitter, 0, expr->value);
+            emitter->cmp_flags_set = true;
+            emitter_touch(emitter, 0);
+            break;
+        case ExprType_Decr:
+            // sub <cell> [rbx], <value>
+            emitter_emit_cell_arithmetic(emitter, 5, expr->value);
+            emitter->cmp_flags_set = true;
+            emitter_touch(emitter, 0);
+            break;
+        case ExprType_Left:
+            if (is_8(expr->value * width)) {
+                // sub rbx, <value: rel8>
+                emitter_push_u8(emitter, 0x48);
+                emitter_push_u8(emitter, 0x83);
+                emitter_push_u8(emitter, 0xeb);
+                emitter_push_u8(emitter, (uint8_t)(expr->value * width));
+            } else {
+                // sub rbx, <value: rel32>
+                emitter_push_u8(emitter, 0x48);
+                emitter_push_u8(emitter, 0x81);
+                emitter_push_u8(emitter, 0xeb);
+                emitter_push_u32(emitter, (uint32_t)(expr->value * width));
+            }
+            emitter->segment_offset -= expr->value * width;
+            break;
+        case ExprType_Right:
+            if (is_8(expr->value * width)) {
+                // add rbx, <value: rel8>
+                emitter_push_u8(emitter, 0x48);
+                emitter_push_u8(emitter, 0x83);
+                emitter_push_u8(emitter, 0xc3);
+                emitter_push_u8(emitter, (uint8_t)(expr->value * width));
+            } else {
+                // add rbx, <value: rel32>
+                emitter_push_u8(emitter, 0x48);
+                emitter_push_u8(emitter, 0x81);
+                emitter_push_u8(emitter, 0xc3);
+                emitter_push_u32(emitter, (uint32_t)(expr->value * width));
+            }
+            emitter->segment_offset += expr->value * width;
+            break;
+        case ExprType_Output:
+            if (emitter->resumable) {
+                emitter_emit_io_resume_point(emitter);
+            }
+            switch (emitter->cell_width) {
+                case CellWidth_8:
+                    // movzx esi, BYTE [rbx]
+                    emitter_push_u8(emitter, 0x0f);
+                    emitter_push_u8(emitter, 0xb6);
+                    emitter_push_u8(emitter, 0x33);
+                    break;
+                case CellWidth_16:
+                    // movzx esi, WORD [rbx]
+                    emitter_push_u8(emitter, 0x0f);
+                    emitter_push_u8(emitter, 0xb7);
+                    emitter_push_u8(emitter, 0x33);
+                    break;
+                case CellWidth_32:
+                    // mov esi, DWORD [rbx]
+                    emitter_push_u8(emitter, 0x8b);
+                    emitter_push_u8(emitter, 0x33);
+                    break;
+            }
+            emitter_emit_context_call(emitter, offsetof(RunContext, write));
+            break;
+        case ExprType_Input:
+            if (emitter->resumable) {
+                emitter_emit_io_resume_point(emitter);
+            }
+            emitter_emit_context_call(emitter, offsetof(RunContext, read));
+            if (emitter->cell_width == CellWidth_8) {
+                // mov BYTE [rbx], al
+                emitter_push_u8(emitter, 0x88);
+                emitter_push_u8(emitter, 0x03);
+            } else {
+                // mov WORD/DWORD [rbx], ax/eax
+                emitter_push_operand_size_prefix(emitter);
+                emitter_push_u8(emitter, 0x89);
+                emitter_push_u8(emitter, 0x03);
+            }
+            emitter_touch(emitter, 0);
+            break;
+        case ExprType_Loop:
+            fprintf(stderr, "panic: emitter: unexpected loop\n");
+            exit(1);
+            break;
+        case ExprType_Zero:
+            if (emitter->cell_width == CellWidth_8) {
+                // mov BYTE [rbx], 0
+                emitter_push_u8(emitter, 0xc6);
+                emitter_push_u8(emitter, 0x03);
+            } else {
+                // mov WORD/DWORD [rbx], 0
+                emitter_push_operand_size_prefix(emitter);
+                emitter_push_u8(emitter, 0xc7);
+                emitter_push_u8(emitter, 0x03);
+            }
+            for (int i = 0; i < width; ++i) {
+                emitter_push_u8(emitter, 0x00);
+            }
+            emitter_touch(emitter, 0);
+            break;
+        case ExprType_Add:
+            emitter_emit_multiply(emitter, expr->value, 1);
+            break;
+        case ExprType_Mul:
+            emitter_emit_multiply(emitter, expr->offset, expr->value);
+            break;
+        case ExprType_ClearRange:
+            emitter_emit_clear_range(emitter, expr);
+            break;
+        case ExprType_AddRange:
+            emitter_emit_add_range(emitter, expr);
+            break;
+        case ExprType_MulRange:
+            emitter_emit_mul_range(emitter, expr);
+            break;
+        case ExprType_If:
+        case ExprType_DivMod:
+            fprintf(
+                stderr,
+                "panic: emitter: unexpected %s\n",
+                expr_type_name(expr->type)
+            );
+            exit(1);
+            break;
+    }
+    if (expr->type != ExprType_Add && expr->type != ExprType_Mul
+        && expr->type != ExprType_MulRange) {
+        emitter->rax_contains_copy = false;
+    }
+    emitter->type_code_sizes[expr->type] += emitter->pos - start_pos;
+}
+
+void emitter_patch_u32(Emitter* emitter, size_t pos, uint32_t value)
+{
+    emitter->code[pos] = value & 0xFF;
+    emitter->code[pos + 1] = (value >> 8) & 0xFF;
+    emitter->code[pos + 2] = (value >> 16) & 0xFF;
+    emitter->code[pos + 3] = value >> 24;
+}
+
+void emitter_emit_nops(Emitter* emitter, size_t count)
+{
+    static const uint8_t nops[9][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0f, 0x1f, 0x00 },
+        { 0x0f, 0x1f, 0x40, 0x00 },
+        { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+    while (count > 0) {
+        size_t length = count < 9 ? count : 9;
+        for (size_t i = 0; i < length; ++i) {
+            emitter_push_u8(emitter, nops[length - 1][i]);
+        }
+        count -= length;
+    }
+}
+
+void emitter_emit_align(Emitter* emitter, size_t alignment)
+{
+    size_t misalignment = emitter->pos % alignment;
+    if (misalignment != 0) {
+        emitter_emit_nops(emitter, alignment - misalignment);
+    }
+}
+
+void emitter_emit_cmp_zero(Emitter* emitter)
+{
+    if (emitter->cmp_flags_set) {
+        return;
+    }
+    if (emitter->cell_width == CellWidth_8) {
+        // cmp BYTE [rbx], 0
+        emitter_push_u8(emitter, 0x80);
+    } else {
+        // cmp WORD/DWORD [rbx], 0
+        emitter_push_operand_size_prefix(emitter);
+        emitter_push_u8(emitter, 0x83);
+    }
+    emitter_push_u8(emitter, 0x3b);
+    emitter_push_u8(emitter, 0x00);
+}
+
+void emitter_emit_jump_back(
+    Emitter* emitter, uint8_t short_opcode, size_t target_pos
+)
+{
+    int64_t relative_address = (int64_t)target_pos - (int64_t)emitter->pos;
+    if (relative_address - 2 >= -128) {
+        // j<cc> <target: rel8>
+        emitter_push_u8(emitter, short_opcode);
+        emitter_push_u8(emitter, (uint8_t)(relative_address - 2));
+    } else if (short_opcode == 0xeb) {
+        // jmp <target: rel32>
+        emitter_push_u8(emitter, 0xe9);
+        emitter_push_u32(emitter, (uint32_t)(relative_address - 5));
+    } else {
+        // j<cc> <target: rel32>
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, short_opcode + 0x10);
+        emitter_push_u32(emitter, (uint32_t)(relative_address - 6));
+    }
+}
+
+// emits one iteration of a loop body, after the profile counter, tracking
+// point and fuel check that every iteration starts with
+void emitter_emit_loop_iteration(
+    Emitter* emitter, Expr* expr, int loop_id, bool track_high_water
+)
+{
+    size_t start_pos = emitter->pos;
+    emitter->rax_contains_copy = false;
+    if (emitter->profile != NULL) {
+        emitter_emit_counter_increment(
+            emitter, loop_id * PROFILE_COUNTERS_PER_LOOP + PROFILE_ITERATIONS
+        );
+    }
+    if (track_high_water && !expr_loop_is_balanced(expr)) {
+        emitter_emit_track_high_water(emitter);
+    }
+    // counted loops end on their own, within a bounded number of
+    // iterations for all but 32 bit cells
+    if (emitter->fuel
+        && (emitter->cell_width == CellWidth_32
+            || !expr_loop_is_counted(expr))) {
+        emitter_emit_fuel_check(emitter);
+    }
+    emitter->type_code_sizes[ExprType_Loop] += emitter->pos - start_pos;
+
+    emitter->loop_depth += 1;
+    emitter_emit_expr_vec(emitter, &expr->exprs);
+    emitter->loop_depth -= 1;
+}
+
+/*
+ *  unrolling
+ *
+ *  Loops that are left over after optimization with a short body and no
+ *  nested control flow, such as scans and pointer walks, are unrolled. The
+ *  body is emitted several times, with a test of the current cell between
+ *  copies that leaves the loop, and the back edge after the last copy. The
+ *  first copy is emitted as usual, and its size decides how many copies fit
+ *  in UNROLL_MAX_BYTES, which also keeps every exit within a short jump. A
+ *  recorded profile caps the count at the average iterations per entry.
+ *  Only the first copy is a tracking point: the pointer offset is known at
+ *  compile time from there to the back edge, and the code after every exit
+ *  from the loop tracks the high water mark again.
+ *
+ */
+
+#define UNROLL_MAX_COPIES 8
+#define UNROLL_MAX_BYTES 112
+
+bool emitter_loop_is_unrollable(const Emitter* emitter, const Expr* expr)
+{
+    if (!emitter->unroll_loops) {
+        return false;
+    }
+    for (size_t i = 0; i < expr->exprs.length; ++i) {
+        if (expr_branches(&expr->exprs.data[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the number of copies of a loop body to emit, given the size of the first
+// copy and the test that follows it
+int emitter_unroll_factor(
+    const Emitter* emitter, const Expr* expr, size_t copy_size
+)
+{
+    size_t copies = UNROLL_MAX_BYTES / copy_size;
+    if (copies > UNROLL_MAX_COPIES) {
+        copies = UNROLL_MAX_COPIES;
+    }
+    const ProfileRecord* record = emitter->profile_data != NULL
+        ? profile_data_find(emitter->profile_data, expr->loc.offset)
+        : NULL;
+    if (record != NULL && record->entries != 0
+        && record->iterations / record->entries < copies) {
+        copies = (size_t)(record->iterations / record->entries);
+    }
+    return copies > 1 ? (int)copies : 1;
+}
+
+// emits the part of a loop that runs on every iteration, starting at the
+// target of the back edge, and leaves the flags set for the exit
+void emitter_emit_loop_body(Emitter* emitter, Expr* expr, int loop_id)
+{
+    size_t start_pos = emitter->pos;
+    emitter_emit_loop_iteration(emitter, expr, loop_id, true);
+    int copies = 1;
+    if (emitter_loop_is_unrollable(emitter, expr)) {
+        // at most a cmp of a word and a je
+        size_t test_size = emitter->cmp_flags_set ? 2 : 6;
+        copies = emitter_unroll_factor(
+            emitter, expr, emitter->pos - start_pos + test_size
+        );
+    }
+
+    size_t exit_jumps[UNROLL_MAX_COPIES];
+    for (int i = 1; i < copies; ++i) {
+        size_t test_pos = emitter->pos;
+        emitter_emit_cmp_zero(emitter);
+        // je <exit: rel8>
+        emitter_push_u8(emitter, 0x74);
+        emitter_push_u8(emitter, 0x00);
+        exit_jumps[i] = emitter->pos;
+        emitter->type_code_sizes[ExprType_Loop] += emitter->pos - test_pos;
+        emitter_emit_loop_iteration(emitter, expr, loop_id, false);
+    }
+
+    size_t tail_pos = emitter->pos;
+    emitter_emit_cmp_zero(emitter);
+    // jne <start>
+    emitter_emit_jump_back(emitter, 0x75, start_pos);
+    emitter->type_code_sizes[ExprType_Loop] += emitter->pos - tail_pos;
+    for (int i = 1; i < copies; ++i) {
+        emitter->code[exit_jumps[i] - 1]
+            = (uint8_t)(emitter->pos - exit_jumps[i]);
+    }
+
+    // all exits leave ZF set by a comparison of [rbx] against 0
+    emitter->cmp_flags_set = true;
+    emitter->rax_contains_copy = false;
+}
+
+/*
+ *  loop versions
+ *
+ *  A counted loop runs as many iterations as its cell's value at entry
+ *  says, divided by its step. When a recorded profile shows a counted loop
+ *  that is entered often and runs only a few iterations on average, each
+ *  count up to VERSION_MAX_COUNT gets a version of its own: a ladder of
+ *  body copies without any tests, entered at the copy that leaves exactly
+ *  that many to run. At entry, the cell is compared against the value that
+ *  gives each count, and any other value runs the generic loop. The ladder
+ *  is kept within VERSION_MAX_BYTES.
+ *
+ */
+
+#define VERSION_MAX_COUNT 4
+#define VERSION_MAX_BYTES 256
+#define VERSION_MIN_ENTRIES 64
+
+// the size of a copy of the body in the ladder, found by emitting one in
+// place and taking it back along with everything it recorded
+static size_t emitter_measure_iteration(
+    Emitter* emitter, Expr* expr, int loop_id
+)
+{
+    size_t pos = emitter->pos;
+    bool cmp_flags_set = emitter->cmp_flags_set;
+    bool rax_contains_copy = emitter->rax_contains_copy;
+    int segment_offset = emitter->segment_offset;
+    size_t dirty_margin = emitter->dirty_margin;
+    size_t type_code_sizes[EXPR_TYPE_COUNT];
+    memcpy(type_code_sizes, emitter->type_code_sizes, sizeof(type_code_sizes));
+    size_t exits_length = emitter->exits_length;
+    size_t resume_points_length = emitter->resume_points_length;
+    size_t helper_calls_length = emitter->helper_calls_length;
+
+    emitter->cmp_flags_set = false;
+    emitter_emit_loop_iteration(emitter, expr, loop_id, false);
+    size_t size = emitter->pos - pos;
+
+    emitter->pos = pos;
+    emitter->cmp_flags_set = cmp_flags_set;
+    emitter->rax_contains_copy = rax_contains_copy;
+    emitter->segment_offset = segment_offset;
+    emitter->dirty_margin = dirty_margin;
+    memcpy(emitter->type_code_sizes, type_code_sizes, sizeof(type_code_sizes));
+    emitter->exits_length = exits_length;
+    emitter->resume_points_length = resume_points_length;
+    emitter->helper_calls_length = helper_calls_length;
+    return size;
 }
 
-void emitter_push_u32(Emitter* emitter, uint32_t value)
+// the number of counts that get a version, 0 for none
+int emitter_loop_versions(
+    Emitter* emitter, Expr* expr, int loop_id, const ProfileRecord* record
+)
 {
-    emitter->code[emitter->pos] = value & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = (value >> 8) & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = (value >> 16) & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = value >> 24;
-    emitter->pos += 1;
+    long long step;
+    if (record == NULL || record->entries < VERSION_MIN_ENTRIES
+        || record->iterations > record->entries * VERSION_MAX_COUNT
+        || !expr_loop_counted_step(expr, &step)) {
+        return 0;
+    }
+    size_t copy_size = emitter_measure_iteration(emitter, expr, loop_id);
+    size_t versions = VERSION_MAX_BYTES / (copy_size > 0 ? copy_size : 1);
+    return versions > VERSION_MAX_COUNT ? VERSION_MAX_COUNT : (int)versions;
 }
 
-void emitter_push_u64(Emitter* emitter, uint64_t value)
+// the value of the loop's cell at entry that makes it run count iterations
+int emitter_loop_version_value(
+    const Emitter* emitter, const Expr* expr, int count
+)
 {
-    emitter->code[emitter->pos] = value & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = (value >> 8) & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = (value >> 16) & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = (value >> 24) & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = (value >> 32) & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = (value >> 40) & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = (value >> 48) & 0xFF;
-    emitter->pos += 1;
-    emitter->code[emitter->pos] = (value >> 56) & 0xFF;
-    emitter->pos += 1;
+    long long step;
+    expr_loop_counted_step(expr, &step);
+    uint32_t value = (uint32_t)((long long)count * -step);
+    if (emitter->cell_width == CellWidth_8) {
+        value &= 0xFF;
+    } else if (emitter->cell_width == CellWidth_16) {
+        value &= 0xFFFF;
+    }
+    return (int)value;
 }
 
-inline bool is_8(int value) { return value >= -128 && value <= 127; }
-inline bool is_16(int value) { return value >= -32768 && value <= 32767; }
+// emits the tests at loop entry, and returns the position of the jump to
+// each count's version
+void emitter_emit_version_tests(
+    Emitter* emitter, const Expr* expr, int versions, size_t* jumps
+)
+{
+    size_t start_pos = emitter->pos;
+    for (int count = 1; count <= versions; ++count) {
+        // cmp <cell> [rbx], <value>
+        emitter_emit_cell_arithmetic(
+            emitter, 7, emitter_loop_version_value(emitter, expr, count)
+        );
+        // je <version: rel32>
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, 0x84);
+        emitter_push_u32(emitter, 0);
+        jumps[count - 1] = emitter->pos;
+    }
+    emitter->cmp_flags_set = false;
+    emitter->type_code_sizes[ExprType_Loop] += emitter->pos - start_pos;
+}
 
-void emitter_emit_expr(Emitter* emitter, Expr* expr)
+// emits the ladder behind the generic loop, which jumps over it
+void emitter_emit_versions(
+    Emitter* emitter, Expr* expr, int loop_id, int versions, size_t* jumps
+)
 {
+    size_t start_pos = emitter->pos;
+    // jmp <end: rel32>
+    emitter_push_u8(emitter, 0xe9);
+    emitter_push_u32(emitter, 0);
+    size_t skip_pos = emitter->pos;
+    emitter->type_code_sizes[ExprType_Loop] += emitter->pos - start_pos;
+    for (int count = versions; count >= 1; --count) {
+        emitter_patch_u32(
+            emitter,
+            jumps[count - 1] - 4,
+            (uint32_t)(emitter->pos - jumps[count - 1])
+        );
+        emitter->cmp_flags_set = false;
+        emitter_emit_loop_iteration(emitter, expr, loop_id, false);
+    }
+    emitter_patch_u32(
+        emitter, skip_pos - 4, (uint32_t)(emitter->pos - skip_pos)
+    );
     emitter->cmp_flags_set = false;
-    switch (expr->type) {
-        case ExprType_Error:
-            fprintf(stderr, "panic: emitter: program contained errors\n");
-            exit(1);
-            break;
-        case ExprType_Incr:
-            // add BYTE [rbx], <value, rel8>
-            emitter_push_u8(emitter, 0x80);
-            emitter_push_u8(emitter, 0x03);
-            emitter_push_u8(emitter, (uint8_t)expr->value);
-            emitter->cmp_flags_set = true;
-            break;
-        case ExprType_Decr:
-            // sub BYTE [rbx], <value: rel8>
-            emitter_push_u8(emitter, 0x80);
-            emitter_push_u8(emitter, 0x2b);
-            emitter_push_u8(emitter, (uint8_t)expr->value);
-            emitter->cmp_flags_set = true;
-            break;
-        case ExprType_Left:
-            if (is_8(expr->value)) {
-                // sub rbx, <value: rel8>
-                emitter_push_u8(emitter, 0x48);
-                emitter_push_u8(emitter, 0x83);
-                emitter_push_u8(emitter, 0xeb);
-                emitter_push_u8(emitter, (uint8_t)expr->value);
-            } else {
-                // sub rbx, <value: rel32>
-                emitter_push_u8(emitter, 0x48);
-                emitter_push_u8(emitter, 0x81);
-                emitter_push_u8(emitter, 0xeb);
-                emitter_push_u32(emitter, expr->value);
-            }
-            break;
-        case ExprType_Right:
-            if (is_8(expr->value)) {
-                // add rbx, <value: rel8>
-                emitter_push_u8(emitter, 0x48);
-                emitter_push_u8(emitter, 0x83);
-                emitter_push_u8(emitter, 0xc3);
-                emitter_push_u8(emitter, (uint8_t)expr->value);
-            } else {
-                // add rbx, <value: rel32>
-                emitter_push_u8(emitter, 0x48);
-                emitter_push_u8(emitter, 0x81);
-                emitter_push_u8(emitter, 0xc3);
-                emitter_push_u32(emitter, expr->value);
-            }
-            break;
-        case ExprType_Output:
-            // movzx edi, BYTE [rbx]
-            emitter_push_u8(emitter, 0x0f);
-            emitter_push_u8(emitter, 0xb6);
-            emitter_push_u8(emitter, 0x3b);
-            // movabs rax, <put_char>
-            emitter_push_u8(emitter, 0x48);
-            emitter_push_u8(emitter, 0xb8);
-            emitter_push_u64(emitter, (uint64_t)put_char);
-            // call rax
-            emitter_push_u8(emitter, 0xff);
-            emitter_push_u8(emitter, 0xd0);
-            break;
-        case ExprType_Input:
-            // movabs rax, <put_char>
-            emitter_push_u8(emitter, 0x48);
-            emitter_push_u8(emitter, 0xb8);
-            emitter_push_u64(emitter, (uint64_t)get_char);
-            // call rax
-            emitter_push_u8(emitter, 0xff);
-            emitter_push_u8(emitter, 0xd0);
-            // mov BYTE [rbx], al
-            emitter_push_u8(emitter, 0x88);
-            emitter_push_u8(emitter, 0x03);
-            break;
-        case ExprType_Loop:
-            fprintf(stderr, "panic: emitter: unexpected loop\n");
-            exit(1);
-            break;
-        case ExprType_Zero:
-            // mov BYTE [rbx], 0
-            emitter_push_u8(emitter, 0xc6);
-            emitter_push_u8(emitter, 0x03);
-            emitter_push_u8(emitter, 0x00);
-            emitter->cmp_flags_set = true;
-            break;
-        case ExprType_Add:
-            if (!emitter->rax_contains_copy) {
-                // movzx rax, BYTE [rbx]
-                emitter_push_u8(emitter, 0x48);
-                emitter_push_u8(emitter, 0x0f);
-                emitter_push_u8(emitter, 0xb6);
-                emitter_push_u8(emitter, 0x03);
-                emitter->rax_contains_copy = true;
-            }
-            if (is_8(expr->value)) {
-                // add BYTE [rbx + <value: rel8>], al
-                emitter_push_u8(emitter, 0x00);
-                emitter_push_u8(emitter, 0x43);
-                emitter_push_u8(emitter, (uint8_t)expr->value);
-            } else {
-                // add BYTE [rbx + <value: rel32>], al
-                emitter_push_u8(emitter, 0x00);
-                emitter_push_u8(emitter, 0x83);
-                emitter_push_u32(emitter, expr->value);
-            }
-            break;
+    emitter->rax_contains_copy = false;
+}
+
+void emitter_push_symbol(
+    Emitter* emitter, const char* prefix, Expr* expr, size_t start_pos
+)
+{
+    if (emitter->symbols == NULL || emitter->loop_depth != 0) {
+        return;
+    }
+    PerfSymbol symbol = {
+        .start = start_pos,
+        .size = emitter->pos - start_pos,
+    };
+    snprintf(
+        symbol.name,
+        sizeof(symbol.name),
+        "%s_%d_%d",
+        prefix,
+        expr->loc.line,
+        expr->loc.column
+    );
+    perf_symbol_vec_push(emitter->symbols, symbol);
+}
+
+/*
+ *  With a recorded profile, loop heads that run many iterations per entry
+ *  are aligned to 16 bytes, and loops whose body never ran are moved out of
+ *  line behind the epilogue so they do not take up space in the hot path.
+ */
+
+#define HOT_LOOP_ITERATIONS 1024
+#define HOT_LOOP_ITERATIONS_PER_ENTRY 4
+
+void emitter_emit_loop(Emitter* emitter, Expr* expr)
+{
+    size_t head_pos = emitter->pos;
+    int loop_id = emitter->loop_counter;
+    emitter->loop_counter += 1;
+    if (emitter->profile != NULL) {
+        profile_add_loop(emitter->profile, expr->loc);
+        emitter_emit_counter_increment(
+            emitter, loop_id * PROFILE_COUNTERS_PER_LOOP + PROFILE_ENTRIES
+        );
     }
-    if (expr->type != ExprType_Add) {
+    const ProfileRecord* record = emitter->profile_data != NULL
+        ? profile_data_find(emitter->profile_data, expr->loc.offset)
+        : NULL;
+
+    emitter_emit_cmp_zero(emitter);
+    if (record != NULL && record->iterations == 0) {
+        // jne <cold: rel32>
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, 0x85);
+        emitter_push_u32(emitter, 0);
+        emitter_defer_loop(emitter, expr, loop_id);
+        emitter->cmp_flags_set = true;
         emitter->rax_contains_copy = false;
+        if (!expr_loop_is_balanced(expr)) {
+            emitter_emit_track_high_water(emitter);
+        }
+        emitter->type_code_sizes[ExprType_Loop] += emitter->pos - head_pos;
+        return;
+    }
+
+    // je <end: rel32>
+    emitter_push_u8(emitter, 0x0f);
+    emitter_push_u8(emitter, 0x84);
+    emitter_push_u32(emitter, 0);
+    size_t skip_pos = emitter->pos;
+    if (record != NULL && record->iterations >= HOT_LOOP_ITERATIONS
+        && record->iterations
+            >= record->entries * HOT_LOOP_ITERATIONS_PER_ENTRY) {
+        emitter_emit_align(emitter, 16);
     }
+    emitter->type_code_sizes[ExprType_Loop] += emitter->pos - head_pos;
+
+    int versions = emitter_loop_versions(emitter, expr, loop_id, record);
+    size_t version_jumps[VERSION_MAX_COUNT];
+    emitter_emit_version_tests(emitter, expr, versions, version_jumps);
+    emitter_emit_loop_body(emitter, expr, loop_id);
+    if (versions > 0) {
+        emitter_emit_versions(emitter, expr, loop_id, versions, version_jumps);
+    }
+    emitter_patch_u32(
+        emitter, skip_pos - 4, (uint32_t)(emitter->pos - skip_pos)
+    );
+    if (!expr_loop_is_balanced(expr)) {
+        size_t exit_pos = emitter->pos;
+        emitter_emit_track_high_water(emitter);
+        emitter->type_code_sizes[ExprType_Loop] += emitter->pos - exit_pos;
+    }
+    emitter_push_symbol(emitter, "bf_loop", expr, head_pos);
 }
 
-void emitter_emit_loop(Emitter* emitter, Expr* expr)
+/*
+ *  open loops
+ *
+ *  When the source is compiled while it is read, a loop may have to be
+ *  emitted before its end has been seen. Its balance and whether it is
+ *  counted are unknown then, so every iteration tracks the high water mark
+ *  and checks fuel, as does the code after the loop.
+ *
+ */
+
+// returns the position of the body, which the jump over the loop ends at
+size_t emitter_emit_loop_open(Emitter* emitter, SourceLoc loc)
 {
-    int64_t start_loc = (int64_t)&emitter->code[emitter->pos];
-    emitter_emit_expr_vec(emitter, &expr->exprs);
-    if (!emitter->cmp_flags_set) {
-        // cmp BYTE [rbx], 0
-        emitter_push_u8(emitter, 0x80);
-        emitter_push_u8(emitter, 0x3b);
-        emitter_push_u8(emitter, 0x00);
+    size_t head_pos = emitter->pos;
+    int loop_id = emitter->loop_counter;
+    emitter->loop_counter += 1;
+    if (emitter->profile != NULL) {
+        profile_add_loop(emitter->profile, loc);
+        emitter_emit_counter_increment(
+            emitter, loop_id * PROFILE_COUNTERS_PER_LOOP + PROFILE_ENTRIES
+        );
+    }
+    emitter_emit_cmp_zero(emitter);
+    // je <end: rel32>
+    emitter_push_u8(emitter, 0x0f);
+    emitter_push_u8(emitter, 0x84);
+    emitter_push_u32(emitter, 0);
+    size_t body_pos = emitter->pos;
+    emitter->rax_contains_copy = false;
+    if (emitter->profile != NULL) {
+        emitter_emit_counter_increment(
+            emitter, loop_id * PROFILE_COUNTERS_PER_LOOP + PROFILE_ITERATIONS
+        );
     }
+    emitter_emit_track_high_water(emitter);
+    if (emitter->fuel) {
+        emitter_emit_fuel_check(emitter);
+    }
+    emitter->type_code_sizes[ExprType_Loop] += emitter->pos - head_pos;
+    emitter->loop_depth += 1;
+    return body_pos;
+}
 
-    int64_t current_loc = (int64_t)&emitter->code[emitter->pos];
-    int32_t relative_address = -(int32_t)(current_loc - start_loc);
-    if (relative_address >= -127) {
-        // jne <current_loc: rel8>
-        emitter_push_u8(emitter, 0x75);
-        emitter_push_u8(emitter, (uint8_t)relative_address - 2);
-    } else {
-        // jne <current_loc: rel32>
+void emitter_emit_loop_close(Emitter* emitter, size_t body_pos)
+{
+    emitter->loop_depth -= 1;
+    size_t tail_pos = emitter->pos;
+    emitter_emit_cmp_zero(emitter);
+    // jne <body>
+    emitter_emit_jump_back(emitter, 0x75, body_pos);
+    emitter_patch_u32(
+        emitter, body_pos - 4, (uint32_t)(emitter->pos - body_pos)
+    );
+    emitter_emit_track_high_water(emitter);
+    emitter->rax_contains_copy = false;
+    emitter->type_code_sizes[ExprType_Loop] += emitter->pos - tail_pos;
+}
+
+// the body runs at most once and is balanced, so it needs no back edge and
+// no tracking of the tape pointer
+void emitter_emit_if(Emitter* emitter, Expr* expr)
+{
+    size_t head_pos = emitter->pos;
+    emitter_emit_cmp_zero(emitter);
+    // je <end: rel32>
+    emitter_push_u8(emitter, 0x0f);
+    emitter_push_u8(emitter, 0x84);
+    emitter_push_u32(emitter, 0);
+    size_t skip_pos = emitter->pos;
+    emitter->type_code_sizes[ExprType_If] += emitter->pos - head_pos;
+
+    emitter->rax_contains_copy = false;
+    emitter_emit_expr_vec(emitter, &expr->exprs);
+    emitter_patch_u32(
+        emitter, skip_pos - 4, (uint32_t)(emitter->pos - skip_pos)
+    );
+    emitter->cmp_flags_set = false;
+    emitter->rax_contains_copy = false;
+}
+
+/*
+ *  divmod
+ *
+ *  Computes the result of a divmod loop with a single div when its
+ *  preconditions hold, and runs the original loop otherwise. The loop
+ *  leaves the tape pointer where it started, but as far as the emitter
+ *  knows it is unbalanced, so the paths join at a tracking point.
+ *
+ */
+
+void emitter_emit_divmod(Emitter* emitter, Expr* expr)
+{
+    size_t head_pos = emitter->pos;
+    int width = (int)emitter->cell_width;
+    int divisor = expr->offset;
+    size_t fallback_jumps[3];
+    size_t fallback_jumps_length = 0;
+
+    // mov eax, <cell> [rbx]
+    emitter_emit_load_cell(emitter, 0, 0);
+    // mov ecx, <cell> [rbx + <divisor>]
+    emitter_emit_load_cell(emitter, 1, divisor);
+    // cmp ecx, 2
+    emitter_push_u8(emitter, 0x83);
+    emitter_push_u8(emitter, 0xf9);
+    emitter_push_u8(emitter, 0x02);
+    // jb <fallback: rel32>
+    emitter_push_u8(emitter, 0x0f);
+    emitter_push_u8(emitter, 0x82);
+    emitter_push_u32(emitter, 0);
+    fallback_jumps[fallback_jumps_length++] = emitter->pos;
+    // the four cells after d are 4, 8 or 16 bytes
+    for (int i = 0; i < 4 * width; i += 8) {
+        if (width == 1) {
+            // cmp DWORD [rbx + <offset>], 0
+            emitter_push_u8(emitter, 0x83);
+        } else {
+            // cmp QWORD [rbx + <offset>], 0
+            emitter_push_u8(emitter, 0x48);
+            emitter_push_u8(emitter, 0x83);
+        }
+        emitter_push_u8(emitter, 0x7b);
+        emitter_push_u8(emitter, (uint8_t)((divisor + 1) * width + i));
+        emitter_push_u8(emitter, 0x00);
+        // jne <fallback: rel32>
         emitter_push_u8(emitter, 0x0f);
         emitter_push_u8(emitter, 0x85);
-        emitter_push_u32(emitter, (uint32_t)relative_address - 6);
+        emitter_push_u32(emitter, 0);
+        fallback_jumps[fallback_jumps_length++] = emitter->pos;
+    }
+    for (int offset = 1; offset < divisor; ++offset) {
+        // add <cell> [rbx + <offset>], al/ax/eax
+        emitter_emit_cell_register_op(emitter, 0x00, 0, offset);
+    }
+    // xor edx, edx
+    emitter_push_u8(emitter, 0x31);
+    emitter_push_u8(emitter, 0xd2);
+    // div ecx
+    emitter_push_u8(emitter, 0xf7);
+    emitter_push_u8(emitter, 0xf1);
+    // mov <cell> [rbx + <divisor + 2>], al/ax/eax
+    emitter_emit_cell_register_op(emitter, 0x88, 0, divisor + 2);
+    // mov <cell> [rbx + <divisor + 1>], dl/dx/edx
+    emitter_emit_cell_register_op(emitter, 0x88, 2, divisor + 1);
+    // sub ecx, edx
+    emitter_push_u8(emitter, 0x29);
+    emitter_push_u8(emitter, 0xd1);
+    // mov <cell> [rbx + <divisor>], cl/cx/ecx
+    emitter_emit_cell_register_op(emitter, 0x88, 1, divisor);
+    // xor eax, eax
+    emitter_push_u8(emitter, 0x31);
+    emitter_push_u8(emitter, 0xc0);
+    // mov <cell> [rbx], al/ax/eax
+    emitter_emit_cell_register_op(emitter, 0x88, 0, 0);
+    for (int offset = 0; offset <= divisor + 2; ++offset) {
+        emitter_touch(emitter, offset);
+    }
+    // jmp <end: rel32>
+    emitter_push_u8(emitter, 0xe9);
+    emitter_push_u32(emitter, 0);
+    size_t end_jump = emitter->pos;
+    for (size_t i = 0; i < fallback_jumps_length; ++i) {
+        emitter_patch_u32(
+            emitter,
+            fallback_jumps[i] - 4,
+            (uint32_t)(emitter->pos - fallback_jumps[i])
+        );
+    }
+    emitter->type_code_sizes[ExprType_DivMod] += emitter->pos - head_pos;
+
+    emitter->cmp_flags_set = false;
+    emitter->rax_contains_copy = false;
+    emitter_emit_loop(emitter, &expr->exprs.data[0]);
+    emitter_patch_u32(
+        emitter, end_jump - 4, (uint32_t)(emitter->pos - end_jump)
+    );
+    size_t join_pos = emitter->pos;
+    emitter_emit_track_high_water(emitter);
+    emitter->type_code_sizes[ExprType_DivMod] += emitter->pos - join_pos;
+    emitter->rax_contains_copy = false;
+}
+
+void emitter_defer_loop(Emitter* emitter, Expr* expr, int loop_id)
+{
+    if (emitter->deferred_length + 1 > emitter->deferred_capacity) {
+        emitter->deferred_capacity = emitter->deferred_capacity == 0
+            ? 8
+            : emitter->deferred_capacity * 2;
+        emitter->deferred = realloc(
+            emitter->deferred,
+            sizeof(DeferredLoop) * emitter->deferred_capacity
+        );
+    }
+    emitter->deferred[emitter->deferred_length] = (DeferredLoop) {
+        .expr = expr,
+        .loop_id = loop_id,
+        .loop_depth = emitter->loop_depth,
+        .resume_pos = emitter->pos,
+        .segment_offset = emitter->segment_offset,
+    };
+    emitter->deferred_length += 1;
+}
+
+void emitter_emit_deferred_loops(Emitter* emitter)
+{
+    // cold loops may contain cold loops themselves, which are appended to
+    // the list while it is being emitted
+    for (size_t i = 0; i < emitter->deferred_length; ++i) {
+        DeferredLoop loop = emitter->deferred[i];
+        size_t cold_pos = emitter->pos;
+        emitter_patch_u32(
+            emitter,
+            loop.resume_pos - 4,
+            (uint32_t)(cold_pos - loop.resume_pos)
+        );
+        emitter->loop_depth = loop.loop_depth;
+        emitter->segment_offset = loop.segment_offset;
+        emitter_emit_loop_body(emitter, loop.expr, loop.loop_id);
+        // jmp <resume>
+        emitter_emit_jump_back(emitter, 0xeb, loop.resume_pos);
+        emitter_push_symbol(emitter, "bf_cold", loop.expr, cold_pos);
+    }
+    emitter->loop_depth = 0;
+    emitter->deferred_length = 0;
+}
+
+/*
+ *  outlined loops
+ *
+ *  Large balanced loops that occur many times are emitted once as a
+ *  subroutine behind the epilogue, and every occurrence becomes a call.
+ *  The subroutine runs the whole loop, including the entry test, and
+ *  returns with the flags of the final comparison, which ret preserves.
+ *  Loops doing I/O are left inline, since the call would misalign the
+ *  stack for the callbacks. Writes in a subroutine are relative to the
+ *  tape pointer at the call, so each call site adds its own offset to the
+ *  subroutine's reach when the dirty margin is computed.
+ *
+ */
+
+#define OUTLINE_MIN_REPEATS 3
+#define OUTLINE_MIN_NODES 16
+
+void emitter_select_outlined_loops(Emitter* emitter, ExprVec* program)
+{
+    expr_vec_hash_loops(program);
+    expr_table_construct(&emitter->outline_table);
+    expr_table_intern_all(&emitter->outline_table, program);
+    emitter->outlined
+        = calloc(emitter->outline_table.length + 1, sizeof(OutlinedLoop));
+    for (size_t id = 0; id < emitter->outline_table.length; ++id) {
+        const ExprTableEntry* entry = &emitter->outline_table.entries[id];
+        emitter->outlined[id].selected = entry->count >= OUTLINE_MIN_REPEATS
+            && expr_vec_count_nodes(&entry->expr->exprs) + 1
+                >= OUTLINE_MIN_NODES
+            && expr_loop_is_balanced(entry->expr)
+            && !expr_vec_contains_io(&entry->expr->exprs);
+    }
+}
+
+bool emitter_emit_outlined_call(Emitter* emitter, Expr* expr)
+{
+    if (emitter->outlined == NULL) {
+        return false;
+    }
+    int id = expr_table_find(&emitter->outline_table, expr);
+    if (id < 0 || !emitter->outlined[id].selected) {
+        return false;
+    }
+    size_t start_pos = emitter->pos;
+    // call <subroutine: rel32>
+    emitter_push_u8(emitter, 0xe8);
+    emitter_push_u32(emitter, 0);
+    if (emitter->outlined_calls_length + 1 > emitter->outlined_calls_capacity) {
+        emitter->outlined_calls_capacity
+            = emitter->outlined_calls_capacity == 0
+            ? 8
+            : emitter->outlined_calls_capacity * 2;
+        emitter->outlined_calls = realloc(
+            emitter->outlined_calls,
+            sizeof(OutlinedCall) * emitter->outlined_calls_capacity
+        );
+    }
+    emitter->outlined_calls[emitter->outlined_calls_length] = (OutlinedCall) {
+        .pos = emitter->pos - 4,
+        .id = id,
+        .parent = emitter->outline_parent,
+        .segment_offset = emitter->segment_offset,
+    };
+    emitter->outlined_calls_length += 1;
+    emitter->cmp_flags_set = true;
+    emitter->rax_contains_copy = false;
+    emitter->type_code_sizes[ExprType_Loop] += emitter->pos - start_pos;
+    return true;
+}
+
+// the largest offset written by a subroutine, including the subroutines it
+// calls itself
+size_t emitter_outlined_reach(Emitter* emitter, int id)
+{
+    OutlinedLoop* loop = &emitter->outlined[id];
+    if (loop->reach_resolved) {
+        return loop->reach;
+    }
+    for (size_t i = 0; i < emitter->outlined_calls_length; ++i) {
+        OutlinedCall call = emitter->outlined_calls[i];
+        if (call.parent != id) {
+            continue;
+        }
+        int reach = call.segment_offset
+            + (int)emitter_outlined_reach(emitter, call.id);
+        if (reach > 0 && (size_t)reach > loop->reach) {
+            loop->reach = (size_t)reach;
+        }
+    }
+    loop->reach_resolved = true;
+    return loop->reach;
+}
+
+void emitter_emit_outlined_loops(Emitter* emitter)
+{
+    // subroutines may call other subroutines, whose calls are appended to
+    // the list while it is being emitted
+    for (size_t i = 0; i < emitter->outlined_calls_length; ++i) {
+        int id = emitter->outlined_calls[i].id;
+        OutlinedLoop* loop = &emitter->outlined[id];
+        if (loop->emitted) {
+            continue;
+        }
+        Expr* expr = emitter->outline_table.entries[id].expr;
+        emitter_emit_align(emitter, 16);
+        size_t dirty_margin = emitter->dirty_margin;
+        loop->pos = emitter->pos;
+        loop->emitted = true;
+        emitter->dirty_margin = 0;
+        emitter->segment_offset = 0;
+        emitter->outline_parent = id;
+        emitter->loop_depth = 1;
+        emitter->cmp_flags_set = false;
+        emitter->rax_contains_copy = false;
+        emitter_emit_loop(emitter, expr);
+        // ret
+        emitter_push_u8(emitter, 0xc3);
+        emitter_emit_deferred_loops(emitter);
+        emitter_push_symbol(emitter, "bf_outlined", expr, loop->pos);
+        loop->reach = emitter->dirty_margin;
+        emitter->dirty_margin = dirty_margin;
+    }
+    emitter->outline_parent = -1;
+
+    for (size_t i = 0; i < emitter->outlined_calls_length; ++i) {
+        OutlinedCall call = emitter->outlined_calls[i];
+        emitter_patch_u32(
+            emitter,
+            call.pos,
+            (uint32_t)(emitter->outlined[call.id].pos - (call.pos + 4))
+        );
+        if (call.parent == -1) {
+            int reach = call.segment_offset
+                + (int)emitter_outlined_reach(emitter, call.id);
+            if (reach > 0 && (size_t)reach > emitter->dirty_margin) {
+                emitter->dirty_margin = (size_t)reach;
+            }
+        }
     }
 }
 
@@ -201,14 +2142,20 @@ void emitter_emit_expr_vec(Emitter* emitter, ExprVec* vec)
     for (size_t i = 0; i < vec->length; ++i) {
         Expr* expr = &vec->data[i];
         if (expr->type == ExprType_Loop) {
-            emitter_emit_loop(emitter, expr);
+            if (!emitter_emit_outlined_call(emitter, expr)) {
+                emitter_emit_loop(emitter, expr);
+            }
+        } else if (expr->type == ExprType_If) {
+            emitter_emit_if(emitter, expr);
+        } else if (expr->type == ExprType_DivMod) {
+            emitter_emit_divmod(emitter, expr);
         } else {
             emitter_emit_expr(emitter, expr);
         }
     }
 }
 
-void emitter_emit_program(Emitter* emitter, ExprVec* program)
+void emitter_emit_prologue(Emitter* emitter)
 {
     // push rbp:
     emitter_push_u8(emitter, 0x55);
@@ -218,17 +2165,302 @@ void emitter_emit_program(Emitter* emitter, ExprVec* program)
     emitter_push_u8(emitter, 0xe5);
     // push rbx:
     emitter_push_u8(emitter, 0x53);
+    // push r12
+    emitter_push_u8(emitter, 0x41);
+    emitter_push_u8(emitter, 0x54);
+    // push r13
+    emitter_push_u8(emitter, 0x41);
+    emitter_push_u8(emitter, 0x55);
+    // push r14, which also keeps the stack 16 byte aligned for calls
+    emitter_push_u8(emitter, 0x41);
+    emitter_push_u8(emitter, 0x56);
+    if (emitter->fuel) {
+        // push r15
+        emitter_push_u8(emitter, 0x41);
+        emitter_push_u8(emitter, 0x57);
+        // sub rsp, 8
+        emitter_push_u8(emitter, 0x48);
+        emitter_push_u8(emitter, 0x83);
+        emitter_push_u8(emitter, 0xec);
+        emitter_push_u8(emitter, 0x08);
+        // mov r15, QWORD [rsi + <fuel: rel8>]
+        emitter_push_u8(emitter, 0x4c);
+        emitter_push_u8(emitter, 0x8b);
+        emitter_push_u8(emitter, 0x7e);
+        emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, fuel));
+    }
     // mov rbx, rdi
     emitter_push_u8(emitter, 0x48);
     emitter_push_u8(emitter, 0x89);
     emitter_push_u8(emitter, 0xfb);
+    // mov r12, rsi
+    emitter_push_u8(emitter, 0x49);
+    emitter_push_u8(emitter, 0x89);
+    emitter_push_u8(emitter, 0xf4);
+    // mov r13, rbx
+    emitter_push_u8(emitter, 0x49);
+    emitter_push_u8(emitter, 0x89);
+    emitter_push_u8(emitter, 0xdd);
+    if (emitter->profile != NULL) {
+        // mov r14, QWORD [r12 + <counters: rel8>]
+        emitter_push_u8(emitter, 0x4d);
+        emitter_push_u8(emitter, 0x8b);
+        emitter_push_u8(emitter, 0x74);
+        emitter_push_u8(emitter, 0x24);
+        emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, counters));
+    }
+    if (emitter->resumable) {
+        // mov eax, DWORD [r12 + <resume_point: rel8>]
+        emitter_push_u8(emitter, 0x41);
+        emitter_push_u8(emitter, 0x8b);
+        emitter_push_u8(emitter, 0x44);
+        emitter_push_u8(emitter, 0x24);
+        emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, resume_point));
+        // test eax, eax
+        emitter_push_u8(emitter, 0x85);
+        emitter_push_u8(emitter, 0xc0);
+        // jnz <resume dispatch: rel32>
+        emitter_push_u8(emitter, 0x0f);
+        emitter_push_u8(emitter, 0x85);
+        emitter_push_u32(emitter, 0);
+        emitter->resume_jump_pos = emitter->pos - 4;
+    }
+    emitter->segment_offset = 0;
+    emitter->dirty_margin = 0;
+}
 
-    emitter_emit_expr_vec(emitter, program);
-
+// everything after the code of the program: the return, and the code it
+// jumps to out of line
+void emitter_emit_epilogue(Emitter* emitter)
+{
+    // xor eax, eax
+    emitter_push_u8(emitter, 0x31);
+    emitter_push_u8(emitter, 0xc0);
+    size_t exit_pos = emitter->pos;
+    // mov QWORD [r12 + <high_water: rel8>], r13
+    emitter_push_u8(emitter, 0x4d);
+    emitter_push_u8(emitter, 0x89);
+    emitter_push_u8(emitter, 0x6c);
+    emitter_push_u8(emitter, 0x24);
+    emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, high_water));
+    // mov QWORD [r12 + <position: rel8>], rbx
+    emitter_push_u8(emitter, 0x49);
+    emitter_push_u8(emitter, 0x89);
+    emitter_push_u8(emitter, 0x5c);
+    emitter_push_u8(emitter, 0x24);
+    emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, position));
+    if (emitter->fuel) {
+        // mov QWORD [r12 + <fuel: rel8>], r15
+        emitter_push_u8(emitter, 0x4d);
+        emitter_push_u8(emitter, 0x89);
+        emitter_push_u8(emitter, 0x7c);
+        emitter_push_u8(emitter, 0x24);
+        emitter_push_u8(emitter, (uint8_t)offsetof(RunContext, fuel));
+        // lea rsp, [rbp - 40], dropping the return addresses of outlined
+        // loops the fuel ran out in
+        emitter_push_u8(emitter, 0x48);
+        emitter_push_u8(emitter, 0x8d);
+        emitter_push_u8(emitter, 0x65);
+        emitter_push_u8(emitter, 0xd8);
+        // pop r15
+        emitter_push_u8(emitter, 0x41);
+        emitter_push_u8(emitter, 0x5f);
+    }
+    // pop r14
+    emitter_push_u8(emitter, 0x41);
+    emitter_push_u8(emitter, 0x5e);
+    // pop r13
+    emitter_push_u8(emitter, 0x41);
+    emitter_push_u8(emitter, 0x5d);
+    // pop r12
+    emitter_push_u8(emitter, 0x41);
+    emitter_push_u8(emitter, 0x5c);
     // pop rbx
     emitter_push_u8(emitter, 0x5b);
-    // pop rbx
+    // pop rbp
     emitter_push_u8(emitter, 0x5d);
     // ret
     emitter_push_u8(emitter, 0xc3);
+
+    emitter_emit_deferred_loops(emitter);
+    emitter_emit_outlined_loops(emitter);
+    emitter_emit_helper_stubs(emitter);
+    emitter_emit_exits(emitter, exit_pos);
+    if (emitter->resumable) {
+        emitter_patch_u32(
+            emitter,
+            emitter->resume_jump_pos,
+            (uint32_t)(emitter->pos - (emitter->resume_jump_pos + 4))
+        );
+        emitter_emit_resume_dispatch(emitter);
+    }
+}
+
+/*
+ *  parallel emission
+ *
+ *  Large programs are split at the top level after loops, and every chunk
+ *  is emitted on its own by a fresh emitter. The code of a chunk only
+ *  jumps within itself, except for its exits and helper calls, so the
+ *  chunks are linked by appending their code and moving those along. Each
+ *  chunk starts at a tracking point, as its dirty range is computed from
+ *  offset zero.
+ *
+ *  Profiling, perf symbols, outlined loops and resume points number their
+ *  loops or calls across the whole program, so those are emitted in one
+ *  piece.
+ *
+ */
+
+#define EMITTER_PARALLEL_MIN_NODES 16384
+#define EMITTER_CHUNKS_PER_THREAD 4
+
+typedef struct {
+    const Emitter* parent;
+    ExprVec* program;
+    const size_t* ends;
+    Emitter* chunks;
+} ParallelEmission;
+
+static void emitter_emit_chunk(void* user, size_t index)
+{
+    ParallelEmission* work = user;
+    size_t start = index == 0 ? 0 : work->ends[index - 1];
+    work->chunks[index] = emitter_create_chunk(work->parent);
+    ExprVec nodes = {
+        .data = &work->program->data[start],
+        .capacity = work->ends[index] - start,
+        .length = work->ends[index] - start,
+    };
+    emitter_emit_expr_vec(&work->chunks[index], &nodes);
+}
+
+// an emitter for a part of the program, with the same code generation
+// settings
+Emitter emitter_create_chunk(const Emitter* parent)
+{
+    Emitter chunk = emitter_create();
+    chunk.cell_width = parent->cell_width;
+    chunk.unroll_loops = parent->unroll_loops;
+    chunk.avx2 = parent->avx2;
+    chunk.fuel = parent->fuel;
+    return chunk;
+}
+
+bool emitter_chunks_are_relocatable(const Emitter* emitter)
+{
+    return emitter->profile == NULL
+        && (emitter->profile_data == NULL
+            || emitter->profile_data->length == 0)
+        && emitter->symbols == NULL && !emitter->outline_loops
+        && !emitter->resumable;
+}
+
+bool emitter_can_emit_parallel(const Emitter* emitter, ExprVec* program)
+{
+    return emitter_chunks_are_relocatable(emitter)
+        && expr_vec_count_nodes(program) >= EMITTER_PARALLEL_MIN_NODES;
+}
+
+void emitter_link_chunk(Emitter* emitter, const Emitter* chunk)
+{
+    if (emitter->segment_offset != 0) {
+        emitter_emit_track_high_water(emitter);
+    }
+    size_t base = emitter->pos;
+    emitter_push_bytes(emitter, chunk->code, chunk->pos);
+    for (size_t i = 0; i < chunk->exits_length; ++i) {
+        ExitJump exit = chunk->exits[i];
+        emitter_push_exit(
+            emitter, base + exit.pos, exit.status, exit.resume_point
+        );
+    }
+    for (size_t i = 0; i < chunk->helper_calls_length; ++i) {
+        HelperCall call = chunk->helper_calls[i];
+        emitter_push_helper_call(
+            emitter, base + call.pos, call.callback_offset
+        );
+    }
+    for (size_t i = 0; i < EXPR_TYPE_COUNT; ++i) {
+        emitter->type_code_sizes[i] += chunk->type_code_sizes[i];
+    }
+    if (chunk->dirty_margin > emitter->dirty_margin) {
+        emitter->dirty_margin = chunk->dirty_margin;
+    }
+    emitter->loop_counter += chunk->loop_counter;
+    emitter->segment_offset = chunk->segment_offset;
+    emitter->cmp_flags_set = false;
+    emitter->rax_contains_copy = false;
+}
+
+void emitter_emit_parallel(Emitter* emitter, ExprVec* program, int threads)
+{
+    size_t count = (size_t)threads * EMITTER_CHUNKS_PER_THREAD;
+    size_t* ends = malloc(sizeof(size_t) * count);
+    count = expr_vec_split(program, count, ends);
+    Emitter* chunks = malloc(sizeof(Emitter) * count);
+    ParallelEmission work = {
+        .parent = emitter,
+        .program = program,
+        .ends = ends,
+        .chunks = chunks,
+    };
+    parallel_for(count, threads, emitter_emit_chunk, &work);
+    for (size_t i = 0; i < count; ++i) {
+        emitter_link_chunk(emitter, &chunks[i]);
+        emitter_destroy(&chunks[i]);
+    }
+    free(chunks);
+    free(ends);
+}
+
+// emits large top level loops by linking their code from the cache
+void emitter_emit_cached(Emitter* emitter, ExprVec* program)
+{
+    CompileCache* cache = emitter->cache;
+    for (size_t i = 0; i < program->length; ++i) {
+        Expr* expr = &program->data[i];
+        if (compile_cache_wants(expr)) {
+            emitter_link_chunk(
+                emitter, compile_cache_code(cache, emitter, expr)
+            );
+        } else {
+            ExprVec nodes = {
+                .data = expr,
+                .capacity = 1,
+                .length = 1,
+            };
+            emitter_emit_expr_vec(emitter, &nodes);
+        }
+    }
+}
+
+void emitter_emit_program(Emitter* emitter, ExprVec* program)
+{
+    emitter_emit_prologue(emitter);
+    if (emitter->cache != NULL && emitter_chunks_are_relocatable(emitter)) {
+        pthread_mutex_lock(&emitter->cache->lock);
+        bool accepted
+            = compile_cache_accepts_emitter(emitter->cache, emitter);
+        pthread_mutex_unlock(&emitter->cache->lock);
+        if (accepted) {
+            emitter_emit_cached(emitter, program);
+            emitter_emit_epilogue(emitter);
+            return;
+        }
+    }
+    int threads = parallel_thread_count(emitter->threads);
+    if (threads != 1 && emitter_can_emit_parallel(emitter, program)) {
+        emitter_emit_parallel(emitter, program, threads);
+        emitter_emit_epilogue(emitter);
+        return;
+    }
+    // outlined loops would share their profile counters between call sites,
+    // and can't be resumed into
+    if (emitter->outline_loops && emitter->profile == NULL
+        && !emitter->resumable) {
+        emitter_select_outlined_loops(emitter, program);
+    }
+    emitter_emit_expr_vec(emitter, program);
+    emitter_emit_epilogue(emitter);
 }
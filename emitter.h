@@ -2,25 +2,214 @@
 #define EMITTER_H
 
 #include "expr.h"
+#include "perf.h"
+#include "profile.h"
+#include "runtime.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+typedef struct {
+    Expr* expr;
+    int loop_id;
+    int loop_depth;
+    size_t resume_pos;
+    int segment_offset;
+} DeferredLoop;
+
+typedef struct {
+    bool selected;
+    bool emitted;
+    size_t pos;
+    size_t reach;
+    bool reach_resolved;
+} OutlinedLoop;
+
+typedef struct {
+    size_t pos;
+    int id;
+    int parent;
+    int segment_offset;
+} OutlinedCall;
+
+// a jump to the exit stub, patched once the stubs are emitted
+typedef struct {
+    size_t pos;
+    RunStatus status;
+    uint32_t resume_point;
+} ExitJump;
+
+// a call to the stub of a run context callback, patched once the stubs are
+// emitted
+typedef struct {
+    size_t pos;
+    size_t callback_offset;
+} HelperCall;
+
+typedef struct CompileCache CompileCache;
+
 typedef struct {
     uint8_t* code;
+    size_t capacity;
     size_t pos;
     int loop_counter;
     bool cmp_flags_set;
     bool rax_contains_copy;
+    size_t type_code_sizes[EXPR_TYPE_COUNT];
+    Profile* profile;
+    PerfSymbolVec* symbols;
+    int loop_depth;
+    const ProfileData* profile_data;
+    DeferredLoop* deferred;
+    size_t deferred_length;
+    size_t deferred_capacity;
+    int segment_offset;
+    size_t dirty_margin;
+    CellWidth cell_width;
+    bool outline_loops;
+    bool unroll_loops;
+    ExprTable outline_table;
+    OutlinedLoop* outlined;
+    int outline_parent;
+    OutlinedCall* outlined_calls;
+    size_t outlined_calls_length;
+    size_t outlined_calls_capacity;
+    bool avx2;
+    bool fuel;
+    bool resumable;
+    ExitJump* exits;
+    size_t exits_length;
+    size_t exits_capacity;
+    size_t* resume_points;
+    size_t resume_points_length;
+    size_t resume_points_capacity;
+    size_t resume_jump_pos;
+    HelperCall* helper_calls;
+    size_t helper_calls_length;
+    size_t helper_calls_capacity;
+    // for large programs, 0 for one per processor
+    int threads;
+    // code of loops to reuse, NULL to emit everything
+    CompileCache* cache;
 } Emitter;
 
-Emitter emitter_create(uint8_t* code_address);
+// an address range reserved up front, that code is appended to, so that
+// many small programs do not need a mapping each
+typedef struct {
+    uint8_t* base;
+    size_t size;
+    size_t length;
+} CodeRegion;
+
+void code_region_construct(CodeRegion* region, size_t size);
+void code_region_destroy(CodeRegion* region);
+
+Emitter emitter_create(void);
+void emitter_destroy(Emitter* emitter);
+void* emitter_install(const Emitter* emitter, size_t* mapped_size);
+void* emitter_install_shared(
+    const Emitter* emitter, size_t* mapped_size, int* fd
+);
+void* emitter_install_region(const Emitter* emitter, CodeRegion* region);
 void emitter_push_u8(Emitter* emitter, uint8_t value);
 void emitter_push_u32(Emitter* emitter, uint32_t value);
 void emitter_push_u64(Emitter* emitter, uint64_t value);
+void emitter_push_bytes(Emitter* emitter, const uint8_t* bytes, size_t count);
+void emitter_patch_u32(Emitter* emitter, size_t pos, uint32_t value);
+void emitter_emit_nops(Emitter* emitter, size_t count);
+void emitter_emit_align(Emitter* emitter, size_t alignment);
+void emitter_emit_cmp_zero(Emitter* emitter);
+void emitter_emit_jump_back(
+    Emitter* emitter, uint8_t short_opcode, size_t target_pos
+);
+void emitter_emit_counter_increment(Emitter* emitter, int index);
+void emitter_touch(Emitter* emitter, int offset);
+void emitter_emit_track_high_water(Emitter* emitter);
+void emitter_emit_fuel_check(Emitter* emitter);
+uint32_t emitter_push_resume_point(Emitter* emitter);
+void emitter_emit_io_resume_point(Emitter* emitter);
+void emitter_push_exit(
+    Emitter* emitter, size_t jump_pos, RunStatus status, uint32_t resume_point
+);
+void emitter_emit_exits(Emitter* emitter, size_t exit_pos);
+void emitter_emit_resume_dispatch(Emitter* emitter);
+void emitter_emit_context_call(Emitter* emitter, size_t callback_offset);
+void emitter_push_helper_call(
+    Emitter* emitter, size_t call_pos, size_t callback_offset
+);
+void emitter_emit_helper_stubs(Emitter* emitter);
+void emitter_push_operand_size_prefix(Emitter* emitter);
+void emitter_emit_cell_arithmetic(
+    Emitter* emitter, uint8_t operation, int value
+);
+void emitter_emit_load_cell(Emitter* emitter, uint8_t reg, int offset);
+void emitter_emit_cell_register_op(
+    Emitter* emitter, uint8_t opcode, uint8_t reg, int offset
+);
+void emitter_push_cell_address(Emitter* emitter, uint8_t reg, int offset);
+void emitter_push_tape_address(
+    Emitter* emitter, uint8_t reg, int displacement
+);
+void emitter_emit_multiply(Emitter* emitter, int offset, int factor);
+void emitter_emit_clear_bytes(Emitter* emitter, int displacement, int size);
+void emitter_emit_cell_add(Emitter* emitter, int offset, int value);
+void emitter_emit_vector_move(
+    Emitter* emitter, int displacement, int size, bool store
+);
+int emitter_vector_chunk(const Emitter* emitter, int bytes);
+void emitter_emit_clear_range(Emitter* emitter, Expr* expr);
+void emitter_emit_add_range(Emitter* emitter, Expr* expr);
+void emitter_emit_vector_op(
+    Emitter* emitter, uint8_t opcode, uint8_t dest, uint8_t source, bool wide
+);
+void emitter_emit_vector_constant(
+    Emitter* emitter, uint8_t reg, size_t data_pos, bool wide
+);
+void emitter_emit_mul_range(Emitter* emitter, Expr* expr);
 void emitter_emit_expr(Emitter* emitter, Expr* expr);
+void emitter_emit_loop_iteration(
+    Emitter* emitter, Expr* expr, int loop_id, bool track_high_water
+);
+bool emitter_loop_is_unrollable(const Emitter* emitter, const Expr* expr);
+int emitter_unroll_factor(
+    const Emitter* emitter, const Expr* expr, size_t copy_size
+);
+void emitter_emit_loop_body(Emitter* emitter, Expr* expr, int loop_id);
+int emitter_loop_versions(
+    Emitter* emitter, Expr* expr, int loop_id, const ProfileRecord* record
+);
+int emitter_loop_version_value(
+    const Emitter* emitter, const Expr* expr, int count
+);
+void emitter_emit_version_tests(
+    Emitter* emitter, const Expr* expr, int versions, size_t* jumps
+);
+void emitter_emit_versions(
+    Emitter* emitter, Expr* expr, int loop_id, int versions, size_t* jumps
+);
+void emitter_push_symbol(
+    Emitter* emitter, const char* prefix, Expr* expr, size_t start_pos
+);
 void emitter_emit_loop(Emitter* emitter, Expr* expr);
+size_t emitter_emit_loop_open(Emitter* emitter, SourceLoc loc);
+void emitter_emit_loop_close(Emitter* emitter, size_t body_pos);
+void emitter_emit_if(Emitter* emitter, Expr* expr);
+void emitter_emit_divmod(Emitter* emitter, Expr* expr);
+void emitter_defer_loop(Emitter* emitter, Expr* expr, int loop_id);
+void emitter_emit_deferred_loops(Emitter* emitter);
+void emitter_select_outlined_loops(Emitter* emitter, ExprVec* program);
+bool emitter_emit_outlined_call(Emitter* emitter, Expr* expr);
+void emitter_emit_outlined_loops(Emitter* emitter);
+size_t emitter_outlined_reach(Emitter* emitter, int id);
 void emitter_emit_expr_vec(Emitter* emitter, ExprVec* vec);
+void emitter_emit_prologue(Emitter* emitter);
+void emitter_emit_epilogue(Emitter* emitter);
+Emitter emitter_create_chunk(const Emitter* parent);
+bool emitter_chunks_are_relocatable(const Emitter* emitter);
+bool emitter_can_emit_parallel(const Emitter* emitter, ExprVec* program);
+void emitter_link_chunk(Emitter* emitter, const Emitter* chunk);
+void emitter_emit_parallel(Emitter* emitter, ExprVec* program, int threads);
+void emitter_emit_cached(Emitter* emitter, ExprVec* program);
 void emitter_emit_program(Emitter* emitter, ExprVec* program);
 
 #endif
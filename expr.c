@@ -1,9 +1,48 @@
 #include "expr.h"
 #include "print.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
+
+const char* expr_type_name(ExprType type)
+{
+    switch (type) {
+        case ExprType_Error:
+            return "Error";
+        case ExprType_Incr:
+            return "Incr";
+        case ExprType_Decr:
+            return "Decr";
+        case ExprType_Left:
+            return "Left";
+        case ExprType_Right:
+            return "Right";
+        case ExprType_Output:
+            return "Output";
+        case ExprType_Input:
+            return "Input";
+        case ExprType_Loop:
+            return "Loop";
+        case ExprType_Zero:
+            return "Zero";
+        case ExprType_Add:
+            return "Add";
+        case ExprType_Mul:
+            return "Mul";
+        case ExprType_If:
+            return "If";
+        case ExprType_DivMod:
+            return "DivMod";
+        case ExprType_ClearRange:
+            return "ClearRange";
+        case ExprType_AddRange:
+            return "AddRange";
+        case ExprType_MulRange:
+            return "MulRange";
+    }
+    return NULL;
+}
 
 void expr_vec_construct(ExprVec* vec)
 {
@@ -40,22 +79,17 @@ Expr expr_vec_pop(ExprVec* vec)
     return vec->data[vec->length];
 }
 
-void expr_vec_stringify(ExprVec* vec, char* acc, int depth)
+void expr_vec_print(const ExprVec* vec, FILE* stream, int depth)
 {
-    strcat(acc, color_bold);
-    strcat(acc, expr_bracket_color(depth));
-    strcat(acc, "[");
-    strcat(acc, color_reset);
+    const char* color = expr_bracket_color(depth);
+    fprintf(stream, "%s%s[%s", color_bold, color, color_reset);
     for (size_t i = 0; i < vec->length; ++i) {
         if (i != 0) {
-            strcat(acc, " ");
+            fputc(' ', stream);
         }
-        expr_stringify(&vec->data[i], acc, depth + 1);
+        expr_print(&vec->data[i], stream, depth + 1);
     }
-    strcat(acc, color_bold);
-    strcat(acc, expr_bracket_color(depth));
-    strcat(acc, "]");
-    strcat(acc, color_reset);
+    fprintf(stream, "%s%s]%s", color_bold, color, color_reset);
 }
 
 bool expr_vec_equal(const ExprVec* self, const ExprVec* other)
@@ -81,17 +115,117 @@ ExprVec expr_vec_clone(const ExprVec* original)
     return vec;
 }
 
+size_t expr_vec_count_nodes(const ExprVec* vec)
+{
+    size_t count = vec->length;
+    for (size_t i = 0; i < vec->length; ++i) {
+        if (expr_has_body(&vec->data[i])) {
+            count += expr_vec_count_nodes(&vec->data[i].exprs);
+        }
+    }
+    return count;
+}
+
+bool expr_vec_contains_io(const ExprVec* vec)
+{
+    for (size_t i = 0; i < vec->length; ++i) {
+        const Expr* expr = &vec->data[i];
+        if (expr->type == ExprType_Input || expr->type == ExprType_Output
+            || (expr_has_body(expr) && expr_vec_contains_io(&expr->exprs))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool expr_vec_contains_errors(const ExprVec* vec)
+{
+    for (size_t i = 0; i < vec->length; ++i) {
+        const Expr* expr = &vec->data[i];
+        if (expr->type == ExprType_Error
+            || (expr_has_body(expr)
+                && expr_vec_contains_errors(&expr->exprs))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// computes the net pointer movement of a sequence, fails if it depends on
+// the tape contents because of an unbalanced loop, or a divmod whose
+// fallback loop is one
+bool expr_vec_pointer_offset(const ExprVec* vec, int* offset)
+{
+    *offset = 0;
+    for (size_t i = 0; i < vec->length; ++i) {
+        const Expr* expr = &vec->data[i];
+        if (expr->type == ExprType_Left) {
+            *offset -= expr->value;
+        } else if (expr->type == ExprType_Right) {
+            *offset += expr->value;
+        } else if ((expr->type == ExprType_Loop
+                    && !expr_loop_is_balanced(expr))
+                   || expr->type == ExprType_DivMod) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// splits the sequence into at most count chunks with about the same number
+// of nodes each, ending right after a node with a body or at the end, and
+// stores where each chunk ends. Returns the number of chunks
+size_t expr_vec_split(const ExprVec* vec, size_t count, size_t* ends)
+{
+    size_t total = expr_vec_count_nodes(vec);
+    size_t chunks = 0;
+    size_t nodes = 0;
+    for (size_t i = 0; i < vec->length && chunks + 1 < count; ++i) {
+        const Expr* expr = &vec->data[i];
+        nodes += 1;
+        if (expr_has_body(expr)) {
+            nodes += expr_vec_count_nodes(&expr->exprs);
+            if (nodes * count >= total * (chunks + 1)) {
+                ends[chunks] = i + 1;
+                chunks += 1;
+            }
+        }
+    }
+    if (chunks == 0 || ends[chunks - 1] < vec->length) {
+        ends[chunks] = vec->length;
+        chunks += 1;
+    }
+    return chunks;
+}
+
 void expr_free(Expr* expr)
+{
+    if (expr_has_body(expr)) {
+        expr_vec_free(&expr->exprs);
+    }
+}
+
+bool expr_has_body(const Expr* expr)
 {
     switch (expr->type) {
         case ExprType_Loop:
-            expr_vec_free(&expr->exprs);
-            break;
+        case ExprType_If:
+        case ExprType_DivMod:
+        case ExprType_MulRange:
+            return true;
         default:
-            break;
+            return false;
     }
 }
 
+// true for the nodes whose body is code run depending on the tape, rather
+// than the cells of a MulRange
+bool expr_branches(const Expr* expr)
+{
+    return expr->type == ExprType_Loop || expr->type == ExprType_If
+        || expr->type == ExprType_DivMod;
+}
+
 const char* expr_bracket_color(int depth)
 {
     switch (depth % 3) {
@@ -105,85 +239,114 @@ const char* expr_bracket_color(int depth)
     return NULL;
 }
 
-void expr_stringify_concat_value(Expr* expr, char* acc, int depth)
+// prints the first count of a, b and c as one argument list
+static void expr_print_ints(
+    FILE* stream, int depth, int a, int b, int c, int count
+)
+{
+    const char* color = expr_bracket_color(depth);
+    fprintf(stream, "%s%s(%s%d", color_bold, color, color_reset, a);
+    if (count > 1) {
+        fprintf(stream, ", %d", b);
+    }
+    if (count > 2) {
+        fprintf(stream, ", %d", c);
+    }
+    fprintf(stream, "%s%s)%s", color_bold, color, color_reset);
+}
+
+void expr_print_value(const Expr* expr, FILE* stream, int depth)
 {
-    strcat(acc, color_bold);
-    strcat(acc, expr_bracket_color(depth));
-    strcat(acc, "(");
-    strcat(acc, color_reset);
-    char value[16] = { 0 };
-    snprintf(value, 16, "%d", expr->value);
-    strcat(acc, value);
-    strcat(acc, color_bold);
-    strcat(acc, expr_bracket_color(depth));
-    strcat(acc, ")");
-    strcat(acc, color_reset);
+    expr_print_ints(stream, depth, expr->value, 0, 0, 1);
 }
 
-void expr_stringify(Expr* expr, char* acc, int depth)
+static void expr_print_name(const char* color, const char* name, FILE* stream)
+{
+    fprintf(stream, "%s%s%s", color, name, color_reset);
+}
+
+// writes the tree straight to the stream, in time linear in its size
+void expr_print(const Expr* expr, FILE* stream, int depth)
 {
     switch (expr->type) {
         case ExprType_Error:
-            strcat(acc, color_bright_red);
-            strcat(acc, "Error");
-            strcat(acc, color_reset);
+            expr_print_name(color_bright_red, "Error", stream);
             break;
         case ExprType_Incr:
-            strcat(acc, color_yellow);
-            strcat(acc, "Incr");
-            strcat(acc, color_reset);
-            expr_stringify_concat_value(expr, acc, depth);
+            expr_print_name(color_yellow, "Incr", stream);
+            expr_print_value(expr, stream, depth);
             break;
         case ExprType_Decr:
-            strcat(acc, color_yellow);
-            strcat(acc, "Decr");
-            strcat(acc, color_reset);
-            expr_stringify_concat_value(expr, acc, depth);
+            expr_print_name(color_yellow, "Decr", stream);
+            expr_print_value(expr, stream, depth);
             break;
         case ExprType_Left:
-            strcat(acc, color_green);
-            strcat(acc, "Left");
-            strcat(acc, color_reset);
-            expr_stringify_concat_value(expr, acc, depth);
+            expr_print_name(color_green, "Left", stream);
+            expr_print_value(expr, stream, depth);
             break;
         case ExprType_Right:
-            strcat(acc, color_green);
-            strcat(acc, "Right");
-            strcat(acc, color_reset);
-            expr_stringify_concat_value(expr, acc, depth);
+            expr_print_name(color_green, "Right", stream);
+            expr_print_value(expr, stream, depth);
             break;
         case ExprType_Output:
-            strcat(acc, color_bright_gray);
-            strcat(acc, "Output");
-            strcat(acc, color_reset);
+            expr_print_name(color_bright_gray, "Output", stream);
             break;
         case ExprType_Input:
-            strcat(acc, color_bright_gray);
-            strcat(acc, "Input");
-            strcat(acc, color_reset);
+            expr_print_name(color_bright_gray, "Input", stream);
             break;
         case ExprType_Loop:
-            strcat(acc, color_bright_red);
-            strcat(acc, "Loop");
-            expr_vec_stringify(&expr->exprs, acc, depth);
-            strcat(acc, color_reset);
+            fprintf(stream, "%sLoop", color_bright_red);
+            expr_vec_print(&expr->exprs, stream, depth);
+            fputs(color_reset, stream);
             break;
         case ExprType_Zero:
-            strcat(acc, color_yellow);
-            strcat(acc, "Zero");
-            strcat(acc, color_reset);
+            expr_print_name(color_yellow, "Zero", stream);
             break;
         case ExprType_Add:
-            strcat(acc, color_cyan);
-            strcat(acc, "Add");
-            strcat(acc, color_reset);
-            expr_stringify_concat_value(expr, acc, depth);
+            expr_print_name(color_cyan, "Add", stream);
+            expr_print_value(expr, stream, depth);
+            break;
+        case ExprType_Mul:
+            expr_print_name(color_cyan, "Mul", stream);
+            expr_print_ints(stream, depth, expr->offset, expr->value, 0, 2);
+            break;
+        case ExprType_ClearRange:
+            expr_print_name(color_yellow, "ClearRange", stream);
+            expr_print_ints(stream, depth, expr->offset, expr->length, 0, 2);
+            break;
+        case ExprType_AddRange:
+            expr_print_name(color_yellow, "AddRange", stream);
+            expr_print_ints(
+                stream, depth, expr->offset, expr->length, expr->value, 3
+            );
+            break;
+        case ExprType_MulRange:
+            expr_print_name(color_cyan, "MulRange", stream);
+            expr_print_ints(stream, depth, expr->offset, expr->length, 0, 2);
+            fputs(color_cyan, stream);
+            expr_vec_print(&expr->exprs, stream, depth);
+            fputs(color_reset, stream);
+            break;
+        case ExprType_If:
+            fprintf(stream, "%sIf", color_bright_red);
+            expr_vec_print(&expr->exprs, stream, depth);
+            fputs(color_reset, stream);
+            break;
+        case ExprType_DivMod:
+            expr_print_name(color_bright_red, "DivMod", stream);
+            expr_print_ints(stream, depth, expr->offset, 0, 0, 1);
+            fputs(color_bright_red, stream);
+            expr_vec_print(&expr->exprs, stream, depth);
+            fputs(color_reset, stream);
             break;
     }
 }
 
 bool expr_equal(const Expr* self, const Expr* other)
 {
+    if (self == other) {
+        return true;
+    }
     if (self->type != other->type) {
         return false;
     }
@@ -192,11 +355,27 @@ bool expr_equal(const Expr* self, const Expr* other)
         case ExprType_Decr:
         case ExprType_Left:
         case ExprType_Right:
+        case ExprType_Add:
             if (self->value != other->value) {
                 return false;
             }
             break;
+        case ExprType_Mul:
+        case ExprType_ClearRange:
+        case ExprType_AddRange:
+            if (self->offset != other->offset || self->length != other->length
+                || self->value != other->value) {
+                return false;
+            }
+            break;
         case ExprType_Loop:
+        case ExprType_If:
+        case ExprType_DivMod:
+        case ExprType_MulRange:
+            if (self->hash != 0 && other->hash != 0
+                && self->hash != other->hash) {
+                return false;
+            }
             if (!expr_vec_equal(&self->exprs, &other->exprs)) {
                 return false;
             }
@@ -209,12 +388,231 @@ bool expr_equal(const Expr* self, const Expr* other)
 
 Expr expr_clone(const Expr* expr)
 {
-    if (expr->type == ExprType_Loop) {
+    if (expr_has_body(expr)) {
         return (Expr) {
-            .type = ExprType_Loop,
+            .type = expr->type,
+            .loc = expr->loc,
+            .hash = expr->hash,
+            .offset = expr->offset,
+            .length = expr->length,
             .exprs = expr_vec_clone(&expr->exprs),
         };
     } else {
         return *expr;
     }
 }
+
+bool expr_loop_is_balanced(const Expr* expr)
+{
+    int offset;
+    return expr_vec_pointer_offset(&expr->exprs, &offset) && offset == 0;
+}
+
+// true if the loop is balanced, has no loops inside, and only changes its
+// own cell by a constant odd step every iteration, so it ends after fewer
+// than 2 ^ cell bits iterations
+bool expr_loop_is_counted(const Expr* expr)
+{
+    long long step;
+    return expr_loop_counted_step(expr, &step);
+}
+
+// like expr_loop_is_counted, and stores the step of a counted loop
+bool expr_loop_counted_step(const Expr* expr, long long* step)
+{
+    *step = 0;
+    int offset = 0;
+    for (size_t i = 0; i < expr->exprs.length; ++i) {
+        const Expr* inner = &expr->exprs.data[i];
+        switch (inner->type) {
+            case ExprType_Left:
+                offset -= inner->value;
+                break;
+            case ExprType_Right:
+                offset += inner->value;
+                break;
+            case ExprType_Incr:
+            case ExprType_Decr:
+                if (offset == 0) {
+                    *step += inner->type == ExprType_Incr ? inner->value
+                                                          : -inner->value;
+                }
+                break;
+            case ExprType_Output:
+                break;
+            case ExprType_Add:
+                if (offset + inner->value == 0) {
+                    return false;
+                }
+                break;
+            case ExprType_Mul:
+                if (offset + inner->offset == 0) {
+                    return false;
+                }
+                break;
+            case ExprType_ClearRange:
+            case ExprType_AddRange:
+            case ExprType_MulRange:
+                if (offset + inner->offset <= 0
+                    && offset + inner->offset + inner->length > 0) {
+                    return false;
+                }
+                break;
+            case ExprType_Zero:
+            case ExprType_Input:
+                if (offset == 0) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    return offset == 0 && *step % 2 != 0;
+}
+
+/*
+ *  structural hashing
+ *
+ *  Loops, and the other nodes with a body, cache the hash of their
+ *  structure, source locations excluded, so identical subtrees can be found
+ *  without comparing them node by node. A hash of 0 means not computed yet,
+ *  which is what constructing an Expr leaves behind, so a rewritten loop
+ *  never carries a stale hash.
+ *
+ */
+
+static uint64_t hash_mix(uint64_t hash, uint64_t value)
+{
+    hash ^= value + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2);
+    return hash * 0x100000001b3;
+}
+
+uint64_t expr_vec_hash_loops(ExprVec* vec)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < vec->length; ++i) {
+        hash = hash_mix(hash, expr_hash(&vec->data[i]));
+    }
+    return hash;
+}
+
+uint64_t expr_hash(Expr* expr)
+{
+    if (!expr_has_body(expr)) {
+        uint64_t hash = hash_mix(expr->type, (uint64_t)(uint32_t)expr->value);
+        if (expr->offset != 0 || expr->length != 0) {
+            hash = hash_mix(hash, (uint64_t)(uint32_t)expr->offset);
+            hash = hash_mix(hash, (uint64_t)(uint32_t)expr->length);
+        }
+        return hash;
+    }
+    if (expr->hash == 0) {
+        expr->hash = hash_mix(expr->type, expr_vec_hash_loops(&expr->exprs));
+        if (expr->hash == 0) {
+            expr->hash = 1;
+        }
+    }
+    return expr->hash;
+}
+
+/*
+ *  expr table
+ *
+ *  Interns loops by structure. Each distinct loop gets a dense id, so two
+ *  interned loops are equal exactly when their ids are, and the table
+ *  counts how often each one occurs. Loops must have their hash computed.
+ *
+ */
+
+void expr_table_construct(ExprTable* table)
+{
+    *table = (ExprTable) {
+        .entries = malloc(sizeof(ExprTableEntry) * 8),
+        .length = 0,
+        .capacity = 8,
+        .slots = malloc(sizeof(int) * 16),
+        .slots_capacity = 16,
+    };
+    for (size_t i = 0; i < table->slots_capacity; ++i) {
+        table->slots[i] = -1;
+    }
+}
+
+void expr_table_destroy(ExprTable* table)
+{
+    free(table->entries);
+    free(table->slots);
+}
+
+static size_t expr_table_slot(const ExprTable* table, const Expr* loop)
+{
+    size_t mask = table->slots_capacity - 1;
+    size_t slot = (size_t)loop->hash & mask;
+    while (table->slots[slot] != -1) {
+        const ExprTableEntry* entry = &table->entries[table->slots[slot]];
+        if (entry->hash == loop->hash && expr_equal(entry->expr, loop)) {
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void expr_table_grow(ExprTable* table)
+{
+    free(table->slots);
+    table->slots_capacity *= 2;
+    table->slots = malloc(sizeof(int) * table->slots_capacity);
+    for (size_t i = 0; i < table->slots_capacity; ++i) {
+        table->slots[i] = -1;
+    }
+    for (size_t i = 0; i < table->length; ++i) {
+        size_t slot = expr_table_slot(table, table->entries[i].expr);
+        table->slots[slot] = (int)i;
+    }
+}
+
+int expr_table_intern(ExprTable* table, Expr* loop)
+{
+    size_t slot = expr_table_slot(table, loop);
+    if (table->slots[slot] != -1) {
+        table->entries[table->slots[slot]].count += 1;
+        return table->slots[slot];
+    }
+    if (table->length + 1 > table->capacity) {
+        table->capacity *= 2;
+        table->entries = realloc(
+            table->entries, sizeof(ExprTableEntry) * table->capacity
+        );
+    }
+    table->entries[table->length] = (ExprTableEntry) {
+        .expr = loop,
+        .hash = loop->hash,
+        .count = 1,
+    };
+    table->slots[slot] = (int)table->length;
+    table->length += 1;
+    if (table->length * 2 > table->slots_capacity) {
+        expr_table_grow(table);
+    }
+    return (int)table->length - 1;
+}
+
+int expr_table_find(const ExprTable* table, const Expr* loop)
+{
+    return table->slots[expr_table_slot(table, loop)];
+}
+
+void expr_table_intern_all(ExprTable* table, ExprVec* vec)
+{
+    for (size_t i = 0; i < vec->length; ++i) {
+        Expr* expr = &vec->data[i];
+        if (expr->type == ExprType_Loop) {
+            expr_table_intern(table, expr);
+            expr_table_intern_all(table, &expr->exprs);
+        } else if (expr->type == ExprType_If) {
+            expr_table_intern_all(table, &expr->exprs);
+        }
+    }
+}
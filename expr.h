@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef enum {
     ExprType_Error,
@@ -15,8 +17,31 @@ typedef enum {
     ExprType_Loop,
     ExprType_Zero,
     ExprType_Add,
+    ExprType_Mul,
+    ExprType_If,
+    ExprType_DivMod,
+    ExprType_ClearRange,
+    ExprType_AddRange,
+    ExprType_MulRange,
 } ExprType;
 
+#define EXPR_TYPE_COUNT (ExprType_MulRange + 1)
+
+// the size of a tape cell in bytes
+typedef enum {
+    CellWidth_8 = 1,
+    CellWidth_16 = 2,
+    CellWidth_32 = 4,
+} CellWidth;
+
+const char* expr_type_name(ExprType type);
+
+typedef struct {
+    size_t offset;
+    int line;
+    int column;
+} SourceLoc;
+
 typedef struct Expr Expr;
 
 typedef struct ExprVec {
@@ -30,24 +55,64 @@ void expr_vec_destroy(ExprVec* vec);
 void expr_vec_free(ExprVec* vec);
 void expr_vec_push(ExprVec* vec, Expr expr);
 Expr expr_vec_pop(ExprVec* vec);
-void expr_vec_stringify(ExprVec* vec, char* acc, int depth);
+void expr_vec_print(const ExprVec* vec, FILE* stream, int depth);
 bool expr_vec_equal(const ExprVec* self, const ExprVec* other);
 ExprVec expr_vec_clone(const ExprVec* original);
+size_t expr_vec_count_nodes(const ExprVec* vec);
+bool expr_vec_contains_io(const ExprVec* vec);
+bool expr_vec_contains_errors(const ExprVec* vec);
+bool expr_vec_pointer_offset(const ExprVec* vec, int* offset);
+size_t expr_vec_split(const ExprVec* vec, size_t count, size_t* ends);
 
 struct Expr {
     ExprType type;
+    SourceLoc loc;
+    uint64_t hash;
+    // the target cell of a Mul, the divisor of a DivMod or the first cell
+    // of a range, relative to the tape pointer
+    int offset;
+    // the number of cells in a range
+    int length;
     union {
         int value;
+        // a MulRange holds the Mul of every cell in its range, in order
         ExprVec exprs;
     };
 };
 
 void expr_free(Expr* expr);
+bool expr_has_body(const Expr* expr);
+bool expr_branches(const Expr* expr);
 const char* expr_bracket_color(int depth);
-void expr_stringify_concat_value(Expr* expr, char* acc, int depth);
-void expr_stringify_concat_pair(Expr* expr, char* acc, int depth);
-void expr_stringify(Expr* expr, char* acc, int depth);
+void expr_print_value(const Expr* expr, FILE* stream, int depth);
+void expr_print(const Expr* expr, FILE* stream, int depth);
 bool expr_equal(const Expr* self, const Expr* other);
 Expr expr_clone(const Expr* expr);
+bool expr_loop_is_balanced(const Expr* expr);
+bool expr_loop_is_counted(const Expr* expr);
+bool expr_loop_counted_step(const Expr* expr, long long* step);
+
+uint64_t expr_vec_hash_loops(ExprVec* vec);
+uint64_t expr_hash(Expr* expr);
+
+typedef struct {
+    Expr* expr;
+    uint64_t hash;
+    size_t count;
+} ExprTableEntry;
+
+typedef struct {
+    ExprTableEntry* entries;
+    size_t length;
+    size_t capacity;
+    int* slots;
+    size_t slots_capacity;
+} ExprTable;
+
+void expr_table_construct(ExprTable* table);
+void expr_table_destroy(ExprTable* table);
+int expr_table_intern(ExprTable* table, Expr* loop);
+int expr_table_find(const ExprTable* table, const Expr* loop);
+void expr_table_intern_all(ExprTable* table, ExprVec* vec);
 
 #endif
@@ -1,139 +1,689 @@
+#include "batch.h"
+#include "bfjit.h"
+#include "cache.h"
 #include "emitter.h"
 #include "expr.h"
 #include "optimizer.h"
 #include "parser.h"
+#include "perf.h"
 #include "print.h"
+#include "profile.h"
+#include "repl.h"
+#include "stats.h"
+#include "stream.h"
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 
-#define ADD_OPTIMIZATION_WO_FREE_AST(NAME)                                     \
-    previous_ast = ast;                                                        \
-    ast = optimize_##NAME(&ast);                                               \
-    printf("%s" #NAME ":%s\n", color_bold, color_reset);                       \
-    if (!expr_vec_equal(&ast, &previous_ast)) {                                \
-        ast_string[0] = '\0';                                                  \
-        expr_vec_stringify(&ast, ast_string, 0);                               \
-        puts(ast_string);                                                      \
-    }
+typedef enum {
+    StatsMode_None,
+    StatsMode_Text,
+    StatsMode_Json,
+} StatsMode;
 
-#define ADD_OPTIMIZATION(NAME)                                                 \
-    expr_vec_free(&previous_ast);                                              \
-    ADD_OPTIMIZATION_WO_FREE_AST(NAME)
+typedef struct {
+    const char* path;
+    StatsMode stats;
+    bool profile;
+    size_t profile_top_n;
+    bool perf_map;
+    bool jitdump;
+    const char* profile_record_path;
+    const char* profile_use_path;
+    const char* batch_path;
+    int jobs;
+    bool fork;
+    bool repl;
+    bool stream;
+    CellWidth cell_width;
+    bool outline_loops;
+    bool unroll_loops;
+    bool compile_cache;
+    const char* compile_cache_path;
+    bool dump_ast;
+    bool dump_code;
+    bool dump_tape;
+    OptimizerPipeline pipeline;
+    uint64_t fuel;
+    const char* checkpoint_path;
+    const char* resume_path;
+} Args;
 
-int main(int argc, char** argv)
+Args args_parse(int argc, char** argv)
 {
-    // const char* text = "++++++++++[>+<-]";
-    // printf("\ntext:%s\n\"%s\"%s\n", color_bright_green, text, color_reset);
-    // Parser parser = parser_create(lexer_from_string(text, strlen(text)));
-
-    Parser parser = parser_create(lexer_from_args_or_stdin(argc, argv));
-
-    char* ast_string = malloc(sizeof(char) * 33768);
-    ast_string[0] = '\0';
-
-    ExprVec ast = parser_parse(&parser);
-    {
-        expr_vec_stringify(&ast, ast_string, 0);
-        printf("\nparsed:\n%s\n", ast_string);
+    Args args = {
+        .path = NULL,
+        .stats = StatsMode_None,
+        .profile = false,
+        .profile_top_n = 10,
+        .perf_map = false,
+        .jitdump = false,
+        .profile_record_path = NULL,
+        .profile_use_path = NULL,
+        .batch_path = NULL,
+        .jobs = 0,
+        .fork = false,
+        .repl = false,
+        .stream = false,
+        .cell_width = CellWidth_8,
+        .outline_loops = false,
+        .unroll_loops = true,
+        .compile_cache = true,
+        .compile_cache_path = NULL,
+        .dump_ast = false,
+        .dump_code = false,
+        .dump_tape = false,
+        .pipeline = optimizer_pipeline_for_level(2),
+        .fuel = 0,
+        .checkpoint_path = NULL,
+        .resume_path = NULL,
+    };
+    const char* passes = NULL;
+    int max_iterations = -1;
+    double time_budget = -1.0;
+    int threads = -1;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--stats") == 0) {
+            args.stats = StatsMode_Text;
+        } else if (strcmp(arg, "--stats=json") == 0) {
+            args.stats = StatsMode_Json;
+        } else if (strcmp(arg, "--profile") == 0) {
+            args.profile = true;
+        } else if (strncmp(arg, "--profile=", 10) == 0) {
+            args.profile = true;
+            args.profile_top_n = (size_t)strtoul(arg + 10, NULL, 10);
+        } else if (strncmp(arg, "--profile-record=", 17) == 0) {
+            args.profile_record_path = arg + 17;
+        } else if (strncmp(arg, "--profile-use=", 14) == 0) {
+            args.profile_use_path = arg + 14;
+        } else if (strncmp(arg, "--batch=", 8) == 0) {
+            args.batch_path = arg + 8;
+        } else if (strncmp(arg, "--jobs=", 7) == 0) {
+            args.jobs = atoi(arg + 7);
+        } else if (strcmp(arg, "--fork") == 0) {
+            args.fork = true;
+        } else if (strcmp(arg, "--repl") == 0) {
+            args.repl = true;
+        } else if (strcmp(arg, "--stream") == 0) {
+            args.stream = true;
+        } else if (strncmp(arg, "--cell-width=", 13) == 0) {
+            int bits = atoi(arg + 13);
+            if (bits != 8 && bits != 16 && bits != 32) {
+                fprintf(stderr, "panic: cell width must be 8, 16 or 32\n");
+                exit(1);
+            }
+            args.cell_width = (CellWidth)(bits / 8);
+        } else if (strcmp(arg, "--outline-loops") == 0) {
+            args.outline_loops = true;
+        } else if (strcmp(arg, "--no-unroll-loops") == 0) {
+            args.unroll_loops = false;
+        } else if (strcmp(arg, "--no-compile-cache") == 0) {
+            args.compile_cache = false;
+        } else if (strncmp(arg, "--compile-cache=", 16) == 0) {
+            args.compile_cache_path = arg + 16;
+        } else if (strlen(arg) == 3 && strncmp(arg, "-O", 2) == 0
+                   && arg[2] >= '0' && arg[2] <= '3') {
+            args.pipeline = optimizer_pipeline_for_level(arg[2] - '0');
+        } else if (strncmp(arg, "--passes=", 9) == 0) {
+            passes = arg + 9;
+        } else if (strncmp(arg, "--max-iterations=", 17) == 0) {
+            max_iterations = atoi(arg + 17);
+        } else if (strncmp(arg, "--time-budget=", 14) == 0) {
+            // in milliseconds
+            time_budget = atof(arg + 14) / 1000.0;
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            // for optimizing and emitting, 0 for one per processor
+            threads = atoi(arg + 10);
+        } else if (strncmp(arg, "--fuel=", 7) == 0) {
+            // in loop iterations
+            args.fuel = strtoull(arg + 7, NULL, 10);
+        } else if (strncmp(arg, "--checkpoint=", 13) == 0) {
+            args.checkpoint_path = arg + 13;
+        } else if (strncmp(arg, "--resume=", 9) == 0) {
+            args.resume_path = arg + 9;
+        } else if (strcmp(arg, "--dump-ast") == 0) {
+            args.dump_ast = true;
+        } else if (strcmp(arg, "--dump-code") == 0) {
+            args.dump_code = true;
+        } else if (strcmp(arg, "--dump-tape") == 0) {
+            args.dump_tape = true;
+        } else if (strcmp(arg, "--debug") == 0) {
+            args.dump_ast = true;
+            args.dump_code = true;
+            args.dump_tape = true;
+        } else if (strcmp(arg, "--perf-map") == 0) {
+            args.perf_map = true;
+        } else if (strcmp(arg, "--jitdump") == 0) {
+            args.jitdump = true;
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "panic: unknown option \"%s\"\n", arg);
+            exit(1);
+        } else {
+            args.path = arg;
+        }
+    }
+    // the level only picks defaults, explicit options override them
+    // wherever they appear
+    if (passes != NULL
+        && !optimizer_pipeline_set_passes(&args.pipeline, passes)) {
+        fprintf(stderr, "panic: unknown pass in \"%s\"\n", passes);
+        exit(1);
+    }
+    if (max_iterations >= 0) {
+        args.pipeline.max_iterations = max_iterations;
+    }
+    if (time_budget >= 0.0) {
+        args.pipeline.time_budget = time_budget;
+    }
+    if (threads >= 0) {
+        args.pipeline.threads = threads;
     }
+    return args;
+}
+
+typedef struct {
+    const Args* args;
+    Stats* stats;
+} TraceContext;
 
-    ExprVec previous_ast;
-    bool first = true;
-    int pass_counter = 1;
-    while (first || !expr_vec_equal(&ast, &previous_ast)) {
-        printf(
+void trace_iteration_started(void* user, int iteration)
+{
+    TraceContext* context = user;
+    if (context->args->dump_ast) {
+        fprintf(
+            stderr,
             "\n%soptimization pass %d:%s\n",
             color_bold,
-            pass_counter,
+            iteration,
             color_reset
         );
-        pass_counter += 1;
+    }
+}
 
-        if (!first) {
-            expr_vec_free(&previous_ast);
+void trace_pass_finished(
+    void* user,
+    const OptimizerPass* pass,
+    int iteration,
+    double seconds,
+    const ExprVec* before,
+    const ExprVec* after
+)
+{
+    TraceContext* context = user;
+    if (context->args->stats != StatsMode_None) {
+        stats_push_pass(
+            context->stats,
+            (PassStats) {
+                .name = pass->name,
+                .iteration = iteration,
+                .seconds = seconds,
+                .nodes_before = expr_vec_count_nodes(before),
+                .nodes_after = expr_vec_count_nodes(after),
+            }
+        );
+    }
+    if (context->args->dump_ast) {
+        fprintf(stderr, "%s%s:%s\n", color_bold, pass->name, color_reset);
+        if (!expr_vec_equal(after, before)) {
+            expr_vec_print(after, stderr, 0);
+            fputc('\n', stderr);
         }
-        ADD_OPTIMIZATION_WO_FREE_AST(fold_adjecent);
-        ADD_OPTIMIZATION(eliminate_negation);
-        ADD_OPTIMIZATION(eliminate_overflow);
-        ADD_OPTIMIZATION(replace_zeroing_loops);
-        ADD_OPTIMIZATION(replace_copying_loops);
+    }
+}
 
-        if (first) {
-            first = false;
-        }
+void trace_iteration_finished(
+    void* user, int iteration, double seconds, const ExprVec* ast
+)
+{
+    TraceContext* context = user;
+    context->stats->optimize_seconds += seconds;
+    if (context->args->stats != StatsMode_None) {
+        stats_push_iteration(
+            context->stats,
+            (IterationStats) {
+                .iteration = iteration,
+                .seconds = seconds,
+                .nodes_after = expr_vec_count_nodes(ast),
+            }
+        );
     }
+}
 
-    ast_string[0] = '\0';
-    expr_vec_stringify(&ast, ast_string, 0);
-    printf("\n%sfinal:%s\n%s\n", color_bold, color_reset, ast_string);
+static volatile sig_atomic_t stop_requested = 0;
 
-    size_t code_size = 33678;
-    void* code = mmap(
-        NULL,
-        code_size,
-        PROT_READ | PROT_WRITE | PROT_EXEC,
-        MAP_PRIVATE | MAP_ANONYMOUS,
-        -1,
-        0
-    );
-    if (code == NULL) {
-        fprintf(stderr, "panic: could not mmap\n");
-        exit(1);
+void request_stop(int signal)
+{
+    (void)signal;
+    stop_requested = 1;
+}
+
+// interrupting or terminating a run with a checkpoint path stops it at its
+// next input or output and saves a checkpoint there
+void install_stop_handlers(void)
+{
+    struct sigaction action = {
+        .sa_handler = request_stop,
+        .sa_flags = SA_RESTART,
+    };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+void dump_bytes(const uint8_t* bytes, size_t length, size_t row, FILE* stream)
+{
+    for (size_t i = 0; i < length; ++i) {
+        if (bytes[i] == 0) {
+            fputs(color_gray, stream);
+        }
+        if (i % row == 8) {
+            fputc(' ', stream);
+        }
+        fprintf(stream, "%02x ", bytes[i]);
+        fputs(color_reset, stream);
+        if (i % row == row - 1 || i == length - 1) {
+            fputc('\n', stream);
+        }
     }
+}
 
-    Emitter emitter = emitter_create(code);
-    emitter_emit_program(&emitter, &ast);
+// loads the cache file named on the command line, if any
+void load_compile_cache(
+    CompileCache* cache,
+    const Args* args,
+    const OptimizerOptions* optimizer_options
+)
+{
+    compile_cache_construct(cache);
+    if (args->compile_cache && args->compile_cache_path != NULL) {
+        compile_cache_load(
+            cache, args->compile_cache_path, &args->pipeline, optimizer_options
+        );
+    }
+}
 
-    uint8_t* memory = malloc(30000);
-    memset(memory, 0, 30000);
+// saves the cache back to its file if loops were added, and destroys it
+void save_compile_cache(CompileCache* cache, const Args* args)
+{
+    if (args->compile_cache && args->compile_cache_path != NULL
+        && cache->misses > 0
+        && !compile_cache_save(cache, args->compile_cache_path)) {
+        fprintf(
+            stderr,
+            "warning: could not write compile cache \"%s\"\n",
+            args->compile_cache_path
+        );
+    }
+    compile_cache_destroy(cache);
+}
 
-    printf("\n%scode:%s\n", color_bold, color_reset);
+int main(int argc, char** argv)
+{
+    // const char* text = "++++++++++[>+<-]";
+    // printf("\ntext:%s\n\"%s\"%s\n", color_bright_green, text, color_reset);
+    // Parser parser = parser_create(lexer_from_string(text, strlen(text)));
 
-    for (size_t y = 0; y < 40; ++y) {
-        for (size_t x = 0; x < 16; ++x) {
-            uint8_t v = ((uint8_t*)code)[y * 8 + x];
-            if (v == 0) {
-                fputs(color_gray, stdout);
-            }
-            if (x == 8) {
-                fputc(' ', stdout);
+    Args args = args_parse(argc, argv);
+    if (args.batch_path != NULL) {
+        BfjitOptions options = bfjit_default_options();
+        options.cell_width = args.cell_width;
+        options.outline_loops = args.outline_loops;
+        options.unroll_loops = args.unroll_loops;
+        options.pipeline = args.pipeline;
+        options.fuel = args.fuel;
+        // variants of a program share most of their loops
+        CompileCache cache;
+        load_compile_cache(
+            &cache, &args, &(OptimizerOptions) { .cell_width = args.cell_width }
+        );
+        if (args.compile_cache) {
+            options.cache = &cache;
+        }
+        size_t failed
+            = batch_run(args.batch_path, args.jobs, args.fork, &options);
+        if (args.compile_cache) {
+            fputs("batch: ", stderr);
+            compile_cache_print(&cache, stderr);
+        }
+        save_compile_cache(&cache, &args);
+        return failed == 0 ? 0 : 1;
+    }
+    if (args.repl) {
+        BfjitOptions options = bfjit_default_options();
+        options.cell_width = args.cell_width;
+        options.outline_loops = args.outline_loops;
+        options.unroll_loops = args.unroll_loops;
+        options.pipeline = args.pipeline;
+        options.fuel = args.fuel;
+        CompileCache cache;
+        load_compile_cache(
+            &cache, &args, &(OptimizerOptions) { .cell_width = args.cell_width }
+        );
+        if (args.compile_cache) {
+            options.cache = &cache;
+        }
+        FILE* input = stdin;
+        if (args.path != NULL) {
+            input = fopen(args.path, "r");
+            if (input == NULL) {
+                fprintf(
+                    stderr, "panic: could not open file \"%s\"\n", args.path
+                );
+                exit(1);
             }
-            printf("%02x ", v);
-            fputs(color_reset, stdout);
         }
-        printf("\n");
+        repl_run(input, &options);
+        if (input != stdin) {
+            fclose(input);
+        }
+        save_compile_cache(&cache, &args);
+        return 0;
+    }
+
+    Stats stats;
+    stats_construct(&stats);
+
+    // profiling keeps the source around to print snippets of hot loops and
+    // to key recorded profiles by its hash
+    bool record_loops = args.profile || args.profile_record_path != NULL;
+    char* source = NULL;
+    size_t source_length = 0;
+    Lexer lexer;
+    if (record_loops || args.profile_use_path != NULL) {
+        source = read_source(args.path, &source_length);
+        if (source == NULL) {
+            fprintf(
+                stderr, "panic: could not open file \"%s\"\n", args.path
+            );
+            exit(1);
+        }
+        lexer = lexer_from_string(source, source_length);
+    } else {
+        lexer = lexer_from_path_or_stdin(args.path);
+    }
+
+    // a streaming compile reads the source while it emits code, and never
+    // has the whole tree
+    double parse_start = stats_now();
+    ExprVec ast;
+    if (args.stream) {
+        expr_vec_construct(&ast);
+    } else {
+        Parser parser = parser_create(lexer);
+        ast = parser_parse(&parser);
     }
+    stats.parse_seconds = stats_now() - parse_start;
+    stats.parsed_nodes = expr_vec_count_nodes(&ast);
+    if (args.dump_ast) {
+        fputs("\nparsed:\n", stderr);
+        expr_vec_print(&ast, stderr, 0);
+        fputc('\n', stderr);
+    }
+
+    OptimizerOptions optimizer_options = {
+        .cell_width = args.cell_width,
+    };
+    OptimizerTrace trace = {
+        .iteration_started = trace_iteration_started,
+        .pass_finished = trace_pass_finished,
+        .iteration_finished = trace_iteration_finished,
+        .user = &(TraceContext) { .args = &args, .stats = &stats },
+    };
+    // a cache file lets a rebuild after an edit reuse the loops that did not
+    // change. Reused loops keep the source locations they were parsed at,
+    // which profiles and symbols would report
+    bool use_cache = args.compile_cache && args.compile_cache_path != NULL
+        && !args.stream && !record_loops && args.profile_use_path == NULL
+        && !args.perf_map && !args.jitdump;
+    ExprVec optimized;
+    if (use_cache) {
+        CompileCache cache;
+        load_compile_cache(&cache, &args, &optimizer_options);
+        optimized = compile_cache_optimize(
+            &cache, &ast, &args.pipeline, &optimizer_options, &trace
+        );
+        stats.compile_cache = true;
+        stats.compile_cache_hits = cache.hits;
+        stats.compile_cache_misses = cache.misses;
+        save_compile_cache(&cache, &args);
+    } else {
+        optimized = optimize_program(
+            &ast, &args.pipeline, &optimizer_options, &trace
+        );
+    }
+    expr_vec_free(&ast);
+    ast = optimized;
+
+    if (args.dump_ast) {
+        fprintf(stderr, "\n%sfinal:%s\n", color_bold, color_reset);
+        expr_vec_print(&ast, stderr, 0);
+        fputc('\n', stderr);
+    }
+
+    stats.final_nodes = expr_vec_count_nodes(&ast);
 
-    printf("\n%sresult:%s\n", color_bold, color_reset);
+    uint64_t source_hash = profile_hash_source(source, source_length);
+    ProfileData profile_data;
+    profile_data_construct(&profile_data, source_hash);
+    if (args.profile_use_path != NULL
+        && !profile_data_load(&profile_data, args.profile_use_path)) {
+        fprintf(
+            stderr,
+            "warning: no profile for this program in \"%s\"\n",
+            args.profile_use_path
+        );
+    }
+
+    double emit_start = stats_now();
+    Profile profile;
+    profile_construct(&profile);
+    Emitter emitter = emitter_create();
+    emitter.cell_width = args.cell_width;
+    emitter.outline_loops = args.outline_loops;
+    emitter.unroll_loops = args.unroll_loops;
+    emitter.fuel = args.fuel != 0;
+    emitter.threads = args.pipeline.threads;
+    bool resumable = args.checkpoint_path != NULL || args.resume_path != NULL;
+    emitter.resumable = resumable;
+    if (record_loops) {
+        emitter.profile = &profile;
+    }
+    emitter.profile_data = &profile_data;
+    PerfSymbolVec symbols;
+    perf_symbol_vec_construct(&symbols);
+    if (args.perf_map || args.jitdump) {
+        emitter.symbols = &symbols;
+    }
+    if (args.stream) {
+        emitter_emit_prologue(&emitter);
+        SourceLoc error_loc;
+        if (!stream_compile(
+                &emitter,
+                &lexer,
+                &args.pipeline,
+                &optimizer_options,
+                &error_loc
+            )) {
+            fprintf(
+                stderr,
+                "panic: unmatched bracket at %d:%d\n",
+                error_loc.line,
+                error_loc.column
+            );
+            exit(1);
+        }
+        emitter_emit_epilogue(&emitter);
+    } else {
+        emitter_emit_program(&emitter, &ast);
+    }
+    BfjitProgram program;
+    bfjit_program_from_emitter(&program, &emitter, NULL);
+    uint8_t* code = program.code;
+    program.fuel = args.fuel;
+    if (record_loops) {
+        profile_allocate_counters(&profile);
+        program.counters = profile.counters;
+    }
+    stats.emit_seconds = stats_now() - emit_start;
+    stats.code_size = emitter.pos;
+    memcpy(
+        stats.type_code_sizes,
+        emitter.type_code_sizes,
+        sizeof(stats.type_code_sizes)
+    );
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-    void (*runnable)(uint8_t* memory) = (void (*)(uint8_t* memory))code;
-#pragma GCC diagnostic pop
+    JitDump jitdump;
+    bool jitdump_opened = false;
+    if (args.perf_map || args.jitdump) {
+        perf_symbol_vec_fill_gaps(&symbols, emitter.pos);
+    }
+    if (args.perf_map && !perf_map_write(&symbols, code, emitter.pos)) {
+        fprintf(stderr, "warning: could not write perf map\n");
+    }
+    if (args.jitdump) {
+        jitdump_opened = jitdump_open(&jitdump);
+        if (jitdump_opened) {
+            jitdump_write_code(&jitdump, &symbols, code);
+        } else {
+            fprintf(stderr, "warning: could not open jitdump file\n");
+        }
+    }
 
-    runnable(memory);
+    BfjitTape tape;
+    bfjit_tape_construct(&tape, 30000 * (size_t)args.cell_width);
 
-    printf("\n%smemory:%s\n", color_bold, color_reset);
+    if (args.dump_code) {
+        fprintf(stderr, "\n%scode:%s\n", color_bold, color_reset);
+        dump_bytes(code, emitter.pos, 16, stderr);
+    }
 
-    for (size_t y = 0; y < 4; ++y) {
-        for (size_t x = 0; x < 8; ++x) {
-            uint8_t v = memory[y * 8 + x];
-            if (v == 0) {
-                fputs(color_gray, stdout);
+    BfjitIo io = bfjit_stdio(NULL);
+    BfjitCheckpoint checkpoint;
+    bfjit_checkpoint_construct(&checkpoint);
+    if (args.resume_path != NULL) {
+        if (!bfjit_checkpoint_load(&checkpoint, args.resume_path)) {
+            fprintf(
+                stderr,
+                "panic: could not read checkpoint \"%s\"\n",
+                args.resume_path
+            );
+            exit(1);
+        }
+        if (!bfjit_checkpoint_matches(&checkpoint, &program, &tape)) {
+            fprintf(
+                stderr,
+                "panic: checkpoint \"%s\" is from a different program or "
+                "options\n",
+                args.resume_path
+            );
+            exit(1);
+        }
+        // the input consumed before the checkpoint is not read again
+        for (uint64_t i = 0; i < checkpoint.input_offset; ++i) {
+            if (getchar() == EOF) {
+                break;
             }
-            printf("%02x ", v);
-            fputs(color_reset, stdout);
         }
-        printf("\n");
+    }
+    if (args.checkpoint_path != NULL) {
+        install_stop_handlers();
+    }
+    HardwareCounterGroup counters;
+    bool counters_open
+        = args.stats != StatsMode_None && hardware_counters_open(&counters);
+    if (counters_open) {
+        hardware_counters_start(&counters);
+    }
+    double run_start = stats_now();
+    RunStatus status = resumable
+        ? bfjit_run_resumable(
+              &program, &tape, &io, &checkpoint, &stop_requested
+          )
+        : bfjit_run(&program, &tape, &io);
+    stats.run_seconds = stats_now() - run_start;
+    if (counters_open) {
+        hardware_counters_stop(&counters, &stats.counters);
+        hardware_counters_close(&counters);
+    }
+
+    if (args.dump_tape) {
+        fflush(stdout);
+        fprintf(stderr, "\n%smemory:%s\n", color_bold, color_reset);
+        dump_bytes(tape.data, 32, 8, stderr);
+    }
+
+    fflush(stdout);
+    if (status == RunStatus_OutOfFuel) {
+        fprintf(
+            stderr,
+            "error: out of fuel after %llu loop iterations\n",
+            (unsigned long long)args.fuel
+        );
+    }
+    if (status != RunStatus_Finished && args.checkpoint_path != NULL) {
+        if (bfjit_checkpoint_save(&checkpoint, args.checkpoint_path)) {
+            fprintf(
+                stderr,
+                "checkpoint written to \"%s\"\n",
+                args.checkpoint_path
+            );
+        } else {
+            fprintf(
+                stderr,
+                "warning: could not write checkpoint \"%s\"\n",
+                args.checkpoint_path
+            );
+        }
+    }
+    if (args.stats == StatsMode_Text) {
+        stats_print(&stats, stderr);
+    } else if (args.stats == StatsMode_Json) {
+        stats_print_json(&stats, stderr);
+    }
+    if (args.profile) {
+        profile_report(
+            &profile, source, source_length, args.profile_top_n, stderr
+        );
+    }
+    if (args.profile_record_path != NULL) {
+        ProfileData recorded;
+        profile_data_construct(&recorded, source_hash);
+        profile_data_load(&recorded, args.profile_record_path);
+        profile_data_merge(&recorded, &profile);
+        if (!profile_data_save(&recorded, args.profile_record_path)) {
+            fprintf(
+                stderr,
+                "warning: could not write profile \"%s\"\n",
+                args.profile_record_path
+            );
+        }
+        profile_data_destroy(&recorded);
     }
 
-    free(memory);
-    munmap(code, code_size);
-    expr_vec_free(&previous_ast);
+    if (jitdump_opened) {
+        jitdump_close(&jitdump);
+    }
+    emitter_destroy(&emitter);
+    perf_symbol_vec_destroy(&symbols);
+    profile_destroy(&profile);
+    profile_data_destroy(&profile_data);
+    free(source);
+    stats_destroy(&stats);
+    bfjit_tape_destroy(&tape);
+    bfjit_program_destroy(&program);
+    bfjit_checkpoint_destroy(&checkpoint);
     expr_vec_free(&ast);
-    free(ast_string);
+    switch (status) {
+        case RunStatus_Finished:
+            return 0;
+        case RunStatus_OutOfFuel:
+            return 2;
+        case RunStatus_Stopped:
+            return 3;
+    }
+    return 1;
 }
@@ -1,5 +1,25 @@
 #include "optimizer.h"
 #include "expr.h"
+#include "parallel.h"
+#include "parser.h"
+#include "rewrite.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ARITHMETIC (EXPR_TYPE_BIT(ExprType_Incr) | EXPR_TYPE_BIT(ExprType_Decr))
+#define MOVES (EXPR_TYPE_BIT(ExprType_Left) | EXPR_TYPE_BIT(ExprType_Right))
+
+static void push_expr(
+    ExprVec* replacement, ExprType type, SourceLoc loc, int value
+)
+{
+    expr_vec_push(
+        replacement, (Expr) { .type = type, .loc = loc, .value = value }
+    );
+}
 
 /*
  *  fold adjecent
@@ -10,47 +30,25 @@
  *
  */
 
-ExprVec optimize_fold_adjecent(const ExprVec* vec)
+static bool fold_adjecent_guard(
+    const Expr* match, const OptimizerOptions* options
+)
 {
-    ExprVec exprs;
-    expr_vec_construct(&exprs);
-    if (vec->length == 0) {
-        return exprs;
-    }
-    Expr a = expr_optimize_fold_adjecent(&vec->data[0]);
-    for (size_t i = 1; i < vec->length; ++i) {
-        Expr b = expr_optimize_fold_adjecent(&vec->data[i]);
-        switch (a.type) {
-            case ExprType_Incr:
-            case ExprType_Decr:
-            case ExprType_Left:
-            case ExprType_Right:
-                if (a.type != b.type) {
-                    expr_vec_push(&exprs, a);
-                    a = b;
-                } else {
-                    a.value += b.value;
-                }
-                break;
-            default:
-                expr_vec_push(&exprs, a);
-                a = b;
-        }
-    }
-    expr_vec_push(&exprs, a);
-    return exprs;
+    (void)options;
+    return match[0].type == match[1].type;
 }
 
-Expr expr_optimize_fold_adjecent(const Expr* expr)
+static void fold_adjecent_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
 {
-    if (expr->type == ExprType_Loop) {
-        return (Expr) {
-            .type = ExprType_Loop,
-            .exprs = optimize_fold_adjecent(&expr->exprs),
-        };
-    } else {
-        return expr_clone(expr);
-    }
+    (void)options;
+    push_expr(
+        replacement,
+        match[0].type,
+        match[0].loc,
+        match[0].value + match[1].value
+    );
 }
 
 /*
@@ -66,116 +64,86 @@ Expr expr_optimize_fold_adjecent(const Expr* expr)
  *
  */
 
-ExprVec optimize_eliminate_negation(const ExprVec* vec)
-{
-    ExprVec exprs;
-    expr_vec_construct(&exprs);
-    if (vec->length == 0) {
-        return exprs;
-    }
-    expr_vec_push(&exprs, expr_optimize_eliminate_negation(&vec->data[0]));
-    for (size_t i = 1; i < vec->length; ++i) {
-        expr_vec_push(&exprs, expr_optimize_eliminate_negation(&vec->data[i]));
-        Expr* a = &exprs.data[i - 1];
-        Expr* b = &exprs.data[i];
-        if (a->type == ExprType_Incr && b->type == ExprType_Decr) {
-            if (a->value > b->value) {
-                a->value -= b->value;
-                expr_vec_pop(&exprs);
-            } else if (a->value < b->value) {
-                *a = (Expr) { .type = ExprType_Decr,
-                              .value = b->value - a->value };
-                expr_vec_pop(&exprs);
-            } else {
-                expr_vec_pop(&exprs);
-                expr_vec_pop(&exprs);
-            }
-        } else if (a->type == ExprType_Decr && b->type == ExprType_Incr) {
-            if (a->value > b->value) {
-                a->value -= b->value;
-                expr_vec_pop(&exprs);
-            } else if (a->value < b->value) {
-                *a = (Expr) { .type = ExprType_Incr,
-                              .value = b->value - a->value };
-                expr_vec_pop(&exprs);
-            } else {
-                expr_vec_pop(&exprs);
-                expr_vec_pop(&exprs);
-            }
-        }
-        if (a->type == ExprType_Left && b->type == ExprType_Right) {
-            if (a->value > b->value) {
-                a->value -= b->value;
-                expr_vec_pop(&exprs);
-            } else if (a->value < b->value) {
-                *a = (Expr) { .type = ExprType_Right,
-                              .value = b->value - a->value };
-                expr_vec_pop(&exprs);
-            } else {
-                expr_vec_pop(&exprs);
-                expr_vec_pop(&exprs);
-            }
-        } else if (a->type == ExprType_Right && b->type == ExprType_Left) {
-            if (a->value > b->value) {
-                a->value -= b->value;
-                expr_vec_pop(&exprs);
-            } else if (a->value < b->value) {
-                *a = (Expr) { .type = ExprType_Left,
-                              .value = b->value - a->value };
-                expr_vec_pop(&exprs);
-            } else {
-                expr_vec_pop(&exprs);
-                expr_vec_pop(&exprs);
-            }
-        }
+static ExprType negated_type(ExprType type)
+{
+    switch (type) {
+        case ExprType_Incr:
+            return ExprType_Decr;
+        case ExprType_Decr:
+            return ExprType_Incr;
+        case ExprType_Left:
+            return ExprType_Right;
+        case ExprType_Right:
+            return ExprType_Left;
+        default:
+            return ExprType_Error;
     }
-    return exprs;
 }
 
-Expr expr_optimize_eliminate_negation(const Expr* expr)
+static bool eliminate_negation_guard(
+    const Expr* match, const OptimizerOptions* options
+)
 {
-    if (expr->type == ExprType_Loop) {
-        return (Expr) {
-            .type = ExprType_Loop,
-            .exprs = optimize_eliminate_negation(&expr->exprs),
-        };
-    } else {
-        return expr_clone(expr);
+    (void)options;
+    return match[1].type == negated_type(match[0].type);
+}
+
+static void eliminate_negation_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    (void)options;
+    if (match[0].value > match[1].value) {
+        push_expr(
+            replacement,
+            match[0].type,
+            match[0].loc,
+            match[0].value - match[1].value
+        );
+    } else if (match[0].value < match[1].value) {
+        push_expr(
+            replacement,
+            match[1].type,
+            match[0].loc,
+            match[1].value - match[0].value
+        );
     }
 }
 
 /*
  *  eliminate overflow
  *
- *  A(n) :: { Incr(n) | Decr(n) | Right(n) | Left(n) }
+ *  A(n) :: { Incr(n) | Decr(n) }
  *
- *  n > 255
+ *  m = 2 ^ cell bits
  *
- *  A(n) -> A(n % 256)
+ *  n >= m
+ *
+ *  A(n) ? n % m == 0 -> []
+ *  A(n) -> A(n % m)
  *
  */
 
-ExprVec optimize_eliminate_overflow(const ExprVec* vec)
+// 32 bit cells cannot overflow an int
+static long long cell_modulus(const OptimizerOptions* options)
 {
-    ExprVec exprs;
-    expr_vec_construct(&exprs);
-    for (size_t i = 0; i < vec->length; ++i) {
-        expr_vec_push(&exprs, expr_optimize_eliminate_overflow(&vec->data[i]));
-    }
-    return exprs;
+    return 1LL << (8 * options->cell_width);
 }
 
-Expr expr_optimize_eliminate_overflow(const Expr* expr)
+static bool eliminate_overflow_guard(
+    const Expr* match, const OptimizerOptions* options
+)
 {
-    if (expr->type == ExprType_Loop) {
-        return (Expr) {
-            .type = ExprType_Loop,
-            .exprs = optimize_eliminate_overflow(&expr->exprs),
-        };
-    } else if (expr->value > 255) {
-        return (Expr) { .type = expr->type, .value = expr->value % 256 };
-    } else {
-        return expr_clone(expr);
+    return match[0].value >= cell_modulus(options);
+}
+
+static void eliminate_overflow_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    int value = (int)(match[0].value % cell_modulus(options));
+    if (value != 0) {
+        push_expr(replacement, match[0].type, match[0].loc, value);
     }
 }
 
@@ -184,100 +152,1567 @@ Expr expr_optimize_eliminate_overflow(const Expr* expr)
  *
  *  A(n) :: { Incr(n) | Decr(n) }
  *
- *  n % 2 == 1
+ *  n % 2 == 1, which is coprime to the modulus of every cell width
  *
  *  Loop[A(n)] -> Zero
  *
  */
 
-ExprVec optimize_replace_zeroing_loops(const ExprVec* vec)
+static bool replace_zeroing_loops_guard(
+    const Expr* match, const OptimizerOptions* options
+)
 {
-    ExprVec exprs;
-    expr_vec_construct(&exprs);
-    for (size_t i = 0; i < vec->length; ++i) {
+    (void)options;
+    return match[0].exprs.data[0].value % 2 != 0;
+}
+
+static void replace_zeroing_loops_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    (void)options;
+    push_expr(replacement, ExprType_Zero, match[0].loc, 0);
+}
+
+/*
+ *  replace copying loops
+ *
+ *  O(n), I(n) :: { Left(n) | Right(n) }
+ *
+ *  O != I
+ *
+ *  [Loop[O(n) Incr(m) I(n) Decr(m)]] -> [Copy(n) Zero]
+ *
+ */
+
+static bool replace_copying_loops_guard(
+    const Expr* match, const OptimizerOptions* options
+)
+{
+    (void)options;
+    const Expr* body = match[0].exprs.data;
+    return body[0].type != body[2].type && body[0].value == body[2].value
+        && body[1].value == body[3].value;
+}
+
+static void replace_copying_loops_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    (void)options;
+    const Expr* body = match[0].exprs.data;
+    int offset
+        = body[0].type == ExprType_Right ? body[0].value : -body[0].value;
+    push_expr(replacement, ExprType_Add, match[0].loc, offset);
+    push_expr(replacement, ExprType_Zero, match[0].loc, 0);
+}
+
+/*
+ *  replace multiply loops
+ *
+ *  A(n) :: { Incr(n) | Decr(n) | Right(n) | Left(n) }
+ *
+ *  the body only consists of A, is balanced and changes the current cell by
+ *  an odd s, all other cells k change by d(k)
+ *
+ *  Loop[A...] -> [Mul(k, -d(k) / s)... Zero]
+ *
+ *  An odd s has an inverse modulo the cell modulus, so a loop starting at n
+ *  runs exactly n / s times in cell arithmetic, which is n times for s = -1
+ *  and 2 ^ cell bits - n times for s = 1. Mul(k, 1) is emitted as Add(k).
+ *
+ */
+
+#define MULTIPLY_MAX_TARGETS 16
+
+typedef struct {
+    int offsets[MULTIPLY_MAX_TARGETS];
+    long long deltas[MULTIPLY_MAX_TARGETS];
+    size_t length;
+} MultiplyLoop;
+
+static bool multiply_loop_analyze(
+    const ExprVec* body, MultiplyLoop* loop, const OptimizerOptions* options
+)
+{
+    loop->length = 1;
+    loop->offsets[0] = 0;
+    loop->deltas[0] = 0;
+    int offset = 0;
+    for (size_t i = 0; i < body->length; ++i) {
+        const Expr* expr = &body->data[i];
+        if (expr->type == ExprType_Left) {
+            offset -= expr->value;
+            continue;
+        } else if (expr->type == ExprType_Right) {
+            offset += expr->value;
+            continue;
+        } else if (expr->type != ExprType_Incr
+                   && expr->type != ExprType_Decr) {
+            return false;
+        }
+        size_t target = 0;
+        while (target < loop->length && loop->offsets[target] != offset) {
+            target += 1;
+        }
+        if (target == loop->length) {
+            if (loop->length == MULTIPLY_MAX_TARGETS) {
+                return false;
+            }
+            loop->offsets[target] = offset;
+            loop->deltas[target] = 0;
+            loop->length += 1;
+        }
+        loop->deltas[target]
+            += expr->type == ExprType_Incr ? expr->value : -expr->value;
+    }
+    long long modulus = cell_modulus(options);
+    for (size_t i = 0; i < loop->length; ++i) {
+        loop->deltas[i] = (loop->deltas[i] % modulus + modulus) % modulus;
+    }
+    return offset == 0 && loop->deltas[0] % 2 != 0;
+}
+
+// the factor by which a cell changing by delta per iteration changes in
+// total, for a loop whose control cell changes by an odd step
+static long long trip_factor(
+    long long delta, long long step, const OptimizerOptions* options
+)
+{
+    long long modulus = cell_modulus(options);
+    // newton iteration, every step doubles the number of correct low bits
+    unsigned long long inverse = (unsigned long long)step;
+    for (int i = 0; i < 5; ++i) {
+        inverse *= 2 - (unsigned long long)step * inverse;
+    }
+    unsigned long long factor = (unsigned long long)(modulus - delta)
+        * (inverse % (unsigned long long)modulus);
+    return (long long)(factor % (unsigned long long)modulus);
+}
+
+// cell[offset] += cell[0] * factor, with the factor modulo the cell modulus
+static void push_multiply(
+    ExprVec* replacement,
+    SourceLoc loc,
+    int offset,
+    long long factor,
+    const OptimizerOptions* options
+)
+{
+    long long modulus = cell_modulus(options);
+    if (factor == 0) {
+        return;
+    }
+    if (factor > modulus / 2) {
+        factor -= modulus;
+    }
+    if (factor == 1) {
+        push_expr(replacement, ExprType_Add, loc, offset);
+    } else {
         expr_vec_push(
-            &exprs, expr_optimize_replace_zeroing_loops(&vec->data[i])
+            replacement,
+            (Expr) {
+                .type = ExprType_Mul,
+                .loc = loc,
+                .offset = offset,
+                .value = (int)factor,
+            }
         );
     }
-    return exprs;
 }
 
-Expr expr_optimize_replace_zeroing_loops(const Expr* expr)
+static bool replace_multiply_loops_guard(
+    const Expr* match, const OptimizerOptions* options
+)
 {
-    if (expr->type == ExprType_Loop) {
-        if (expr->exprs.length == 1
-            && (expr->exprs.data[0].type == ExprType_Incr
-                || expr->exprs.data[0].type == ExprType_Decr)
-            && expr->exprs.data[0].value % 2 != 0) {
-            return (Expr) { .type = ExprType_Zero };
-        } else {
-            return (Expr) {
-                .type = ExprType_Loop,
-                .exprs = optimize_replace_zeroing_loops(&expr->exprs),
+    MultiplyLoop loop;
+    return multiply_loop_analyze(&match[0].exprs, &loop, options);
+}
+
+static void replace_multiply_loops_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    MultiplyLoop loop;
+    multiply_loop_analyze(&match[0].exprs, &loop, options);
+    for (size_t i = 1; i < loop.length; ++i) {
+        push_multiply(
+            replacement,
+            match[0].loc,
+            loop.offsets[i],
+            trip_factor(loop.deltas[i], loop.deltas[0], options),
+            options
+        );
+    }
+    push_expr(replacement, ExprType_Zero, match[0].loc, 0);
+}
+
+/*
+ *  replace conditional loops
+ *
+ *  the body is balanced and the last write to the current cell sets it to
+ *  zero, so the loop runs at most once
+ *
+ *  Loop[A... Zero B...] -> If[A... Zero B...]
+ *
+ */
+
+static bool body_leaves_cell_zero(const ExprVec* body)
+{
+    int body_offset;
+    if (!expr_vec_pointer_offset(body, &body_offset) || body_offset != 0) {
+        return false;
+    }
+    bool zero = false;
+    int offset = 0;
+    for (size_t i = 0; i < body->length; ++i) {
+        const Expr* expr = &body->data[i];
+        switch (expr->type) {
+            case ExprType_Left:
+                offset -= expr->value;
+                break;
+            case ExprType_Right:
+                offset += expr->value;
+                break;
+            case ExprType_Incr:
+            case ExprType_Decr:
+            case ExprType_Input:
+                zero = zero && offset != 0;
+                break;
+            case ExprType_Zero:
+            case ExprType_Loop:
+            case ExprType_If:
+            case ExprType_DivMod:
+                // all of these leave their own cell at zero, but may write
+                // anywhere else
+                zero = offset == 0;
+                break;
+            case ExprType_Add:
+                zero = zero && offset + expr->value != 0;
+                break;
+            case ExprType_Mul:
+                zero = zero && offset + expr->offset != 0;
+                break;
+            case ExprType_ClearRange:
+                if (offset + expr->offset <= 0
+                    && offset + expr->offset + expr->length > 0) {
+                    zero = true;
+                }
+                break;
+            case ExprType_AddRange:
+            case ExprType_MulRange:
+                if (offset + expr->offset <= 0
+                    && offset + expr->offset + expr->length > 0) {
+                    zero = false;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return zero;
+}
+
+static bool replace_conditional_loops_guard(
+    const Expr* match, const OptimizerOptions* options
+)
+{
+    (void)options;
+    return body_leaves_cell_zero(&match[0].exprs);
+}
+
+static void replace_conditional_loops_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    (void)options;
+    expr_vec_push(
+        replacement,
+        (Expr) {
+            .type = ExprType_If,
+            .loc = match[0].loc,
+            .exprs = expr_vec_clone(&match[0].exprs),
+        }
+    );
+}
+
+/*
+ *  replace divmod loops
+ *
+ *  The well known divmod algorithms, with n at the current cell and d at
+ *  offset k:
+ *
+ *  k = 1: [n d 0 0 0 0] -> [0 d-n%d n%d n/d 0 0]
+ *  k = 2: [n m d 0 0 0 0] -> [0 m+n d-n%d n%d n/d 0 0]
+ *
+ *  Loop[...] -> DivMod(k)[Loop[...]]
+ *
+ *  The result only holds for d >= 2 and the four cells after d being zero,
+ *  so the loop is kept as the fallback for when the emitted code finds
+ *  either isn't the case.
+ *
+ */
+
+typedef struct {
+    const char* source;
+    int divisor_offset;
+} DivModIdiom;
+
+static const DivModIdiom divmod_idioms[] = {
+    { "[->-[>+>>]>[+[-<+>]>+>>]<<<<<]", 1 },
+    { "[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]", 2 },
+};
+
+#define DIVMOD_IDIOMS_LENGTH (sizeof(divmod_idioms) / sizeof(divmod_idioms[0]))
+
+// the idioms as the rewrite rules leave them
+static ExprVec divmod_templates[DIVMOD_IDIOMS_LENGTH];
+static pthread_once_t divmod_templates_once = PTHREAD_ONCE_INIT;
+
+static ExprVec rewrite_without_divmod(
+    const ExprVec* vec, const OptimizerOptions* options
+);
+
+static void divmod_templates_construct(void)
+{
+    OptimizerOptions options = optimizer_default_options();
+    for (size_t i = 0; i < DIVMOD_IDIOMS_LENGTH; ++i) {
+        const char* source = divmod_idioms[i].source;
+        Parser parser
+            = parser_create(lexer_from_string(source, strlen(source)));
+        ExprVec parsed = parser_parse(&parser);
+        divmod_templates[i] = rewrite_without_divmod(&parsed, &options);
+        expr_vec_free(&parsed);
+    }
+}
+
+static const DivModIdiom* divmod_idiom_find(const Expr* loop)
+{
+    pthread_once(&divmod_templates_once, divmod_templates_construct);
+    for (size_t i = 0; i < DIVMOD_IDIOMS_LENGTH; ++i) {
+        if (expr_equal(loop, &divmod_templates[i].data[0])) {
+            return &divmod_idioms[i];
+        }
+    }
+    return NULL;
+}
+
+static bool replace_divmod_loops_guard(
+    const Expr* match, const OptimizerOptions* options
+)
+{
+    (void)options;
+    return divmod_idiom_find(&match[0]) != NULL;
+}
+
+static void replace_divmod_loops_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    (void)options;
+    Expr divmod = {
+        .type = ExprType_DivMod,
+        .loc = match[0].loc,
+        .offset = divmod_idiom_find(&match[0])->divisor_offset,
+    };
+    expr_vec_construct(&divmod.exprs);
+    expr_vec_push(&divmod.exprs, expr_clone(&match[0]));
+    expr_vec_push(replacement, divmod);
+}
+
+/*
+ *  rewrite rules
+ *
+ *  Each rule is a pass of its own in the registry, so levels and --passes
+ *  can pick them one by one. Rule passes that follow each other in a
+ *  pipeline still run together in one traversal of the rewrite engine.
+ *
+ */
+
+static const RewriteRule fold_adjecent_rule = {
+    .name = "fold_adjecent",
+    .pattern_length = 2,
+    .pattern = { { .types = ARITHMETIC | MOVES },
+                 { .types = ARITHMETIC | MOVES } },
+    .guard = fold_adjecent_guard,
+    .build = fold_adjecent_build,
+};
+
+static const RewriteRule eliminate_negation_rule = {
+    .name = "eliminate_negation",
+    .pattern_length = 2,
+    .pattern = { { .types = ARITHMETIC | MOVES },
+                 { .types = ARITHMETIC | MOVES } },
+    .guard = eliminate_negation_guard,
+    .build = eliminate_negation_build,
+};
+
+static const RewriteRule eliminate_overflow_rule = {
+    .name = "eliminate_overflow",
+    .pattern_length = 1,
+    .pattern = { { .types = ARITHMETIC } },
+    .guard = eliminate_overflow_guard,
+    .build = eliminate_overflow_build,
+};
+
+static const RewriteRule replace_zeroing_loops_rule = {
+    .name = "replace_zeroing_loops",
+    .pattern_length = 1,
+    .pattern = { {
+        .types = EXPR_TYPE_BIT(ExprType_Loop),
+        .body_length = 1,
+        .body = { ARITHMETIC },
+    } },
+    .guard = replace_zeroing_loops_guard,
+    .build = replace_zeroing_loops_build,
+};
+
+static const RewriteRule replace_multiply_loops_rule = {
+    .name = "replace_multiply_loops",
+    .pattern_length = 1,
+    .pattern = { { .types = EXPR_TYPE_BIT(ExprType_Loop) } },
+    .guard = replace_multiply_loops_guard,
+    .build = replace_multiply_loops_build,
+};
+
+static const RewriteRule replace_copying_loops_rule = {
+    .name = "replace_copying_loops",
+    .pattern_length = 1,
+    .pattern = { {
+        .types = EXPR_TYPE_BIT(ExprType_Loop),
+        .body_length = 4,
+        .body = { MOVES,
+                  EXPR_TYPE_BIT(ExprType_Incr),
+                  MOVES,
+                  EXPR_TYPE_BIT(ExprType_Decr) },
+    } },
+    .guard = replace_copying_loops_guard,
+    .build = replace_copying_loops_build,
+};
+
+static const RewriteRule replace_conditional_loops_rule = {
+    .name = "replace_conditional_loops",
+    .pattern_length = 1,
+    .pattern = { { .types = EXPR_TYPE_BIT(ExprType_Loop) } },
+    .guard = replace_conditional_loops_guard,
+    .build = replace_conditional_loops_build,
+};
+
+static const RewriteRule replace_divmod_loops_rule = {
+    .name = "replace_divmod_loops",
+    .pattern_length = 1,
+    .pattern = { { .types = EXPR_TYPE_BIT(ExprType_Loop) } },
+    .guard = replace_divmod_loops_guard,
+    .build = replace_divmod_loops_build,
+};
+
+// every rule in the order the engine tries them, the divmod rule has to
+// stay last, see rewrite_without_divmod
+static const RewriteRule* const rewrite_rules[] = {
+    &fold_adjecent_rule,
+    &eliminate_negation_rule,
+    &eliminate_overflow_rule,
+    &replace_zeroing_loops_rule,
+    &replace_multiply_loops_rule,
+    &replace_copying_loops_rule,
+    &replace_conditional_loops_rule,
+    &replace_divmod_loops_rule,
+};
+
+static const size_t rewrite_rules_length
+    = sizeof(rewrite_rules) / sizeof(rewrite_rules[0]);
+
+// the divmod templates are rewritten by every rule but the divmod rule
+// itself, which is the last one
+static ExprVec rewrite_without_divmod(
+    const ExprVec* vec, const OptimizerOptions* options
+)
+{
+    return rewrite_apply(vec, rewrite_rules, rewrite_rules_length - 1, options);
+}
+
+ExprVec optimize_rewrite(const ExprVec* vec, const OptimizerOptions* options)
+{
+    return rewrite_apply(vec, rewrite_rules, rewrite_rules_length, options);
+}
+
+/*
+ *  merge ranges
+ *
+ *  M(m) :: { Left(m) | Right(m) }, moving to offset t
+ *
+ *  Zero is ClearRange(0, 1), Incr(k) is AddRange(0, 1, k) and Decr(k) is
+ *  AddRange(0, 1, -k)
+ *
+ *  [ClearRange(o, n) M(m) Zero] ? t == o + n -> [M(m) ClearRange(o - t, n + 1)]
+ *  [ClearRange(o, n) M(m) Zero] ? t == o - 1 -> [M(m) ClearRange(0, n + 1)]
+ *
+ *  [AddRange(o, n, k) M(m) AddRange(0, 1, k)] likewise
+ *
+ *  The move goes first, so the range is relative to the new pointer and the
+ *  next cell of a run matches the same pattern again.
+ *
+ *  Add(k) is Mul(k, 1) and Mul(k, f) is MulRange(k, 1)
+ *
+ *  [MulRange(o, n) Mul(t, f)] ? t == o + n -> [MulRange(o, n + 1)]
+ *  [MulRange(o, n) Mul(t, f)] ? t == o - 1 -> [MulRange(t, n + 1)]
+ *
+ *  A MulRange keeps the Mul of every cell, in order. They all read the
+ *  current cell, which none of them writes, so the multiplies of a run can
+ *  be done at once.
+ *
+ *  The emitter lowers ranges to vector instructions. This runs as its own
+ *  pass after the rewrite rules, which only know about single cells.
+ *
+ */
+
+static bool expr_as_range(
+    const Expr* expr, Expr* range, const OptimizerOptions* options
+)
+{
+    long long modulus = cell_modulus(options);
+    switch (expr->type) {
+        case ExprType_Zero:
+            *range = (Expr) { .type = ExprType_ClearRange, .length = 1 };
+            return true;
+        case ExprType_Incr:
+        case ExprType_Decr: {
+            long long value
+                = expr->type == ExprType_Incr ? expr->value : -expr->value;
+            *range = (Expr) {
+                .type = ExprType_AddRange,
+                .length = 1,
+                .value = (int)((value % modulus + modulus) % modulus),
             };
+            return true;
+        }
+        case ExprType_ClearRange:
+        case ExprType_AddRange:
+            *range = *expr;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool merge_ranges_guard(
+    const Expr* match, const OptimizerOptions* options
+)
+{
+    Expr range, cell;
+    if (!expr_as_range(&match[0], &range, options)
+        || !expr_as_range(&match[2], &cell, options)
+        || match[2].type == ExprType_ClearRange
+        || match[2].type == ExprType_AddRange || range.type != cell.type
+        || range.value != cell.value) {
+        return false;
+    }
+    int target
+        = match[1].type == ExprType_Right ? match[1].value : -match[1].value;
+    return target == range.offset + range.length
+        || target == range.offset - 1;
+}
+
+static void merge_ranges_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    Expr range;
+    expr_as_range(&match[0], &range, options);
+    int target
+        = match[1].type == ExprType_Right ? match[1].value : -match[1].value;
+    range.loc = match[0].loc;
+    if (target < range.offset) {
+        range.offset = target;
+    }
+    range.offset -= target;
+    range.length += 1;
+    expr_vec_push(replacement, match[1]);
+    expr_vec_push(replacement, range);
+}
+
+static const RewriteRule merge_ranges_rule = {
+    .name = "merge_ranges",
+    .pattern_length = 3,
+    .pattern = { { .types = EXPR_TYPE_BIT(ExprType_Zero)
+                       | EXPR_TYPE_BIT(ExprType_ClearRange) | ARITHMETIC
+                       | EXPR_TYPE_BIT(ExprType_AddRange) },
+                 { .types = MOVES },
+                 { .types = EXPR_TYPE_BIT(ExprType_Zero) | ARITHMETIC } },
+    .guard = merge_ranges_guard,
+    .build = merge_ranges_build,
+};
+
+// the cells a Mul, an Add or a MulRange adds to
+static void multiply_targets(const Expr* expr, int* offset, int* length)
+{
+    if (expr->type == ExprType_MulRange) {
+        *offset = expr->offset;
+        *length = expr->length;
+    } else {
+        *offset = expr->type == ExprType_Add ? expr->value : expr->offset;
+        *length = 1;
+    }
+}
+
+static Expr expr_as_multiply(const Expr* expr)
+{
+    if (expr->type == ExprType_Mul) {
+        return *expr;
+    }
+    return (Expr) {
+        .type = ExprType_Mul,
+        .loc = expr->loc,
+        .offset = expr->value,
+        .value = 1,
+    };
+}
+
+static bool merge_multiplies_guard(
+    const Expr* match, const OptimizerOptions* options
+)
+{
+    (void)options;
+    int offset, length, target, target_length;
+    multiply_targets(&match[0], &offset, &length);
+    multiply_targets(&match[1], &target, &target_length);
+    if (offset <= 0 && offset + length > 0) {
+        return false;
+    }
+    return target != 0
+        && (target == offset + length || target == offset - 1);
+}
+
+static void merge_multiplies_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    (void)options;
+    int offset, length, target, target_length;
+    multiply_targets(&match[0], &offset, &length);
+    multiply_targets(&match[1], &target, &target_length);
+    Expr range = {
+        .type = ExprType_MulRange,
+        .loc = match[0].loc,
+        .offset = target < offset ? target : offset,
+        .length = length + 1,
+    };
+    expr_vec_construct(&range.exprs);
+    if (target < offset) {
+        expr_vec_push(&range.exprs, expr_as_multiply(&match[1]));
+    }
+    if (match[0].type == ExprType_MulRange) {
+        for (size_t i = 0; i < match[0].exprs.length; ++i) {
+            expr_vec_push(&range.exprs, match[0].exprs.data[i]);
         }
     } else {
-        return expr_clone(expr);
+        expr_vec_push(&range.exprs, expr_as_multiply(&match[0]));
     }
+    if (target > offset) {
+        expr_vec_push(&range.exprs, expr_as_multiply(&match[1]));
+    }
+    expr_vec_push(replacement, range);
+}
+
+static const RewriteRule merge_multiplies_rule = {
+    .name = "merge_multiplies",
+    .pattern_length = 2,
+    .pattern = { { .types = EXPR_TYPE_BIT(ExprType_Add)
+                       | EXPR_TYPE_BIT(ExprType_Mul)
+                       | EXPR_TYPE_BIT(ExprType_MulRange) },
+                 { .types = EXPR_TYPE_BIT(ExprType_Add)
+                       | EXPR_TYPE_BIT(ExprType_Mul) } },
+    .guard = merge_multiplies_guard,
+    .build = merge_multiplies_build,
+};
+
+ExprVec optimize_merge_ranges(
+    const ExprVec* vec, const OptimizerOptions* options
+)
+{
+    const RewriteRule* rules[] = { &merge_ranges_rule, &merge_multiplies_rule };
+    return rewrite_apply(vec, rules, 2, options);
 }
 
 /*
- *  replace copying loops
+ *  hoist invariants
  *
- *  O(n), I(n) :: { Left(n) | Right(n) }
+ *  the body is balanced, every loop in it is balanced, the current cell is
+ *  only changed by Incr and Decr outside of inner loops, by an odd step s,
+ *  and cells k are only changed by Incr and Decr outside of inner loops,
+ *  by d(k), and never read
  *
- *  O != I
+ *  Loop[A...] -> [Mul(k, -d(k) / s)... Loop[A... without the k updates]]
  *
- *  [Loop[O(n) Incr(1) I(n) Decr(1)]] -> [Copy(n) Zero]
+ *  The loop runs n / s times, see replace multiply loops, and nothing in it
+ *  depends on the k cells, so their updates can be done in one step before
+ *  the loop. Whatever remains of the body is left in the loop.
  *
  */
 
-ExprVec optimize_replace_copying_loops(const ExprVec* original)
+#define HOIST_MAX_CELLS 64
+
+typedef struct {
+    int offset;
+    long long delta;
+    // read by anything in the loop
+    bool read;
+    // written other than by Incr and Decr at the top level of the body
+    bool written;
+} CellUse;
+
+typedef struct {
+    CellUse cells[HOIST_MAX_CELLS];
+    size_t length;
+} LoopUses;
+
+static CellUse* loop_uses_find(LoopUses* uses, int offset)
 {
-    ExprVec result;
-    expr_vec_construct(&result);
-    for (size_t i = 0; i < original->length; ++i) {
-        const Expr* expr = &original->data[i];
-        if (expr->type == ExprType_Loop) {
-            const ExprVec* loop = &expr->exprs;
-            if (loop->length == 4
-                && ((loop->data[0].type == ExprType_Left
-                     && loop->data[2].type == ExprType_Right)
-                    || (loop->data[0].type == ExprType_Right
-                        && loop->data[2].type == ExprType_Left))
-                && loop->data[1].type == ExprType_Incr
-                && loop->data[3].type == ExprType_Decr
-                && loop->data[1].value == loop->data[3].value) {
-                if (loop->data[0].type == ExprType_Right) {
-                    expr_vec_push(
-                        &result,
-                        (Expr) {
-                            .type = ExprType_Add,
-                            .value = loop->data[0].value,
-                        }
-                    );
+    for (size_t i = 0; i < uses->length; ++i) {
+        if (uses->cells[i].offset == offset) {
+            return &uses->cells[i];
+        }
+    }
+    if (uses->length == HOIST_MAX_CELLS) {
+        return NULL;
+    }
+    uses->cells[uses->length] = (CellUse) { .offset = offset };
+    return &uses->cells[uses->length++];
+}
+
+static bool loop_uses_mark(LoopUses* uses, int offset, bool read)
+{
+    CellUse* cell = loop_uses_find(uses, offset);
+    if (cell == NULL) {
+        return false;
+    }
+    if (read) {
+        cell->read = true;
+    } else {
+        cell->written = true;
+    }
+    return true;
+}
+
+// false if the body has a cell access at an offset not known statically
+static bool loop_uses_collect(
+    const ExprVec* body, int offset, bool top_level, LoopUses* uses
+)
+{
+    int body_offset;
+    if (!expr_vec_pointer_offset(body, &body_offset) || body_offset != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < body->length; ++i) {
+        const Expr* expr = &body->data[i];
+        bool known = true;
+        switch (expr->type) {
+            case ExprType_Left:
+                offset -= expr->value;
+                break;
+            case ExprType_Right:
+                offset += expr->value;
+                break;
+            case ExprType_Incr:
+            case ExprType_Decr:
+                if (top_level) {
+                    CellUse* cell = loop_uses_find(uses, offset);
+                    known = cell != NULL;
+                    if (known) {
+                        cell->delta += expr->type == ExprType_Incr
+                            ? expr->value
+                            : -expr->value;
+                    }
                 } else {
-                    expr_vec_push(
-                        &result,
-                        (Expr) {
-                            .type = ExprType_Add,
-                            .value = -loop->data[0].value,
-                        }
-                    );
+                    known = loop_uses_mark(uses, offset, false);
+                }
+                break;
+            case ExprType_Output:
+                known = loop_uses_mark(uses, offset, true);
+                break;
+            case ExprType_Input:
+            case ExprType_Zero:
+                known = loop_uses_mark(uses, offset, false);
+                break;
+            case ExprType_Add:
+                known = loop_uses_mark(uses, offset, true)
+                    && loop_uses_mark(uses, offset + expr->value, false);
+                break;
+            case ExprType_Mul:
+                known = loop_uses_mark(uses, offset, true)
+                    && loop_uses_mark(uses, offset + expr->offset, false);
+                break;
+            case ExprType_MulRange:
+                known = loop_uses_mark(uses, offset, true);
+                for (int j = 0; known && j < expr->length; ++j) {
+                    int target = offset + expr->offset + j;
+                    known = loop_uses_mark(uses, target, false);
+                }
+                break;
+            case ExprType_ClearRange:
+            case ExprType_AddRange:
+                for (int j = 0; known && j < expr->length; ++j) {
+                    int target = offset + expr->offset + j;
+                    known = loop_uses_mark(uses, target, false);
+                }
+                break;
+            case ExprType_Loop:
+            case ExprType_If:
+                known = loop_uses_mark(uses, offset, true)
+                    && loop_uses_mark(uses, offset, false)
+                    && loop_uses_collect(&expr->exprs, offset, false, uses);
+                break;
+            default:
+                known = false;
+                break;
+        }
+        if (!known) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool hoist_invariants_analyze(
+    const Expr* loop, LoopUses* uses, const OptimizerOptions* options
+)
+{
+    uses->length = 0;
+    if (!loop_uses_collect(&loop->exprs, 0, true, uses)) {
+        return false;
+    }
+    CellUse* control = loop_uses_find(uses, 0);
+    if (control == NULL || control->written || control->delta % 2 == 0) {
+        return false;
+    }
+    long long modulus = cell_modulus(options);
+    bool any = false;
+    for (size_t i = 0; i < uses->length; ++i) {
+        CellUse* cell = &uses->cells[i];
+        cell->delta = (cell->delta % modulus + modulus) % modulus;
+        any = any || (cell->offset != 0 && !cell->read && !cell->written);
+    }
+    return any;
+}
+
+static bool hoist_invariants_guard(
+    const Expr* match, const OptimizerOptions* options
+)
+{
+    LoopUses uses;
+    return hoist_invariants_analyze(&match[0], &uses, options);
+}
+
+static void hoist_invariants_build(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+)
+{
+    LoopUses uses;
+    hoist_invariants_analyze(&match[0], &uses, options);
+    long long step = loop_uses_find(&uses, 0)->delta;
+    for (size_t i = 0; i < uses.length; ++i) {
+        const CellUse* cell = &uses.cells[i];
+        if (cell->offset != 0 && !cell->read && !cell->written) {
+            push_multiply(
+                replacement,
+                match[0].loc,
+                cell->offset,
+                trip_factor(cell->delta, step, options),
+                options
+            );
+        }
+    }
+    Expr loop = {
+        .type = ExprType_Loop,
+        .loc = match[0].loc,
+    };
+    expr_vec_construct(&loop.exprs);
+    int offset = 0;
+    for (size_t i = 0; i < match[0].exprs.length; ++i) {
+        const Expr* expr = &match[0].exprs.data[i];
+        if (expr->type == ExprType_Left) {
+            offset -= expr->value;
+        } else if (expr->type == ExprType_Right) {
+            offset += expr->value;
+        } else if (offset != 0
+                   && (expr->type == ExprType_Incr
+                       || expr->type == ExprType_Decr)) {
+            const CellUse* cell = loop_uses_find(&uses, offset);
+            if (!cell->read && !cell->written) {
+                continue;
+            }
+        }
+        expr_vec_push(&loop.exprs, expr_clone(expr));
+    }
+    expr_vec_push(replacement, loop);
+}
+
+static const RewriteRule hoist_invariants_rule = {
+    .name = "hoist_invariants",
+    .pattern_length = 1,
+    .pattern = { { .types = EXPR_TYPE_BIT(ExprType_Loop) } },
+    .guard = hoist_invariants_guard,
+    .build = hoist_invariants_build,
+};
+
+ExprVec optimize_hoist_invariants(
+    const ExprVec* vec, const OptimizerOptions* options
+)
+{
+    const RewriteRule* rules[] = { &hoist_invariants_rule };
+    return rewrite_apply(vec, rules, 1, options);
+}
+
+/*
+ *  pass registry
+ *
+ *  Every pass the pipeline can be built from. The cost class decides which
+ *  optimization levels include a pass: -O1 runs the cheap ones once, -O2
+ *  adds the moderate ones and iterates a few times, -O3 runs everything
+ *  until the program stops changing. The rewrite rules come first, in the
+ *  order the engine tries them, so a level runs all of its rules in one
+ *  traversal.
+ *
+ *  cheap      folding and cancelling adjacent arithmetic and moves
+ *  moderate   zeroing, copying, multiply and conditional loops, hoisting
+ *             invariants out of loops, merging ranges
+ *  expensive  divmod loops, which are compared against whole templates and
+ *             keep the loop as a fallback
+ *
+ */
+
+static const OptimizerPass optimizer_passes[] = {
+    {
+        .name = "fold_adjecent",
+        .rule = &fold_adjecent_rule,
+        .cost = PassCost_Cheap,
+    },
+    {
+        .name = "eliminate_negation",
+        .rule = &eliminate_negation_rule,
+        .cost = PassCost_Cheap,
+    },
+    {
+        .name = "eliminate_overflow",
+        .rule = &eliminate_overflow_rule,
+        .cost = PassCost_Cheap,
+    },
+    {
+        .name = "replace_zeroing_loops",
+        .rule = &replace_zeroing_loops_rule,
+        .cost = PassCost_Moderate,
+    },
+    {
+        .name = "replace_multiply_loops",
+        .rule = &replace_multiply_loops_rule,
+        .cost = PassCost_Moderate,
+    },
+    {
+        .name = "replace_copying_loops",
+        .rule = &replace_copying_loops_rule,
+        .cost = PassCost_Moderate,
+    },
+    {
+        .name = "replace_conditional_loops",
+        .rule = &replace_conditional_loops_rule,
+        .cost = PassCost_Moderate,
+    },
+    {
+        .name = "replace_divmod_loops",
+        .rule = &replace_divmod_loops_rule,
+        .cost = PassCost_Expensive,
+    },
+    {
+        .name = "hoist_invariants",
+        .pass = optimize_hoist_invariants,
+        .cost = PassCost_Moderate,
+    },
+    {
+        .name = "merge_ranges",
+        .pass = optimize_merge_ranges,
+        .cost = PassCost_Moderate,
+    },
+};
+
+static const size_t optimizer_passes_length
+    = sizeof(optimizer_passes) / sizeof(optimizer_passes[0]);
+
+// how a run of rule passes shows up in a trace
+static const OptimizerPass optimizer_rewrite_pass = {
+    .name = "rewrite",
+    .pass = optimize_rewrite,
+    .cost = PassCost_Cheap,
+};
+
+OptimizerOptions optimizer_default_options(void)
+{
+    return (OptimizerOptions) {
+        .cell_width = CellWidth_8,
+    };
+}
+
+const OptimizerPass* optimizer_find_pass(const char* name, size_t length)
+{
+    for (size_t i = 0; i < optimizer_passes_length; ++i) {
+        if (strlen(optimizer_passes[i].name) == length
+            && strncmp(optimizer_passes[i].name, name, length) == 0) {
+            return &optimizer_passes[i];
+        }
+    }
+    return NULL;
+}
+
+OptimizerPipeline optimizer_pipeline_for_level(int level)
+{
+    OptimizerPipeline pipeline = {
+        .passes_length = 0,
+        .max_iterations = 0,
+        .time_budget = 0.0,
+        .threads = 1,
+    };
+    PassCost max_cost;
+    if (level <= 0) {
+        return pipeline;
+    } else if (level == 1) {
+        max_cost = PassCost_Cheap;
+        pipeline.max_iterations = 1;
+    } else if (level == 2) {
+        max_cost = PassCost_Moderate;
+        pipeline.max_iterations = 8;
+    } else {
+        max_cost = PassCost_Expensive;
+    }
+    for (size_t i = 0; i < optimizer_passes_length; ++i) {
+        if (optimizer_passes[i].cost <= max_cost) {
+            pipeline.passes[pipeline.passes_length] = &optimizer_passes[i];
+            pipeline.passes_length += 1;
+        }
+    }
+    return pipeline;
+}
+
+static bool optimizer_pipeline_push(
+    OptimizerPipeline* pipeline, const OptimizerPass* pass
+)
+{
+    if (pipeline->passes_length == OPTIMIZER_MAX_PASSES) {
+        return false;
+    }
+    pipeline->passes[pipeline->passes_length] = pass;
+    pipeline->passes_length += 1;
+    return true;
+}
+
+// replaces the passes with a comma separated list of pass names, fails on
+// names missing from the registry. "rewrite" stands for every rewrite rule
+bool optimizer_pipeline_set_passes(
+    OptimizerPipeline* pipeline, const char* names
+)
+{
+    pipeline->passes_length = 0;
+    const char* name = names;
+    while (*name != '\0') {
+        size_t length = strcspn(name, ",");
+        if (length == strlen("rewrite")
+            && strncmp(name, "rewrite", length) == 0) {
+            for (size_t i = 0; i < optimizer_passes_length; ++i) {
+                if (optimizer_passes[i].rule != NULL
+                    && !optimizer_pipeline_push(
+                        pipeline, &optimizer_passes[i]
+                    )) {
+                    return false;
+                }
+            }
+        } else if (length > 0) {
+            const OptimizerPass* pass = optimizer_find_pass(name, length);
+            if (pass == NULL || !optimizer_pipeline_push(pipeline, pass)) {
+                return false;
+            }
+        }
+        name += length;
+        if (*name == ',') {
+            name += 1;
+        }
+    }
+    return true;
+}
+
+static double optimizer_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+/*
+ *  optimize program
+ *
+ *  Runs the pipeline's passes in order until an iteration leaves the
+ *  program unchanged, the iteration cap is reached or the time budget runs
+ *  out. The budget is checked between passes, every pass leaves a valid
+ *  program behind so stopping early only costs optimization.
+ *
+ */
+
+static ExprVec optimize_sequential(
+    const ExprVec* program,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    const OptimizerTrace* trace
+)
+{
+    ExprVec ast = expr_vec_clone(program);
+    if (pipeline->passes_length == 0) {
+        return ast;
+    }
+    double start = optimizer_now();
+    bool out_of_time = false;
+    for (int iteration = 1; !out_of_time; ++iteration) {
+        if (trace != NULL && trace->iteration_started != NULL) {
+            trace->iteration_started(trace->user, iteration);
+        }
+        double iteration_start = optimizer_now();
+        ExprVec iteration_ast = expr_vec_clone(&ast);
+        for (size_t i = 0; i < pipeline->passes_length && !out_of_time;) {
+            const OptimizerPass* pass = pipeline->passes[i];
+            double pass_start = optimizer_now();
+            ExprVec optimized;
+            if (pass->rule != NULL) {
+                // rules next to each other share a traversal, which is
+                // traced as a single rewrite pass
+                const RewriteRule* rules[OPTIMIZER_MAX_PASSES];
+                size_t rules_length = 0;
+                while (i < pipeline->passes_length
+                       && pipeline->passes[i]->rule != NULL) {
+                    rules[rules_length] = pipeline->passes[i]->rule;
+                    rules_length += 1;
+                    i += 1;
                 }
-                expr_vec_push(&result, (Expr) { .type = ExprType_Zero });
+                optimized = rewrite_apply(&ast, rules, rules_length, options);
+                pass = &optimizer_rewrite_pass;
             } else {
-                expr_vec_push(
-                    &result,
-                    (Expr) {
-                        .type = ExprType_Loop,
-                        .exprs = optimize_replace_copying_loops(&expr->exprs),
-                    }
+                optimized = pass->pass(&ast, options);
+                i += 1;
+            }
+            double now = optimizer_now();
+            if (trace != NULL && trace->pass_finished != NULL) {
+                trace->pass_finished(
+                    trace->user,
+                    pass,
+                    iteration,
+                    now - pass_start,
+                    &ast,
+                    &optimized
                 );
             }
+            expr_vec_free(&ast);
+            ast = optimized;
+            out_of_time = pipeline->time_budget > 0.0
+                && now - start >= pipeline->time_budget;
+        }
+        if (trace != NULL && trace->iteration_finished != NULL) {
+            trace->iteration_finished(
+                trace->user, iteration, optimizer_now() - iteration_start, &ast
+            );
+        }
+        bool changed = !expr_vec_equal(&ast, &iteration_ast);
+        expr_vec_free(&iteration_ast);
+        if (!changed
+            || (pipeline->max_iterations > 0
+                && iteration >= pipeline->max_iterations)) {
+            break;
+        }
+    }
+    return ast;
+}
+
+/*
+ *  memoized optimization
+ *
+ *  Generated programs repeat the same loops many times, and optimizing
+ *  every copy repeats the same work. Loops are interned by structure, and
+ *  a loop of at least OPTIMIZER_MEMO_MIN_NODES nodes that occurs more than
+ *  once, at any depth, is optimized on its own the first time it is met.
+ *  Later copies take a clone of that result. The program itself is
+ *  interned, so the table holds the first copy of every loop and finding
+ *  a loop that occurs once only compares pointers.
+ *
+ *  The nodes between memoized loops are optimized as they are, and a loop
+ *  that contains memoized loops is rebuilt around its memoized body and
+ *  optimized as a single node, for the rules that match a whole loop. No
+ *  rule matches a loop together with other nodes, so the seam between two
+ *  parts is fixed by running the pipeline once more over the nodes that do
+ *  not branch on either side of it. A time budget is shared by
+ *  all the parts, and a loop is only kept if its optimization finished
+ *  within it. A trace sees the whole as a single iteration.
+ *
+ *  A pipeline that runs a single iteration, as -O1 does, is left alone, as
+ *  cloning a result costs about as much as optimizing the loop again.
+ *
+ */
+
+#define OPTIMIZER_MEMO_MIN_NODES 16
+
+typedef struct {
+    bool marked;
+    // a memoized loop is nested somewhere in the body
+    bool nested;
+    bool repeated;
+    size_t nodes;
+    bool optimized;
+    ExprVec result;
+} OptimizerMemoEntry;
+
+typedef struct {
+    ExprTable table;
+    OptimizerMemoEntry* entries;
+    const OptimizerPipeline* pipeline;
+    const OptimizerOptions* options;
+    double deadline;
+} OptimizerMemo;
+
+// counts the nodes, marks the loops worth memoizing and tells whether the
+// nodes contain any of them
+static bool optimizer_memo_mark(
+    OptimizerMemo* memo, const ExprVec* vec, size_t* nodes
+)
+{
+    bool any = false;
+    for (size_t i = 0; i < vec->length; ++i) {
+        const Expr* expr = &vec->data[i];
+        if (expr->type == ExprType_Loop) {
+            int id = expr_table_find(&memo->table, expr);
+            OptimizerMemoEntry* entry = &memo->entries[id];
+            if (!entry->marked) {
+                entry->marked = true;
+                entry->nodes = 1;
+                entry->nested
+                    = optimizer_memo_mark(memo, &expr->exprs, &entry->nodes);
+                entry->repeated = memo->table.entries[id].count > 1
+                    && entry->nodes >= OPTIMIZER_MEMO_MIN_NODES;
+            }
+            *nodes += entry->nodes;
+            any = any || entry->repeated || entry->nested;
+        } else if (expr_has_body(expr)) {
+            *nodes += 1;
+            any = optimizer_memo_mark(memo, &expr->exprs, nodes) || any;
         } else {
-            expr_vec_push(&result, expr_clone(expr));
+            *nodes += 1;
+        }
+    }
+    return any;
+}
+
+// runs the pipeline with what is left of the time budget, and tells
+// whether it finished before the deadline
+static ExprVec optimize_memo_part(
+    const OptimizerMemo* memo, const ExprVec* nodes, bool* finished
+)
+{
+    OptimizerPipeline budgeted = *memo->pipeline;
+    if (memo->pipeline->time_budget > 0.0) {
+        double remaining = memo->deadline - optimizer_now();
+        if (remaining > 0.0) {
+            budgeted.time_budget = remaining;
+        } else {
+            budgeted.passes_length = 0;
+        }
+    }
+    ExprVec optimized
+        = optimize_sequential(nodes, &budgeted, memo->options, NULL);
+    *finished = memo->pipeline->time_budget <= 0.0
+        || optimizer_now() < memo->deadline;
+    return optimized;
+}
+
+// appends an optimized part to the result, taking its nodes over, and
+// optimizes the nodes that do not branch on both sides of the seam together
+static void optimize_memo_append(
+    const OptimizerMemo* memo, ExprVec* result, ExprVec* part
+)
+{
+    size_t tail = 0;
+    while (tail < result->length
+           && !expr_branches(&result->data[result->length - tail - 1])) {
+        tail += 1;
+    }
+    size_t head = 0;
+    while (head < part->length && !expr_branches(&part->data[head])) {
+        head += 1;
+    }
+    if (tail == 0 || head == 0) {
+        head = 0;
+    } else {
+        ExprVec seam;
+        expr_vec_construct(&seam);
+        for (size_t i = result->length - tail; i < result->length; ++i) {
+            expr_vec_push(&seam, result->data[i]);
+        }
+        result->length -= tail;
+        for (size_t i = 0; i < head; ++i) {
+            expr_vec_push(&seam, part->data[i]);
+        }
+        bool finished;
+        ExprVec fixed = optimize_memo_part(memo, &seam, &finished);
+        expr_vec_free(&seam);
+        for (size_t i = 0; i < fixed.length; ++i) {
+            expr_vec_push(result, fixed.data[i]);
+        }
+        expr_vec_destroy(&fixed);
+    }
+    for (size_t i = head; i < part->length; ++i) {
+        expr_vec_push(result, part->data[i]);
+    }
+    expr_vec_destroy(part);
+}
+
+static ExprVec optimize_memo_vec(OptimizerMemo* memo, const ExprVec* vec);
+
+static ExprVec optimize_memo_loop(OptimizerMemo* memo, const Expr* loop)
+{
+    OptimizerMemoEntry* entry
+        = &memo->entries[expr_table_find(&memo->table, loop)];
+    if (entry->optimized) {
+        return expr_vec_clone(&entry->result);
+    }
+    bool finished;
+    ExprVec optimized;
+    if (entry->nested) {
+        Expr rebuilt = {
+            .type = ExprType_Loop,
+            .loc = loop->loc,
+            .exprs = optimize_memo_vec(memo, &loop->exprs),
+        };
+        ExprVec nodes = {
+            .data = &rebuilt,
+            .capacity = 1,
+            .length = 1,
+        };
+        optimized = optimize_memo_part(memo, &nodes, &finished);
+        expr_free(&rebuilt);
+    } else {
+        // borrows the loop, which is cloned before any pass runs
+        ExprVec nodes = {
+            .data = (Expr*)loop,
+            .capacity = 1,
+            .length = 1,
+        };
+        optimized = optimize_memo_part(memo, &nodes, &finished);
+    }
+    if (entry->repeated && finished) {
+        entry->optimized = true;
+        entry->result = expr_vec_clone(&optimized);
+    }
+    return optimized;
+}
+
+static ExprVec optimize_memo_vec(OptimizerMemo* memo, const ExprVec* vec)
+{
+    ExprVec result;
+    expr_vec_construct(&result);
+    size_t run_start = 0;
+    for (size_t i = 0; i <= vec->length; ++i) {
+        const Expr* expr = i < vec->length ? &vec->data[i] : NULL;
+        if (expr != NULL) {
+            if (expr->type != ExprType_Loop) {
+                continue;
+            }
+            const OptimizerMemoEntry* entry
+                = &memo->entries[expr_table_find(&memo->table, expr)];
+            if (!entry->repeated && !entry->nested) {
+                continue;
+            }
+        }
+        if (i > run_start) {
+            ExprVec run = {
+                .data = &vec->data[run_start],
+                .capacity = i - run_start,
+                .length = i - run_start,
+            };
+            bool finished;
+            ExprVec optimized = optimize_memo_part(memo, &run, &finished);
+            optimize_memo_append(memo, &result, &optimized);
         }
+        run_start = i + 1;
+        if (expr == NULL) {
+            break;
+        }
+        ExprVec optimized = optimize_memo_loop(memo, expr);
+        optimize_memo_append(memo, &result, &optimized);
     }
     return result;
 }
+
+static ExprVec optimize_memoized(
+    const ExprVec* program,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    const OptimizerTrace* trace
+)
+{
+    if (pipeline->passes_length == 0 || pipeline->max_iterations == 1) {
+        return optimize_sequential(program, pipeline, options, trace);
+    }
+    double start = optimizer_now();
+    // hashing only fills in the cached hashes, which are not part of the
+    // value of a node, so the program is interned where it is
+    ExprVec* ast = (ExprVec*)program;
+    expr_vec_hash_loops(ast);
+    OptimizerMemo memo = {
+        .pipeline = pipeline,
+        .options = options,
+        .deadline = start + pipeline->time_budget,
+    };
+    expr_table_construct(&memo.table);
+    expr_table_intern_all(&memo.table, ast);
+    memo.entries = calloc(
+        memo.table.length > 0 ? memo.table.length : 1,
+        sizeof(OptimizerMemoEntry)
+    );
+    size_t nodes = 0;
+    ExprVec optimized;
+    if (!optimizer_memo_mark(&memo, ast, &nodes)) {
+        optimized = optimize_sequential(ast, pipeline, options, trace);
+    } else {
+        if (trace != NULL && trace->iteration_started != NULL) {
+            trace->iteration_started(trace->user, 1);
+        }
+        optimized = optimize_memo_vec(&memo, ast);
+        if (trace != NULL && trace->iteration_finished != NULL) {
+            trace->iteration_finished(
+                trace->user, 1, optimizer_now() - start, &optimized
+            );
+        }
+    }
+    for (size_t i = 0; i < memo.table.length; ++i) {
+        if (memo.entries[i].optimized) {
+            expr_vec_free(&memo.entries[i].result);
+        }
+    }
+    free(memo.entries);
+    expr_table_destroy(&memo.table);
+    return optimized;
+}
+
+/*
+ *  parallel optimization
+ *
+ *  Passes rewrite every loop body and the top level on their own, and rules
+ *  only match runs of adjacent nodes. So a large program is split at the
+ *  top level into chunks that each end in a loop, and the chunks are
+ *  optimized in parallel. The only matches that can be missed are those
+ *  across a seam, which running the pipeline once more over the few nodes
+ *  on either side of every seam picks up. A trace sees the whole as a
+ *  single iteration.
+ *
+ */
+
+#define OPTIMIZER_PARALLEL_MIN_NODES 16384
+#define OPTIMIZER_CHUNKS_PER_THREAD 4
+#define OPTIMIZER_SEAM_NODES 8
+
+typedef struct {
+    const ExprVec* program;
+    const size_t* ends;
+    ExprVec* results;
+    const OptimizerPipeline* pipeline;
+    const OptimizerOptions* options;
+} ParallelOptimization;
+
+static void optimize_chunk(void* user, size_t index)
+{
+    ParallelOptimization* work = user;
+    size_t start = index == 0 ? 0 : work->ends[index - 1];
+    // borrows the nodes, which are cloned before any pass runs
+    ExprVec chunk = {
+        .data = &work->program->data[start],
+        .capacity = work->ends[index] - start,
+        .length = work->ends[index] - start,
+    };
+    work->results[index]
+        = optimize_memoized(&chunk, work->pipeline, work->options, NULL);
+}
+
+static ExprVec optimize_parallel(
+    const ExprVec* program,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    int threads
+)
+{
+    size_t count = (size_t)threads * OPTIMIZER_CHUNKS_PER_THREAD;
+    size_t* ends = malloc(sizeof(size_t) * count);
+    count = expr_vec_split(program, count, ends);
+    ExprVec* results = malloc(sizeof(ExprVec) * count);
+    ParallelOptimization work = {
+        .program = program,
+        .ends = ends,
+        .results = results,
+        .pipeline = pipeline,
+        .options = options,
+    };
+    parallel_for(count, threads, optimize_chunk, &work);
+
+    ExprVec ast;
+    expr_vec_construct(&ast);
+    for (size_t i = 0; i < count; ++i) {
+        ExprVec* chunk = &results[i];
+        size_t head = 0;
+        if (i > 0) {
+            ExprVec seam;
+            expr_vec_construct(&seam);
+            size_t tail = ast.length < OPTIMIZER_SEAM_NODES
+                ? ast.length
+                : OPTIMIZER_SEAM_NODES;
+            for (size_t j = ast.length - tail; j < ast.length; ++j) {
+                expr_vec_push(&seam, ast.data[j]);
+            }
+            ast.length -= tail;
+            head = chunk->length < OPTIMIZER_SEAM_NODES
+                ? chunk->length
+                : OPTIMIZER_SEAM_NODES;
+            for (size_t j = 0; j < head; ++j) {
+                expr_vec_push(&seam, chunk->data[j]);
+            }
+            ExprVec fixed
+                = optimize_sequential(&seam, pipeline, options, NULL);
+            expr_vec_free(&seam);
+            for (size_t j = 0; j < fixed.length; ++j) {
+                expr_vec_push(&ast, fixed.data[j]);
+            }
+            expr_vec_destroy(&fixed);
+        }
+        for (size_t j = head; j < chunk->length; ++j) {
+            expr_vec_push(&ast, chunk->data[j]);
+        }
+        expr_vec_destroy(chunk);
+    }
+    free(results);
+    free(ends);
+    return ast;
+}
+
+ExprVec optimize_program(
+    const ExprVec* program,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    const OptimizerTrace* trace
+)
+{
+    int threads = parallel_thread_count(pipeline->threads);
+    if (threads == 1 || pipeline->passes_length == 0
+        || expr_vec_count_nodes(program) < OPTIMIZER_PARALLEL_MIN_NODES) {
+        return optimize_memoized(program, pipeline, options, trace);
+    }
+    if (trace != NULL && trace->iteration_started != NULL) {
+        trace->iteration_started(trace->user, 1);
+    }
+    double start = optimizer_now();
+    ExprVec ast = optimize_parallel(program, pipeline, options, threads);
+    if (trace != NULL && trace->iteration_finished != NULL) {
+        trace->iteration_finished(
+            trace->user, 1, optimizer_now() - start, &ast
+        );
+    }
+    return ast;
+}
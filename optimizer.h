@@ -2,19 +2,84 @@
 #define OPTIMIZER_H
 
 #include "expr.h"
+#include <stdbool.h>
+#include <stddef.h>
 
-ExprVec optimize_fold_adjecent(const ExprVec* vec);
-Expr expr_optimize_fold_adjecent(const Expr* expr);
+typedef struct {
+    CellWidth cell_width;
+} OptimizerOptions;
 
-ExprVec optimize_eliminate_negation(const ExprVec* vec);
-Expr expr_optimize_eliminate_negation(const Expr* expr);
+OptimizerOptions optimizer_default_options(void);
 
-ExprVec optimize_eliminate_overflow(const ExprVec* vec);
-Expr expr_optimize_eliminate_overflow(const Expr* expr);
+ExprVec optimize_rewrite(const ExprVec* vec, const OptimizerOptions* options);
+ExprVec optimize_hoist_invariants(
+    const ExprVec* vec, const OptimizerOptions* options
+);
+ExprVec optimize_merge_ranges(
+    const ExprVec* vec, const OptimizerOptions* options
+);
 
-ExprVec optimize_replace_zeroing_loops(const ExprVec* vec);
-Expr expr_optimize_replace_zeroing_loops(const Expr* expr);
+typedef ExprVec (*OptimizationPass)(
+    const ExprVec* vec, const OptimizerOptions* options
+);
 
-ExprVec optimize_replace_copying_loops(const ExprVec* vec);
+typedef enum {
+    PassCost_Cheap,
+    PassCost_Moderate,
+    PassCost_Expensive,
+} PassCost;
+
+typedef struct RewriteRule RewriteRule;
+
+typedef struct {
+    const char* name;
+    // a pass over the whole tree, or NULL for a single rewrite rule
+    OptimizationPass pass;
+    const RewriteRule* rule;
+    PassCost cost;
+} OptimizerPass;
+
+const OptimizerPass* optimizer_find_pass(const char* name, size_t length);
+
+#define OPTIMIZER_MAX_PASSES 32
+
+typedef struct {
+    const OptimizerPass* passes[OPTIMIZER_MAX_PASSES];
+    size_t passes_length;
+    // 0 runs until an iteration leaves the program unchanged
+    int max_iterations;
+    // in seconds, 0 means no limit
+    double time_budget;
+    // for large programs, 0 for one per processor
+    int threads;
+} OptimizerPipeline;
+
+OptimizerPipeline optimizer_pipeline_for_level(int level);
+bool optimizer_pipeline_set_passes(
+    OptimizerPipeline* pipeline, const char* names
+);
+
+typedef struct {
+    void (*iteration_started)(void* user, int iteration);
+    void (*pass_finished)(
+        void* user,
+        const OptimizerPass* pass,
+        int iteration,
+        double seconds,
+        const ExprVec* before,
+        const ExprVec* after
+    );
+    void (*iteration_finished)(
+        void* user, int iteration, double seconds, const ExprVec* ast
+    );
+    void* user;
+} OptimizerTrace;
+
+ExprVec optimize_program(
+    const ExprVec* program,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    const OptimizerTrace* trace
+);
 
 #endif
@@ -0,0 +1,60 @@
+#include "parallel.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    ParallelTask task;
+    void* user;
+    size_t count;
+    atomic_size_t next;
+} ParallelLoop;
+
+// 0 or less picks one thread per online processor
+int parallel_thread_count(int threads)
+{
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return threads > 0 ? threads : 1;
+}
+
+static void* parallel_worker(void* data)
+{
+    ParallelLoop* loop = data;
+    size_t index;
+    while ((index = atomic_fetch_add(&loop->next, 1)) < loop->count) {
+        loop->task(loop->user, index);
+    }
+    return NULL;
+}
+
+// runs task for every index below count, on up to threads threads,
+// including the calling one, and returns once all of them are done
+void parallel_for(size_t count, int threads, ParallelTask task, void* user)
+{
+    ParallelLoop loop = {
+        .task = task,
+        .user = user,
+        .count = count,
+    };
+    atomic_init(&loop.next, 0);
+    size_t helper_count = (size_t)parallel_thread_count(threads) - 1;
+    if (helper_count > count) {
+        helper_count = count > 0 ? count - 1 : 0;
+    }
+    pthread_t* helpers = malloc(sizeof(pthread_t) * (helper_count + 1));
+    size_t started = 0;
+    while (started < helper_count
+           && pthread_create(&helpers[started], NULL, parallel_worker, &loop)
+               == 0) {
+        started += 1;
+    }
+    parallel_worker(&loop);
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+}
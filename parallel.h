@@ -0,0 +1,11 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+typedef void (*ParallelTask)(void* user, size_t index);
+
+int parallel_thread_count(int threads);
+void parallel_for(size_t count, int threads, ParallelTask task, void* user);
+
+#endif
@@ -6,6 +6,7 @@ Lexer lexer_from_string(const char* text, size_t length)
     Lexer lexer = (Lexer) {
         .type = LexerType_String,
         .current = text[0],
+        .loc = { .offset = 0, .line = 1, .column = 1 },
         .string = {
             .text = text,
             .index = 0,
@@ -23,15 +24,16 @@ Lexer lexer_from_file(FILE* file)
         .file = file,
     };
     lexer_step(&lexer);
+    lexer.loc = (SourceLoc) { .offset = 0, .line = 1, .column = 1 };
     return lexer;
 }
 
-Lexer lexer_from_args_or_stdin(int argc, char** argv)
+Lexer lexer_from_path_or_stdin(const char* path)
 {
-    if (argc >= 2) {
-        FILE* file = fopen(argv[1], "r");
+    if (path != NULL) {
+        FILE* file = fopen(path, "r");
         if (!file) {
-            fprintf(stderr, "panic: could not open file \"%s\"\n", argv[1]);
+            fprintf(stderr, "panic: could not open file \"%s\"\n", path);
             exit(1);
         }
         return lexer_from_file(file);
@@ -40,6 +42,34 @@ Lexer lexer_from_args_or_stdin(int argc, char** argv)
     }
 }
 
+char* read_source(const char* path, size_t* length)
+{
+    FILE* file = stdin;
+    if (path != NULL) {
+        file = fopen(path, "r");
+        if (!file) {
+            return NULL;
+        }
+    }
+    size_t capacity = 4096;
+    char* text = malloc(capacity);
+    *length = 0;
+    size_t read;
+    while ((read = fread(&text[*length], 1, capacity - *length - 1, file))
+           > 0) {
+        *length += read;
+        if (*length + 1 == capacity) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+        }
+    }
+    text[*length] = '\0';
+    if (file != stdin) {
+        fclose(file);
+    }
+    return text;
+}
+
 bool lexer_done(Lexer* lexer)
 {
     switch (lexer->type) {
@@ -56,6 +86,13 @@ void lexer_step(Lexer* lexer)
     if (lexer_done(lexer)) {
         return;
     }
+    lexer->loc.offset += 1;
+    if (lexer->current == '\n') {
+        lexer->loc.line += 1;
+        lexer->loc.column = 1;
+    } else {
+        lexer->loc.column += 1;
+    }
     switch (lexer->type) {
         case LexerType_String:
             lexer->string.index += 1;
@@ -70,6 +107,7 @@ void lexer_step(Lexer* lexer)
 
 Token lexer_next(Lexer* lexer)
 {
+    lexer->token_loc = lexer->loc;
     if (lexer_done(lexer)) {
         return Token_Eof;
     }
@@ -97,20 +135,21 @@ Token lexer_next(Lexer* lexer)
 
 Parser parser_create(Lexer lexer)
 {
-    return (Parser) {
-        .lexer = lexer,
-        .current = lexer_next(&lexer),
-    };
+    Parser parser = (Parser) { .lexer = lexer };
+    parser_step(&parser);
+    return parser;
 }
 
 void parser_step(Parser* parser)
 {
     parser->current = lexer_next(&parser->lexer);
+    parser->current_loc = parser->lexer.token_loc;
 }
 Expr parser_parse_expr(Parser* parser);
 
 Expr parser_parse_loop(Parser* parser)
 {
+    SourceLoc loc = parser->current_loc;
     parser_step(parser);
     ExprVec exprs;
     expr_vec_construct(&exprs);
@@ -118,43 +157,53 @@ Expr parser_parse_loop(Parser* parser)
         expr_vec_push(&exprs, parser_parse_expr(parser));
     }
     if (parser->current != Token_RBracket) {
-        return (Expr) { .type = ExprType_Error };
+        return (Expr) { .type = ExprType_Error, .loc = loc };
     }
     parser_step(parser);
-    return (Expr) { .type = ExprType_Loop, .exprs = exprs };
+    return (Expr) { .type = ExprType_Loop, .loc = loc, .exprs = exprs };
 }
 
 Expr parser_parse_expr(Parser* parser)
 {
+    SourceLoc loc = parser->current_loc;
     switch (parser->current) {
         case Token_Plus:
             return (
                 parser_step(parser),
-                (Expr) { .type = ExprType_Incr, .value = 1 }
+                (Expr) { .type = ExprType_Incr, .loc = loc, .value = 1 }
             );
         case Token_Minus:
             return (
                 parser_step(parser),
-                (Expr) { .type = ExprType_Decr, .value = 1 }
+                (Expr) { .type = ExprType_Decr, .loc = loc, .value = 1 }
             );
         case Token_LT:
             return (
                 parser_step(parser),
-                (Expr) { .type = ExprType_Left, .value = 1 }
+                (Expr) { .type = ExprType_Left, .loc = loc, .value = 1 }
             );
         case Token_GT:
             return (
                 parser_step(parser),
-                (Expr) { .type = ExprType_Right, .value = 1 }
+                (Expr) { .type = ExprType_Right, .loc = loc, .value = 1 }
             );
         case Token_Dot:
-            return (parser_step(parser), (Expr) { .type = ExprType_Output });
+            return (
+                parser_step(parser),
+                (Expr) { .type = ExprType_Output, .loc = loc }
+            );
         case Token_Comma:
-            return (parser_step(parser), (Expr) { .type = ExprType_Input });
+            return (
+                parser_step(parser),
+                (Expr) { .type = ExprType_Input, .loc = loc }
+            );
         case Token_LBracket:
             return parser_parse_loop(parser);
         default:
-            return (parser_step(parser), (Expr) { .type = ExprType_Error });
+            return (
+                parser_step(parser),
+                (Expr) { .type = ExprType_Error, .loc = loc }
+            );
     }
 }
 
@@ -24,6 +24,8 @@ typedef enum {
 typedef struct {
     LexerType type;
     char current;
+    SourceLoc loc;
+    SourceLoc token_loc;
     union {
         struct {
             const char* text;
@@ -36,7 +38,8 @@ typedef struct {
 
 Lexer lexer_from_string(const char* text, size_t length);
 Lexer lexer_from_file(FILE* file);
-Lexer lexer_from_args_or_stdin(int argc, char** argv);
+Lexer lexer_from_path_or_stdin(const char* path);
+char* read_source(const char* path, size_t* length);
 bool lexer_done(Lexer* lexer);
 void lexer_step(Lexer* lexer);
 Token lexer_next(Lexer* lexer);
@@ -44,6 +47,7 @@ Token lexer_next(Lexer* lexer);
 typedef struct {
     Lexer lexer;
     Token current;
+    SourceLoc current_loc;
 } Parser;
 
 Parser parser_create(Lexer lexer);
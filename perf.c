@@ -0,0 +1,228 @@
+#include "perf.h"
+#include <elf.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+void perf_symbol_vec_construct(PerfSymbolVec* vec)
+{
+    *vec = (PerfSymbolVec) {
+        .data = malloc(sizeof(PerfSymbol) * 8),
+        .length = 0,
+        .capacity = 8,
+    };
+}
+
+void perf_symbol_vec_destroy(PerfSymbolVec* vec) { free(vec->data); }
+
+void perf_symbol_vec_push(PerfSymbolVec* vec, PerfSymbol symbol)
+{
+    if (vec->length + 1 > vec->capacity) {
+        vec->capacity *= 2;
+        vec->data = realloc(vec->data, sizeof(PerfSymbol) * vec->capacity);
+    }
+    vec->data[vec->length] = symbol;
+    vec->length += 1;
+}
+
+static PerfSymbol program_symbol(size_t start, size_t end)
+{
+    PerfSymbol symbol = {
+        .start = start,
+        .size = end - start,
+    };
+    snprintf(symbol.name, sizeof(symbol.name), "bf_program");
+    return symbol;
+}
+
+// covers the code between symbols (prologue, straight-line code between
+// top-level loops, epilogue) with `bf_program` entries, so every emitted
+// byte is attributed to some symbol
+void perf_symbol_vec_fill_gaps(PerfSymbolVec* vec, size_t code_size)
+{
+    PerfSymbolVec filled;
+    perf_symbol_vec_construct(&filled);
+    size_t pos = 0;
+    for (size_t i = 0; i < vec->length; ++i) {
+        PerfSymbol* symbol = &vec->data[i];
+        if (symbol->start > pos) {
+            perf_symbol_vec_push(&filled, program_symbol(pos, symbol->start));
+        }
+        perf_symbol_vec_push(&filled, *symbol);
+        pos = symbol->start + symbol->size;
+    }
+    if (code_size > pos) {
+        perf_symbol_vec_push(&filled, program_symbol(pos, code_size));
+    }
+    perf_symbol_vec_destroy(vec);
+    *vec = filled;
+}
+
+bool perf_map_write(
+    const PerfSymbolVec* symbols, const uint8_t* code, size_t code_size
+)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE* file = fopen(path, "a");
+    if (!file) {
+        return false;
+    }
+    for (size_t i = 0; i < symbols->length; ++i) {
+        const PerfSymbol* symbol = &symbols->data[i];
+        if (symbol->start + symbol->size > code_size) {
+            continue;
+        }
+        fprintf(
+            file,
+            "%lx %zx %s\n",
+            (unsigned long)(uintptr_t)&code[symbol->start],
+            symbol->size,
+            symbol->name
+        );
+    }
+    fclose(file);
+    return true;
+}
+
+/*
+ *  jitdump
+ *
+ *  Format described in linux/tools/perf/Documentation/jitdump-specification.
+ *  `perf record -k mono` followed by `perf inject --jit` picks up the file
+ *  because it is mmap'ed executable, and then resolves samples in the code
+ *  region to the JIT_CODE_LOAD records below.
+ *
+ */
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_CODE_LOAD 0
+#define JITDUMP_CODE_CLOSE 3
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} JitDumpHeader;
+
+typedef struct {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+} JitDumpRecordHeader;
+
+typedef struct {
+    JitDumpRecordHeader header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+} JitDumpCodeLoad;
+
+static uint64_t jitdump_timestamp(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+}
+
+bool jitdump_open(JitDump* dump)
+{
+    const char* directory = getenv("JITDUMPDIR");
+    char path[256];
+    snprintf(
+        path,
+        sizeof(path),
+        "%s/jit-%d.dump",
+        directory != NULL ? directory : "/tmp",
+        (int)getpid()
+    );
+    dump->file = fopen(path, "w+");
+    if (!dump->file) {
+        return false;
+    }
+    dump->marker_size = (size_t)sysconf(_SC_PAGESIZE);
+    dump->marker = mmap(
+        NULL,
+        dump->marker_size,
+        PROT_READ | PROT_EXEC,
+        MAP_PRIVATE,
+        fileno(dump->file),
+        0
+    );
+    if (dump->marker == MAP_FAILED) {
+        dump->marker = NULL;
+    }
+    JitDumpHeader header = {
+        .magic = JITDUMP_MAGIC,
+        .version = JITDUMP_VERSION,
+        .total_size = sizeof(JitDumpHeader),
+        .elf_mach = EM_X86_64,
+        .pad1 = 0,
+        .pid = (uint32_t)getpid(),
+        .timestamp = jitdump_timestamp(),
+        .flags = 0,
+    };
+    fwrite(&header, sizeof(header), 1, dump->file);
+    return true;
+}
+
+void jitdump_write_code(
+    JitDump* dump, const PerfSymbolVec* symbols, const uint8_t* code
+)
+{
+    uint32_t pid = (uint32_t)getpid();
+    uint32_t tid = (uint32_t)syscall(SYS_gettid);
+    for (size_t i = 0; i < symbols->length; ++i) {
+        const PerfSymbol* symbol = &symbols->data[i];
+        size_t name_size = strlen(symbol->name) + 1;
+        uint64_t address = (uint64_t)(uintptr_t)&code[symbol->start];
+        JitDumpCodeLoad record = {
+            .header = {
+                .id = JITDUMP_CODE_LOAD,
+                .total_size = (uint32_t)(
+                    sizeof(JitDumpCodeLoad) + name_size + symbol->size
+                ),
+                .timestamp = jitdump_timestamp(),
+            },
+            .pid = pid,
+            .tid = tid,
+            .vma = address,
+            .code_addr = address,
+            .code_size = symbol->size,
+            .code_index = (uint64_t)i,
+        };
+        fwrite(&record, sizeof(record), 1, dump->file);
+        fwrite(symbol->name, 1, name_size, dump->file);
+        fwrite(&code[symbol->start], 1, symbol->size, dump->file);
+    }
+    fflush(dump->file);
+}
+
+void jitdump_close(JitDump* dump)
+{
+    JitDumpRecordHeader close_record = {
+        .id = JITDUMP_CODE_CLOSE,
+        .total_size = sizeof(JitDumpRecordHeader),
+        .timestamp = jitdump_timestamp(),
+    };
+    fwrite(&close_record, sizeof(close_record), 1, dump->file);
+    if (dump->marker != NULL) {
+        munmap(dump->marker, dump->marker_size);
+    }
+    fclose(dump->file);
+}
@@ -0,0 +1,42 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+    size_t start;
+    size_t size;
+    char name[48];
+} PerfSymbol;
+
+typedef struct {
+    PerfSymbol* data;
+    size_t length;
+    size_t capacity;
+} PerfSymbolVec;
+
+void perf_symbol_vec_construct(PerfSymbolVec* vec);
+void perf_symbol_vec_destroy(PerfSymbolVec* vec);
+void perf_symbol_vec_push(PerfSymbolVec* vec, PerfSymbol symbol);
+void perf_symbol_vec_fill_gaps(PerfSymbolVec* vec, size_t code_size);
+
+bool perf_map_write(
+    const PerfSymbolVec* symbols, const uint8_t* code, size_t code_size
+);
+
+typedef struct {
+    FILE* file;
+    void* marker;
+    size_t marker_size;
+} JitDump;
+
+bool jitdump_open(JitDump* dump);
+void jitdump_write_code(
+    JitDump* dump, const PerfSymbolVec* symbols, const uint8_t* code
+);
+void jitdump_close(JitDump* dump);
+
+#endif
@@ -0,0 +1,289 @@
+#include "profile.h"
+#include "expr.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void profile_construct(Profile* profile)
+{
+    *profile = (Profile) {
+        .loops = malloc(sizeof(SourceLoc) * 8),
+        .length = 0,
+        .capacity = 8,
+        .counters = NULL,
+    };
+}
+
+void profile_destroy(Profile* profile)
+{
+    free(profile->loops);
+    free(profile->counters);
+}
+
+int profile_add_loop(Profile* profile, SourceLoc loc)
+{
+    if (profile->length + 1 > profile->capacity) {
+        profile->capacity *= 2;
+        profile->loops
+            = realloc(profile->loops, sizeof(SourceLoc) * profile->capacity);
+    }
+    profile->loops[profile->length] = loc;
+    profile->length += 1;
+    return (int)profile->length - 1;
+}
+
+void profile_allocate_counters(Profile* profile)
+{
+    free(profile->counters);
+    profile->counters = calloc(
+        profile->length * PROFILE_COUNTERS_PER_LOOP + 1, sizeof(uint64_t)
+    );
+}
+
+uint64_t profile_entries(const Profile* profile, int loop_id)
+{
+    return profile->counters
+        [loop_id * PROFILE_COUNTERS_PER_LOOP + PROFILE_ENTRIES];
+}
+
+uint64_t profile_iterations(const Profile* profile, int loop_id)
+{
+    return profile->counters
+        [loop_id * PROFILE_COUNTERS_PER_LOOP + PROFILE_ITERATIONS];
+}
+
+static const Profile* sorting_profile;
+
+static int compare_loop_ids(const void* a, const void* b)
+{
+    uint64_t lhs = profile_iterations(sorting_profile, *(const int*)a);
+    uint64_t rhs = profile_iterations(sorting_profile, *(const int*)b);
+    return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+static void print_snippet(
+    const char* source, size_t source_length, size_t offset, FILE* stream
+)
+{
+    const size_t max_length = 48;
+    int depth = 0;
+    size_t printed = 0;
+    for (size_t i = offset; i < source_length; ++i) {
+        char c = source[i];
+        if (c != '+' && c != '-' && c != '<' && c != '>' && c != '.'
+            && c != ',' && c != '[' && c != ']') {
+            continue;
+        }
+        if (printed == max_length) {
+            fputs("...", stream);
+            return;
+        }
+        fputc(c, stream);
+        printed += 1;
+        if (c == '[') {
+            depth += 1;
+        } else if (c == ']') {
+            depth -= 1;
+            if (depth == 0) {
+                return;
+            }
+        }
+    }
+}
+
+void profile_report(
+    const Profile* profile,
+    const char* source,
+    size_t source_length,
+    size_t top_n,
+    FILE* stream
+)
+{
+    int* ids = malloc(sizeof(int) * (profile->length + 1));
+    for (size_t i = 0; i < profile->length; ++i) {
+        ids[i] = (int)i;
+    }
+    sorting_profile = profile;
+    qsort(ids, profile->length, sizeof(int), compare_loop_ids);
+
+    fprintf(stream, "profile: top %zu loops by iterations\n", top_n);
+    fprintf(
+        stream,
+        "  %4s %14s %12s %10s  %s\n",
+        "#",
+        "iterations",
+        "entries",
+        "line:col",
+        "source"
+    );
+    for (size_t i = 0; i < profile->length && i < top_n; ++i) {
+        int id = ids[i];
+        SourceLoc loc = profile->loops[id];
+        char position[32];
+        snprintf(position, sizeof(position), "%d:%d", loc.line, loc.column);
+        fprintf(
+            stream,
+            "  %4zu %14" PRIu64 " %12" PRIu64 " %10s  ",
+            i + 1,
+            profile_iterations(profile, id),
+            profile_entries(profile, id),
+            position
+        );
+        if (source != NULL) {
+            print_snippet(source, source_length, loc.offset, stream);
+        }
+        fputc('\n', stream);
+    }
+    free(ids);
+}
+
+/*
+ *  recorded profiles
+ *
+ *  Loop statistics persisted between runs, keyed by the hash of the source
+ *  text. Loops are identified by the source offset of their opening bracket,
+ *  which stays stable when the optimizer changes.
+ *
+ */
+
+uint64_t profile_hash_source(const char* source, size_t length)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (uint8_t)source[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+void profile_data_construct(ProfileData* data, uint64_t source_hash)
+{
+    *data = (ProfileData) {
+        .source_hash = source_hash,
+        .data = malloc(sizeof(ProfileRecord) * 8),
+        .length = 0,
+        .capacity = 8,
+    };
+}
+
+void profile_data_destroy(ProfileData* data) { free(data->data); }
+
+static void profile_data_push(ProfileData* data, ProfileRecord record)
+{
+    if (data->length + 1 > data->capacity) {
+        data->capacity *= 2;
+        data->data
+            = realloc(data->data, sizeof(ProfileRecord) * data->capacity);
+    }
+    data->data[data->length] = record;
+    data->length += 1;
+}
+
+static int compare_records(const void* a, const void* b)
+{
+    size_t lhs = ((const ProfileRecord*)a)->offset;
+    size_t rhs = ((const ProfileRecord*)b)->offset;
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+// sorts by offset and sums up records with the same offset
+static void profile_data_coalesce(ProfileData* data)
+{
+    qsort(data->data, data->length, sizeof(ProfileRecord), compare_records);
+    size_t length = 0;
+    for (size_t i = 0; i < data->length; ++i) {
+        ProfileRecord* last = length > 0 ? &data->data[length - 1] : NULL;
+        if (last != NULL && last->offset == data->data[i].offset) {
+            last->entries += data->data[i].entries;
+            last->iterations += data->data[i].iterations;
+        } else {
+            data->data[length] = data->data[i];
+            length += 1;
+        }
+    }
+    data->length = length;
+}
+
+void profile_data_merge(ProfileData* data, const Profile* profile)
+{
+    for (size_t id = 0; id < profile->length; ++id) {
+        profile_data_push(
+            data,
+            (ProfileRecord) {
+                .offset = profile->loops[id].offset,
+                .entries = profile_entries(profile, (int)id),
+                .iterations = profile_iterations(profile, (int)id),
+            }
+        );
+    }
+    profile_data_coalesce(data);
+}
+
+const ProfileRecord* profile_data_find(const ProfileData* data, size_t offset)
+{
+    ProfileRecord key = { .offset = offset };
+    return bsearch(
+        &key, data->data, data->length, sizeof(ProfileRecord), compare_records
+    );
+}
+
+/*
+ *  profile file
+ *
+ *  bfjit-profile 1 <source hash>
+ *  <offset> <entries> <iterations>
+ *  ...
+ *
+ */
+
+bool profile_data_load(ProfileData* data, const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    int version;
+    uint64_t source_hash;
+    if (fscanf(file, "bfjit-profile %d %" SCNx64, &version, &source_hash) != 2
+        || version != 1 || source_hash != data->source_hash) {
+        fclose(file);
+        return false;
+    }
+    ProfileRecord record;
+    while (fscanf(
+               file,
+               "%zu %" SCNu64 " %" SCNu64,
+               &record.offset,
+               &record.entries,
+               &record.iterations
+           )
+           == 3) {
+        profile_data_push(data, record);
+    }
+    fclose(file);
+    profile_data_coalesce(data);
+    return true;
+}
+
+bool profile_data_save(const ProfileData* data, const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "bfjit-profile 1 %016" PRIx64 "\n", data->source_hash);
+    for (size_t i = 0; i < data->length; ++i) {
+        const ProfileRecord* record = &data->data[i];
+        fprintf(
+            file,
+            "%zu %" PRIu64 " %" PRIu64 "\n",
+            record->offset,
+            record->entries,
+            record->iterations
+        );
+    }
+    fclose(file);
+    return true;
+}
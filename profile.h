@@ -0,0 +1,57 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "expr.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// counters are laid out as [entries, iterations] per loop id
+#define PROFILE_COUNTERS_PER_LOOP 2
+#define PROFILE_ENTRIES 0
+#define PROFILE_ITERATIONS 1
+
+typedef struct {
+    SourceLoc* loops;
+    size_t length;
+    size_t capacity;
+    uint64_t* counters;
+} Profile;
+
+void profile_construct(Profile* profile);
+void profile_destroy(Profile* profile);
+int profile_add_loop(Profile* profile, SourceLoc loc);
+void profile_allocate_counters(Profile* profile);
+uint64_t profile_entries(const Profile* profile, int loop_id);
+uint64_t profile_iterations(const Profile* profile, int loop_id);
+void profile_report(
+    const Profile* profile,
+    const char* source,
+    size_t source_length,
+    size_t top_n,
+    FILE* stream
+);
+
+typedef struct {
+    size_t offset;
+    uint64_t entries;
+    uint64_t iterations;
+} ProfileRecord;
+
+typedef struct {
+    uint64_t source_hash;
+    ProfileRecord* data;
+    size_t length;
+    size_t capacity;
+} ProfileData;
+
+uint64_t profile_hash_source(const char* source, size_t length);
+void profile_data_construct(ProfileData* data, uint64_t source_hash);
+void profile_data_destroy(ProfileData* data);
+void profile_data_merge(ProfileData* data, const Profile* profile);
+const ProfileRecord* profile_data_find(const ProfileData* data, size_t offset);
+bool profile_data_load(ProfileData* data, const char* path);
+bool profile_data_save(const ProfileData* data, const char* path);
+
+#endif
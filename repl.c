@@ -0,0 +1,290 @@
+#include "repl.h"
+#include "bfjit.h"
+#include "emitter.h"
+#include "runtime.h"
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ *  repl mode
+ *
+ *  Source is read a line at a time and collected until its brackets
+ *  balance. Every such chunk is compiled on its own and run right away, on
+ *  a tape and at a tape pointer that carry over from one chunk to the next.
+ *  A chunk's code makes no assumptions about the tape, so it is compiled
+ *  exactly as a whole program would be. The code is appended to one code
+ *  region reserved for the session, instead of getting a mapping of its
+ *  own, and stays there until the session ends. With a fuel budget, a
+ *  chunk that runs out of fuel stops where it was, and the session goes
+ *  on from there.
+ *
+ *  Input for ',' is read from the same stream as the source, right after
+ *  the line that completed the chunk.
+ *
+ */
+
+#define REPL_TAPE_CELLS 30000
+#define REPL_TAPE_RESERVE ((size_t)1 << 30)
+#define REPL_CODE_REGION_SIZE ((size_t)256 << 20)
+
+/*
+ *  session tape
+ *
+ *  The tape lives in a reservation of address space that is inaccessible
+ *  except for the cells in use, with a guard page on either side. A chunk
+ *  that reaches past the accessible cells faults, and the fault handler
+ *  makes the tape at least twice as large and lets the access run again,
+ *  so the tape grows as far as the reservation goes. A fault in a guard
+ *  page, below the first cell or past the reservation, stops the chunk:
+ *  its tape pointer goes back to where the chunk started, and what it
+ *  wrote until then stays on the tape.
+ *
+ */
+
+typedef struct {
+    BfjitTape tape;
+    // the guard page below the first cell
+    uint8_t* base;
+    // the largest size the tape can grow to
+    size_t limit;
+    size_t page_size;
+    // faults are only handled while a chunk runs
+    volatile sig_atomic_t running;
+    sigjmp_buf stop_jump;
+    struct sigaction previous_action;
+} ReplTape;
+
+static ReplTape* repl_active_tape = NULL;
+
+static bool repl_tape_grow(ReplTape* tape, size_t size)
+{
+    if (size > tape->limit) {
+        return false;
+    }
+    if (size < tape->tape.size * 2) {
+        size = tape->tape.size * 2;
+    }
+    size = (size + tape->page_size - 1) / tape->page_size * tape->page_size;
+    if (size > tape->limit) {
+        size = tape->limit;
+    }
+    uint8_t* end = tape->tape.data + tape->tape.size;
+    if (mprotect(end, size - tape->tape.size, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    tape->tape.size = size;
+    return true;
+}
+
+static void repl_tape_fault(int signal, siginfo_t* info, void* context)
+{
+    (void)signal;
+    (void)context;
+    ReplTape* tape = repl_active_tape;
+    uint8_t* address = info->si_addr;
+    if (tape->running && address >= tape->base
+        && address < tape->tape.data + tape->limit + tape->page_size) {
+        if (address >= tape->tape.data + tape->tape.size
+            && repl_tape_grow(
+                tape, (size_t)(address - tape->tape.data) + 1
+            )) {
+            return;
+        }
+        tape->running = 0;
+        siglongjmp(tape->stop_jump, 1);
+    }
+    // not a tape access, crash as usual once the access runs again
+    sigaction(SIGSEGV, &tape->previous_action, NULL);
+}
+
+static void repl_tape_construct(ReplTape* tape, size_t size)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    uint8_t* base = mmap(
+        NULL,
+        REPL_TAPE_RESERVE + 2 * page_size,
+        PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "panic: could not mmap\n");
+        exit(1);
+    }
+    *tape = (ReplTape) {
+        .tape = {
+            .data = base + page_size,
+            .size = 0,
+            .dirty = 0,
+        },
+        .base = base,
+        .limit = REPL_TAPE_RESERVE,
+        .page_size = page_size,
+        .running = 0,
+    };
+    if (!repl_tape_grow(tape, size)) {
+        fprintf(stderr, "panic: could not mprotect\n");
+        exit(1);
+    }
+
+    struct sigaction action = {
+        .sa_sigaction = repl_tape_fault,
+        .sa_flags = SA_SIGINFO,
+    };
+    sigemptyset(&action.sa_mask);
+    repl_active_tape = tape;
+    sigaction(SIGSEGV, &action, &tape->previous_action);
+}
+
+static void repl_tape_destroy(ReplTape* tape)
+{
+    sigaction(SIGSEGV, &tape->previous_action, NULL);
+    repl_active_tape = NULL;
+    munmap(tape->base, tape->limit + 2 * tape->page_size);
+}
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} ReplChunk;
+
+static void repl_chunk_append(ReplChunk* chunk, const char* text, size_t length)
+{
+    if (chunk->length + length > chunk->capacity) {
+        chunk->capacity = chunk->capacity == 0 ? 64 : chunk->capacity;
+        while (chunk->length + length > chunk->capacity) {
+            chunk->capacity *= 2;
+        }
+        chunk->data = realloc(chunk->data, chunk->capacity);
+    }
+    memcpy(&chunk->data[chunk->length], text, length);
+    chunk->length += length;
+}
+
+static void repl_run_chunk(
+    const ReplChunk* chunk,
+    const BfjitOptions* options,
+    RuntimeStreams* streams,
+    ReplTape* tape,
+    size_t* position
+)
+{
+    BfjitProgram program;
+    if (!bfjit_compile(&program, chunk->data, chunk->length, options)) {
+        fprintf(stderr, "error: could not compile chunk\n");
+        return;
+    }
+    BfjitIo io = bfjit_stdio(streams);
+    size_t start = *position;
+    if (sigsetjmp(tape->stop_jump, 1) != 0) {
+        fflush(stdout);
+        fprintf(
+            stderr,
+            "error: chunk moved off the tape, tape pointer reset to %zu\n",
+            start / (size_t)options->cell_width
+        );
+        *position = start;
+        tape->tape.dirty = tape->tape.size;
+        bfjit_program_destroy(&program);
+        return;
+    }
+    tape->running = 1;
+    RunStatus status = bfjit_run_at(&program, &tape->tape, &io, position);
+    tape->running = 0;
+    fflush(stdout);
+    if (status == RunStatus_OutOfFuel) {
+        fprintf(
+            stderr,
+            "error: out of fuel after %llu loop iterations\n",
+            (unsigned long long)options->fuel
+        );
+    }
+    bfjit_program_destroy(&program);
+}
+
+void repl_run(FILE* input, const BfjitOptions* options)
+{
+    CodeRegion region;
+    code_region_construct(&region, REPL_CODE_REGION_SIZE);
+    BfjitOptions chunk_options = *options;
+    chunk_options.shared = false;
+    chunk_options.resumable = false;
+    chunk_options.region = &region;
+    RuntimeStreams streams = {
+        .input = input,
+        .output = stdout,
+    };
+    ReplTape tape;
+    repl_tape_construct(&tape, REPL_TAPE_CELLS * (size_t)options->cell_width);
+    size_t position = 0;
+
+    bool interactive = isatty(fileno(input));
+    ReplChunk chunk = {
+        .data = NULL,
+        .length = 0,
+        .capacity = 0,
+    };
+    int depth = 0;
+    bool has_commands = false;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    while (true) {
+        if (interactive) {
+            fputs(chunk.length == 0 ? "bf> " : "... ", stderr);
+        }
+        ssize_t line_length = getline(&line, &line_capacity, input);
+        if (line_length < 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < line_length && depth >= 0; ++i) {
+            if (strchr("+-<>.,[]", line[i]) == NULL) {
+                continue;
+            }
+            has_commands = true;
+            if (line[i] == '[') {
+                depth += 1;
+            } else if (line[i] == ']') {
+                depth -= 1;
+            }
+        }
+        if (depth < 0) {
+            fprintf(stderr, "error: unmatched ']', chunk discarded\n");
+            chunk.length = 0;
+            depth = 0;
+            has_commands = false;
+            continue;
+        }
+        repl_chunk_append(&chunk, line, (size_t)line_length);
+        if (depth > 0) {
+            continue;
+        }
+        if (has_commands) {
+            repl_run_chunk(
+                &chunk, &chunk_options, &streams, &tape, &position
+            );
+        }
+        chunk.length = 0;
+        has_commands = false;
+    }
+    if (depth > 0) {
+        fprintf(stderr, "error: unmatched '[' at end of input\n");
+    }
+    if (interactive) {
+        fputc('\n', stderr);
+    }
+
+    free(line);
+    free(chunk.data);
+    repl_tape_destroy(&tape);
+    code_region_destroy(&region);
+}
@@ -0,0 +1,9 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include "bfjit.h"
+#include <stdio.h>
+
+void repl_run(FILE* input, const BfjitOptions* options);
+
+#endif
@@ -0,0 +1,123 @@
+#include "rewrite.h"
+#include "expr.h"
+#include "optimizer.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *  rewrite engine
+ *
+ *  Rules match a sequence of nodes ending at the top of the output, loops
+ *  can additionally be matched by the shape of their body. A guard checks
+ *  whatever the types alone cannot express and the build function emits the
+ *  replacement.
+ *
+ *  The tree is rewritten in one bottom-up traversal. Loop bodies are
+ *  rewritten before the loop itself is pushed, and the output doubles as the
+ *  worklist: after a rule fires, its replacement is pushed node by node and
+ *  matched again, so a rewrite that makes two nodes adjacent is picked up
+ *  right away instead of in another pass over the whole tree.
+ *
+ */
+
+static bool rewrite_element_matches(
+    const RewriteElement* element, const Expr* expr
+)
+{
+    if ((element->types & EXPR_TYPE_BIT(expr->type)) == 0) {
+        return false;
+    }
+    if (expr->type != ExprType_Loop || element->body_length == 0) {
+        return true;
+    }
+    if (expr->exprs.length != element->body_length) {
+        return false;
+    }
+    for (size_t i = 0; i < element->body_length; ++i) {
+        if ((element->body[i] & EXPR_TYPE_BIT(expr->exprs.data[i].type))
+            == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool rewrite_rule_matches(
+    const RewriteRule* rule,
+    const ExprVec* exprs,
+    const OptimizerOptions* options
+)
+{
+    if (exprs->length < rule->pattern_length) {
+        return false;
+    }
+    const Expr* match = &exprs->data[exprs->length - rule->pattern_length];
+    for (size_t i = 0; i < rule->pattern_length; ++i) {
+        if (!rewrite_element_matches(&rule->pattern[i], &match[i])) {
+            return false;
+        }
+    }
+    return rule->guard == NULL || rule->guard(match, options);
+}
+
+static void rewrite_push(
+    ExprVec* exprs,
+    Expr expr,
+    const RewriteRule* const* rules,
+    size_t rules_length,
+    const OptimizerOptions* options
+)
+{
+    expr_vec_push(exprs, expr);
+    for (size_t i = 0; i < rules_length; ++i) {
+        const RewriteRule* rule = rules[i];
+        if (!rewrite_rule_matches(rule, exprs, options)) {
+            continue;
+        }
+        size_t start = exprs->length - rule->pattern_length;
+        ExprVec replacement;
+        expr_vec_construct(&replacement);
+        rule->build(&exprs->data[start], &replacement, options);
+        while (exprs->length > start) {
+            Expr matched = expr_vec_pop(exprs);
+            expr_free(&matched);
+        }
+        for (size_t j = 0; j < replacement.length; ++j) {
+            rewrite_push(
+                exprs, replacement.data[j], rules, rules_length, options
+            );
+        }
+        expr_vec_destroy(&replacement);
+        return;
+    }
+}
+
+ExprVec rewrite_apply(
+    const ExprVec* vec,
+    const RewriteRule* const* rules,
+    size_t rules_length,
+    const OptimizerOptions* options
+)
+{
+    ExprVec exprs;
+    expr_vec_construct(&exprs);
+    for (size_t i = 0; i < vec->length; ++i) {
+        const Expr* expr = &vec->data[i];
+        Expr rewritten;
+        // a divmod keeps its original loop as a fallback, which would just
+        // be recognized again
+        if (expr->type == ExprType_Loop || expr->type == ExprType_If) {
+            rewritten = (Expr) {
+                .type = expr->type,
+                .loc = expr->loc,
+                .exprs
+                = rewrite_apply(&expr->exprs, rules, rules_length, options),
+            };
+        } else {
+            rewritten = expr_clone(expr);
+        }
+        rewrite_push(&exprs, rewritten, rules, rules_length, options);
+    }
+    return exprs;
+}
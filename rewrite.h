@@ -0,0 +1,43 @@
+#ifndef REWRITE_H
+#define REWRITE_H
+
+#include "expr.h"
+#include "optimizer.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EXPR_TYPE_BIT(TYPE) (1u << (TYPE))
+#define REWRITE_MAX_PATTERN 8
+
+typedef struct {
+    // bitmask of accepted types, see EXPR_TYPE_BIT
+    uint32_t types;
+    // loops only, the body has to be exactly these types, 0 accepts any body
+    size_t body_length;
+    uint32_t body[REWRITE_MAX_PATTERN];
+} RewriteElement;
+
+typedef bool (*RewriteGuard)(
+    const Expr* match, const OptimizerOptions* options
+);
+typedef void (*RewriteBuild)(
+    const Expr* match, ExprVec* replacement, const OptimizerOptions* options
+);
+
+typedef struct RewriteRule {
+    const char* name;
+    size_t pattern_length;
+    RewriteElement pattern[REWRITE_MAX_PATTERN];
+    RewriteGuard guard;
+    RewriteBuild build;
+} RewriteRule;
+
+ExprVec rewrite_apply(
+    const ExprVec* vec,
+    const RewriteRule* const* rules,
+    size_t rules_length,
+    const OptimizerOptions* options
+);
+
+#endif
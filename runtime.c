@@ -2,6 +2,16 @@
 #include <stdint.h>
 #include <stdio.h>
 
-uint8_t get_char(void) { return (uint8_t)fgetc(stdin); }
+// user points to the RuntimeStreams to use, or is NULL for stdin and stdout
 
-void put_char(uint8_t v) { fputc(v, stdout); }
+int runtime_read_stdio(void* user)
+{
+    RuntimeStreams* streams = user;
+    return getc_unlocked(streams != NULL ? streams->input : stdin);
+}
+
+void runtime_write_stdio(void* user, uint8_t value)
+{
+    RuntimeStreams* streams = user;
+    putc_unlocked(value, streams != NULL ? streams->output : stdout);
+}
@@ -1,9 +1,44 @@
 #ifndef RUNTIME_H
 #define RUNTIME_H
 
+#include <signal.h>
 #include <stdint.h>
+#include <stdio.h>
 
-uint8_t get_char(void);
-void put_char(uint8_t v);
+typedef int (*ReadCallback)(void* user);
+typedef void (*WriteCallback)(void* user, uint8_t value);
+
+// passed to compiled code in rsi and kept in r12, the emitter addresses the
+// fields by their offsets
+typedef struct {
+    ReadCallback read;
+    WriteCallback write;
+    void* user;
+    uint64_t* counters;
+    uint8_t* high_water;
+    // loop iterations left, only used by code compiled with fuel checks
+    uint64_t fuel;
+    // the tape pointer when the compiled code returned, or to resume at
+    uint8_t* position;
+    // where resumable code stopped, or is to be entered, 0 for the start
+    uint32_t resume_point;
+    // resumable code stops at the next input or output once this is set
+    const volatile sig_atomic_t* stop;
+} RunContext;
+
+// returned by compiled code in eax
+typedef enum {
+    RunStatus_Finished,
+    RunStatus_OutOfFuel,
+    RunStatus_Stopped,
+} RunStatus;
+
+typedef struct {
+    FILE* input;
+    FILE* output;
+} RuntimeStreams;
+
+int runtime_read_stdio(void* user);
+void runtime_write_stdio(void* user, uint8_t value);
 
 #endif
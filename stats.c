@@ -0,0 +1,287 @@
+#include "stats.h"
+#include "expr.h"
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+double stats_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+void stats_construct(Stats* stats)
+{
+    *stats = (Stats) {
+        .passes = malloc(sizeof(PassStats) * 8),
+        .passes_capacity = 8,
+        .iterations = malloc(sizeof(IterationStats) * 8),
+        .iterations_capacity = 8,
+    };
+}
+
+void stats_destroy(Stats* stats)
+{
+    free(stats->passes);
+    free(stats->iterations);
+}
+
+void stats_push_pass(Stats* stats, PassStats pass)
+{
+    if (stats->passes_length + 1 > stats->passes_capacity) {
+        stats->passes_capacity *= 2;
+        stats->passes = realloc(
+            stats->passes, sizeof(PassStats) * stats->passes_capacity
+        );
+    }
+    stats->passes[stats->passes_length] = pass;
+    stats->passes_length += 1;
+}
+
+void stats_push_iteration(Stats* stats, IterationStats iteration)
+{
+    if (stats->iterations_length + 1 > stats->iterations_capacity) {
+        stats->iterations_capacity *= 2;
+        stats->iterations = realloc(
+            stats->iterations,
+            sizeof(IterationStats) * stats->iterations_capacity
+        );
+    }
+    stats->iterations[stats->iterations_length] = iteration;
+    stats->iterations_length += 1;
+}
+
+static double ms(double seconds) { return seconds * 1e3; }
+
+void stats_print(const Stats* stats, FILE* stream)
+{
+    fprintf(stream, "stats:\n");
+    fprintf(
+        stream,
+        "  parse:    %10.3f ms  %zu nodes\n",
+        ms(stats->parse_seconds),
+        stats->parsed_nodes
+    );
+    for (size_t i = 0; i < stats->passes_length; ++i) {
+        const PassStats* pass = &stats->passes[i];
+        fprintf(
+            stream,
+            "    pass %d %-24s %10.3f ms  %zu -> %zu nodes\n",
+            pass->iteration,
+            pass->name,
+            ms(pass->seconds),
+            pass->nodes_before,
+            pass->nodes_after
+        );
+    }
+    for (size_t i = 0; i < stats->iterations_length; ++i) {
+        const IterationStats* iteration = &stats->iterations[i];
+        fprintf(
+            stream,
+            "    iteration %d %30.3f ms  %zu nodes\n",
+            iteration->iteration,
+            ms(iteration->seconds),
+            iteration->nodes_after
+        );
+    }
+    fprintf(
+        stream,
+        "  optimize: %10.3f ms  %zu nodes\n",
+        ms(stats->optimize_seconds),
+        stats->final_nodes
+    );
+    if (stats->compile_cache) {
+        fprintf(
+            stream,
+            "    compile cache  %zu loops reused, %zu optimized\n",
+            stats->compile_cache_hits,
+            stats->compile_cache_misses
+        );
+    }
+    fprintf(
+        stream,
+        "  emit:     %10.3f ms  %zu bytes\n",
+        ms(stats->emit_seconds),
+        stats->code_size
+    );
+    for (size_t type = 0; type < EXPR_TYPE_COUNT; ++type) {
+        if (stats->type_code_sizes[type] == 0) {
+            continue;
+        }
+        fprintf(
+            stream,
+            "    %-8s %zu bytes\n",
+            expr_type_name((ExprType)type),
+            stats->type_code_sizes[type]
+        );
+    }
+    fprintf(stream, "  run:      %10.3f ms\n", ms(stats->run_seconds));
+    if (stats->counters.available) {
+        fprintf(
+            stream,
+            "    instructions  %" PRIu64 "\n"
+            "    cycles        %" PRIu64 "\n"
+            "    branch misses %" PRIu64 "\n",
+            stats->counters.instructions,
+            stats->counters.cycles,
+            stats->counters.branch_misses
+        );
+    }
+}
+
+void stats_print_json(const Stats* stats, FILE* stream)
+{
+    fprintf(
+        stream,
+        "{\"parse\":{\"seconds\":%.9f,\"nodes\":%zu},\"passes\":[",
+        stats->parse_seconds,
+        stats->parsed_nodes
+    );
+    for (size_t i = 0; i < stats->passes_length; ++i) {
+        const PassStats* pass = &stats->passes[i];
+        fprintf(
+            stream,
+            "%s{\"name\":\"%s\",\"iteration\":%d,\"seconds\":%.9f,"
+            "\"nodes_before\":%zu,\"nodes_after\":%zu}",
+            i != 0 ? "," : "",
+            pass->name,
+            pass->iteration,
+            pass->seconds,
+            pass->nodes_before,
+            pass->nodes_after
+        );
+    }
+    fprintf(stream, "],\"iterations\":[");
+    for (size_t i = 0; i < stats->iterations_length; ++i) {
+        const IterationStats* iteration = &stats->iterations[i];
+        fprintf(
+            stream,
+            "%s{\"iteration\":%d,\"seconds\":%.9f,\"nodes\":%zu}",
+            i != 0 ? "," : "",
+            iteration->iteration,
+            iteration->seconds,
+            iteration->nodes_after
+        );
+    }
+    fprintf(
+        stream,
+        "],\"optimize\":{\"seconds\":%.9f,\"nodes\":%zu",
+        stats->optimize_seconds,
+        stats->final_nodes
+    );
+    if (stats->compile_cache) {
+        fprintf(
+            stream,
+            ",\"compile_cache\":{\"hits\":%zu,\"misses\":%zu}",
+            stats->compile_cache_hits,
+            stats->compile_cache_misses
+        );
+    }
+    fprintf(
+        stream,
+        "},\"emit\":{\"seconds\":%.9f,\"code_size\":%zu,"
+        "\"code_size_by_type\":{",
+        stats->emit_seconds,
+        stats->code_size
+    );
+    bool first = true;
+    for (size_t type = 0; type < EXPR_TYPE_COUNT; ++type) {
+        if (stats->type_code_sizes[type] == 0) {
+            continue;
+        }
+        fprintf(
+            stream,
+            "%s\"%s\":%zu",
+            first ? "" : ",",
+            expr_type_name((ExprType)type),
+            stats->type_code_sizes[type]
+        );
+        first = false;
+    }
+    fprintf(stream, "}},\"run\":{\"seconds\":%.9f", stats->run_seconds);
+    if (stats->counters.available) {
+        fprintf(
+            stream,
+            ",\"instructions\":%" PRIu64 ",\"cycles\":%" PRIu64
+            ",\"branch_misses\":%" PRIu64,
+            stats->counters.instructions,
+            stats->counters.cycles,
+            stats->counters.branch_misses
+        );
+    }
+    fprintf(stream, "}}\n");
+}
+
+static int perf_event_open_counter(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+bool hardware_counters_open(HardwareCounterGroup* group)
+{
+    group->instructions = perf_event_open_counter(PERF_COUNT_HW_INSTRUCTIONS);
+    group->cycles = perf_event_open_counter(PERF_COUNT_HW_CPU_CYCLES);
+    group->branch_misses
+        = perf_event_open_counter(PERF_COUNT_HW_BRANCH_MISSES);
+    if (group->instructions < 0 || group->cycles < 0
+        || group->branch_misses < 0) {
+        hardware_counters_close(group);
+        return false;
+    }
+    return true;
+}
+
+void hardware_counters_start(HardwareCounterGroup* group)
+{
+    ioctl(group->instructions, PERF_EVENT_IOC_RESET, 0);
+    ioctl(group->cycles, PERF_EVENT_IOC_RESET, 0);
+    ioctl(group->branch_misses, PERF_EVENT_IOC_RESET, 0);
+    ioctl(group->instructions, PERF_EVENT_IOC_ENABLE, 0);
+    ioctl(group->cycles, PERF_EVENT_IOC_ENABLE, 0);
+    ioctl(group->branch_misses, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+void hardware_counters_stop(HardwareCounterGroup* group, HardwareCounters* out)
+{
+    ioctl(group->instructions, PERF_EVENT_IOC_DISABLE, 0);
+    ioctl(group->cycles, PERF_EVENT_IOC_DISABLE, 0);
+    ioctl(group->branch_misses, PERF_EVENT_IOC_DISABLE, 0);
+    out->available
+        = read(group->instructions, &out->instructions, sizeof(uint64_t))
+            == sizeof(uint64_t)
+        && read(group->cycles, &out->cycles, sizeof(uint64_t))
+            == sizeof(uint64_t)
+        && read(group->branch_misses, &out->branch_misses, sizeof(uint64_t))
+            == sizeof(uint64_t);
+}
+
+void hardware_counters_close(HardwareCounterGroup* group)
+{
+    if (group->instructions >= 0) {
+        close(group->instructions);
+    }
+    if (group->cycles >= 0) {
+        close(group->cycles);
+    }
+    if (group->branch_misses >= 0) {
+        close(group->branch_misses);
+    }
+    *group = (HardwareCounterGroup) { -1, -1, -1 };
+}
@@ -0,0 +1,72 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "expr.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+    const char* name;
+    int iteration;
+    double seconds;
+    size_t nodes_before;
+    size_t nodes_after;
+} PassStats;
+
+typedef struct {
+    int iteration;
+    double seconds;
+    size_t nodes_after;
+} IterationStats;
+
+typedef struct {
+    bool available;
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t branch_misses;
+} HardwareCounters;
+
+typedef struct {
+    double parse_seconds;
+    size_t parsed_nodes;
+    PassStats* passes;
+    size_t passes_length;
+    size_t passes_capacity;
+    IterationStats* iterations;
+    size_t iterations_length;
+    size_t iterations_capacity;
+    double optimize_seconds;
+    size_t final_nodes;
+    // loops reused from a compile cache file, and loops optimized anew
+    bool compile_cache;
+    size_t compile_cache_hits;
+    size_t compile_cache_misses;
+    double emit_seconds;
+    size_t code_size;
+    size_t type_code_sizes[EXPR_TYPE_COUNT];
+    double run_seconds;
+    HardwareCounters counters;
+} Stats;
+
+double stats_now(void);
+void stats_construct(Stats* stats);
+void stats_destroy(Stats* stats);
+void stats_push_pass(Stats* stats, PassStats pass);
+void stats_push_iteration(Stats* stats, IterationStats iteration);
+void stats_print(const Stats* stats, FILE* stream);
+void stats_print_json(const Stats* stats, FILE* stream);
+
+typedef struct {
+    int instructions;
+    int cycles;
+    int branch_misses;
+} HardwareCounterGroup;
+
+bool hardware_counters_open(HardwareCounterGroup* group);
+void hardware_counters_start(HardwareCounterGroup* group);
+void hardware_counters_stop(HardwareCounterGroup* group, HardwareCounters* out);
+void hardware_counters_close(HardwareCounterGroup* group);
+
+#endif
@@ -0,0 +1,227 @@
+#include "stream.h"
+#include "emitter.h"
+#include "expr.h"
+#include "optimizer.h"
+#include "parser.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ *  streaming compile
+ *
+ *  The source is compiled in one pass as it is read, without building the
+ *  tree for the whole program. Nodes that have been read but not emitted
+ *  are held in a window of at most STREAM_WINDOW_NODES nodes. Loops that
+ *  close while their whole body is still in the window are optimized and
+ *  emitted like any other loop, so idioms such as clear, copy and multiply
+ *  loops are found. When the window is full, the outermost loop still held
+ *  in it is emitted as an open loop: the code read so far in front of it is
+ *  optimized and emitted, then its head, and its body follows as it is
+ *  read. Apart from the window, only the stack of open brackets is kept.
+ *
+ *  Runs of the same command are folded as they are read, so that long runs
+ *  do not fill the window.
+ *
+ */
+
+#define STREAM_WINDOW_NODES 4096
+#define STREAM_MAX_RUN (1 << 20)
+
+typedef struct {
+    SourceLoc loc;
+    // read but not emitted yet
+    ExprVec body;
+    // set once the head is emitted
+    bool open;
+    size_t body_pos;
+} StreamFrame;
+
+typedef struct {
+    Emitter* emitter;
+    const OptimizerPipeline* pipeline;
+    const OptimizerOptions* options;
+    // the first frame is the top level, which is always open
+    StreamFrame* frames;
+    size_t frames_length;
+    size_t frames_capacity;
+    // frames from this index on are not open
+    size_t first_closed;
+    // nodes in the window
+    size_t buffered;
+} Stream;
+
+static void stream_push_frame(Stream* stream, SourceLoc loc, bool open)
+{
+    if (stream->frames_length + 1 > stream->frames_capacity) {
+        stream->frames_capacity
+            = stream->frames_capacity == 0 ? 8 : stream->frames_capacity * 2;
+        stream->frames = realloc(
+            stream->frames, sizeof(StreamFrame) * stream->frames_capacity
+        );
+    }
+    StreamFrame* frame = &stream->frames[stream->frames_length];
+    *frame = (StreamFrame) {
+        .loc = loc,
+        .open = open,
+        .body_pos = 0,
+    };
+    expr_vec_construct(&frame->body);
+    stream->frames_length += 1;
+}
+
+static void stream_push(Stream* stream, Expr expr)
+{
+    ExprVec* body = &stream->frames[stream->frames_length - 1].body;
+    bool foldable = expr.type == ExprType_Incr || expr.type == ExprType_Decr
+        || expr.type == ExprType_Left || expr.type == ExprType_Right;
+    if (foldable && body->length > 0) {
+        Expr* last = &body->data[body->length - 1];
+        if (last->type == expr.type && last->value < STREAM_MAX_RUN) {
+            last->value += expr.value;
+            return;
+        }
+    }
+    expr_vec_push(body, expr);
+    stream->buffered += 1;
+}
+
+// optimizes and emits the nodes the frame holds
+static void stream_emit_body(Stream* stream, StreamFrame* frame)
+{
+    ExprVec optimized = optimize_program(
+        &frame->body, stream->pipeline, stream->options, NULL
+    );
+    emitter_emit_expr_vec(stream->emitter, &optimized);
+    expr_vec_free(&optimized);
+    stream->buffered -= expr_vec_count_nodes(&frame->body);
+    expr_vec_free(&frame->body);
+    expr_vec_construct(&frame->body);
+}
+
+// makes room in the window
+static void stream_flush(Stream* stream)
+{
+    if (stream->first_closed < stream->frames_length) {
+        StreamFrame* frame = &stream->frames[stream->first_closed];
+        stream_emit_body(stream, &stream->frames[stream->first_closed - 1]);
+        frame->body_pos = emitter_emit_loop_open(stream->emitter, frame->loc);
+        frame->open = true;
+        stream->first_closed += 1;
+    } else {
+        stream_emit_body(stream, &stream->frames[stream->frames_length - 1]);
+    }
+}
+
+static bool stream_close_loop(Stream* stream)
+{
+    if (stream->frames_length == 1) {
+        return false;
+    }
+    stream->frames_length -= 1;
+    StreamFrame frame = stream->frames[stream->frames_length];
+    if (frame.open) {
+        stream_emit_body(stream, &frame);
+        expr_vec_destroy(&frame.body);
+        emitter_emit_loop_close(stream->emitter, frame.body_pos);
+        stream->first_closed = stream->frames_length;
+        return true;
+    }
+    ExprVec* body = &stream->frames[stream->frames_length - 1].body;
+    expr_vec_push(
+        body,
+        (Expr) { .type = ExprType_Loop, .loc = frame.loc, .exprs = frame.body }
+    );
+    stream->buffered += 1;
+    return true;
+}
+
+// emits the code of the program read from the lexer, between the prologue
+// and the epilogue, and returns false at the first unmatched bracket
+bool stream_compile(
+    Emitter* emitter,
+    Lexer* lexer,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    SourceLoc* error_loc
+)
+{
+    Stream stream = {
+        .emitter = emitter,
+        .pipeline = pipeline,
+        .options = options,
+        .frames = NULL,
+        .frames_length = 0,
+        .frames_capacity = 0,
+        .first_closed = 1,
+        .buffered = 0,
+    };
+    stream_push_frame(&stream, lexer->loc, true);
+    bool balanced = true;
+    Token token;
+    while (balanced && (token = lexer_next(lexer)) != Token_Eof) {
+        SourceLoc loc = lexer->token_loc;
+        switch (token) {
+            case Token_Plus:
+                stream_push(
+                    &stream,
+                    (Expr) { .type = ExprType_Incr, .loc = loc, .value = 1 }
+                );
+                break;
+            case Token_Minus:
+                stream_push(
+                    &stream,
+                    (Expr) { .type = ExprType_Decr, .loc = loc, .value = 1 }
+                );
+                break;
+            case Token_LT:
+                stream_push(
+                    &stream,
+                    (Expr) { .type = ExprType_Left, .loc = loc, .value = 1 }
+                );
+                break;
+            case Token_GT:
+                stream_push(
+                    &stream,
+                    (Expr) { .type = ExprType_Right, .loc = loc, .value = 1 }
+                );
+                break;
+            case Token_Dot:
+                stream_push(
+                    &stream, (Expr) { .type = ExprType_Output, .loc = loc }
+                );
+                break;
+            case Token_Comma:
+                stream_push(
+                    &stream, (Expr) { .type = ExprType_Input, .loc = loc }
+                );
+                break;
+            case Token_LBracket:
+                stream_push_frame(&stream, loc, false);
+                break;
+            case Token_RBracket:
+                balanced = stream_close_loop(&stream);
+                if (!balanced) {
+                    *error_loc = loc;
+                }
+                break;
+            case Token_Eof:
+                break;
+        }
+        while (stream.buffered > STREAM_WINDOW_NODES) {
+            stream_flush(&stream);
+        }
+    }
+    if (balanced && stream.frames_length > 1) {
+        balanced = false;
+        *error_loc = stream.frames[stream.frames_length - 1].loc;
+    }
+    if (balanced) {
+        stream_emit_body(&stream, &stream.frames[0]);
+    }
+    for (size_t i = 0; i < stream.frames_length; ++i) {
+        expr_vec_free(&stream.frames[i].body);
+    }
+    free(stream.frames);
+    return balanced;
+}
@@ -0,0 +1,18 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "emitter.h"
+#include "expr.h"
+#include "optimizer.h"
+#include "parser.h"
+#include <stdbool.h>
+
+bool stream_compile(
+    Emitter* emitter,
+    Lexer* lexer,
+    const OptimizerPipeline* pipeline,
+    const OptimizerOptions* options,
+    SourceLoc* error_loc
+);
+
+#endif